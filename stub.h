@@ -20,7 +20,11 @@
 #ifndef __USBIP_STUB_H
 #define __USBIP_STUB_H
 
+#include <linux/hrtimer.h>
+#include <linux/kref.h>
 #include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/scatterlist.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
@@ -32,6 +36,102 @@
 #define STUB_BUSID_ADDED 2
 #define STUB_BUSID_ALLOC 3
 
+#define STUB_POOL_URB_CLASSES 4
+#define STUB_POOL_BUF_CLASSES 5
+
+/* a transfer buffer allocated with usb_alloc_coherent() */
+struct stub_dma_buf {
+	struct list_head list;
+	void *vaddr;
+	dma_addr_t dma;
+	size_t size;
+};
+
+/* recycled requests and transfer buffers of a stub device, see stub_pool.c */
+struct stub_pool {
+	spinlock_t lock;
+
+	/* buffers are placed on the node of the host controller */
+	struct usb_device *udev;
+	int node;
+
+	struct list_head urbs[STUB_POOL_URB_CLASSES];
+	int nr_urbs[STUB_POOL_URB_CLASSES];
+
+	struct list_head bufs[STUB_POOL_BUF_CLASSES];
+	int nr_bufs[STUB_POOL_BUF_CLASSES];
+
+	unsigned long urb_hit;
+	unsigned long urb_miss;
+	unsigned long buf_hit;
+	unsigned long buf_miss;
+
+	/*
+	 * Optional pre-mapped buffers. At most dma_bufs of dma_size bytes are
+	 * allocated; they are only freed by stub_pool_dma_release() since
+	 * stub_pool_put_priv() may run with interrupts disabled. The settings
+	 * may change at any time; a buffer remembers its own size.
+	 */
+	unsigned int dma;
+	unsigned int dma_size;
+	unsigned int dma_bufs;
+	int nr_dma;
+	struct list_head dma_free;
+	unsigned long dma_hit;
+	unsigned long dma_miss;
+};
+
+/* default geometry of the pre-mapped buffers */
+#define STUB_DMA_BUFS		32
+#define STUB_DMA_SIZE		(128 * 1024)
+
+/* tx queues of completed urbs, highest priority first */
+#define STUB_TX_Q_CTRL	0
+#define STUB_TX_Q_INT	1
+#define STUB_TX_Q_ISOC	2
+#define STUB_TX_Q_BULK	3
+#define STUB_TX_QUEUES	4
+
+/* what stub_tx did with the results of one transfer type */
+struct stub_tx_stats {
+	unsigned long urbs;
+	/* from completion to being queued for the socket */
+	unsigned long long delay_us;
+	unsigned int max_delay_us;
+	/* held back by the shaper */
+	unsigned long long throttled_bytes;
+};
+
+/* tx schedulers */
+#define STUB_TX_SCHED_FIFO	0
+#define STUB_TX_SCHED_PRIO	1
+
+/*
+ * What CMD_SUBMIT needs to know about an endpoint, precomputed from its
+ * descriptor. allowed is the transfer_flags mask of masking_bogus_flags(),
+ * indexed by whether the transfer is out; it only differs for control
+ * endpoints, where the direction comes from the setup packet. type is -1
+ * if the endpoint does not exist in the current configuration.
+ */
+struct stub_ep {
+	unsigned int pipe;
+	int type;
+	int maxpacket;
+	unsigned int allowed[2];
+	int tweak;
+	int merge;
+
+	/* bulk streams the endpoint supports on a SuperSpeed device */
+	struct usb_host_endpoint *hep;
+	unsigned int max_streams;
+};
+
+#define STUB_EP_MAX	16
+
+/* bounds of one merged bulk out transfer */
+#define STUB_MERGE_MAX_URBS	32
+#define STUB_MERGE_MAX_BYTES	(64 * 1024)
+
 struct stub_device {
 	struct usb_interface *interface;
 	struct usb_device *udev;
@@ -41,18 +141,23 @@ struct stub_device {
 
 	/*
 	 * stub_priv preserves private data of each urb.
-	 * It is allocated as stub_priv_cache and assigned to urb->context.
+	 * It is taken from the device pool (see stub_pool.c) and assigned to
+	 * urb->context.
 	 *
 	 * stub_priv is always linked to any one of 4 lists;
 	 *	priv_init: linked to this until the comletion of a urb.
 	 *	priv_tx  : linked to this after the completion of a urb.
 	 *	priv_free: linked to this after the sending of the result.
 	 *
-	 * Any of these list operations should be locked by priv_lock.
+	 * Any of these list operations should be locked by priv_lock, except
+	 * that priv_tx is a lock-less list: stub_complete() adds to it while
+	 * holding priv_lock (so that a RET_UNLINK queued by stub_rx never
+	 * overtakes the completion), and stub_tx takes all of it at once
+	 * without the lock.
 	 */
 	spinlock_t priv_lock;
 	struct list_head priv_init;
-	struct list_head priv_tx;
+	struct llist_head priv_tx;
 	struct list_head priv_free;
 
 	/* see comments for unlinking in stub_rx.c */
@@ -60,8 +165,133 @@ struct stub_device {
 	struct list_head unlink_free;
 
 	wait_queue_head_t tx_waitq;
+
+	/*
+	 * Completed requests are sent to the socket in batches. tx_batch is
+	 * only touched by stub_tx. tx_policy is tunable through sysfs.
+	 */
+	struct usbip_xmit_batch tx_batch;
+	struct usbip_xmit_policy tx_policy;
+
+	/*
+	 * With the prio scheduler, completions are queued by transfer type
+	 * and stub_tx always sends the highest non-empty queue first. At most
+	 * tx_bulk_quantum bytes of bulk results are batched before urgent
+	 * queues are looked at again. The fifo scheduler uses one queue.
+	 */
+	int tx_sched;
+	unsigned int tx_bulk_quantum;
+
+	/*
+	 * Results taken by stub_tx but not sent yet, by tx queue. Only stub_tx
+	 * touches them. They outlive one stub_send_batch() so that the
+	 * shaper can leave them for later.
+	 */
+	struct list_head tx_submits[STUB_TX_QUEUES];
+	struct list_head tx_unlinks;
+
+	/*
+	 * Token bucket shaping the results, see stub_tx_shape(): tx_rate
+	 * bytes per second with bursts of up to tx_burst bytes, 0 is no
+	 * shaping. While the bucket is empty tx_throttled is set, and
+	 * tx_timer wakes stub_tx up once enough has been refilled.
+	 * tx_priority is the sk_priority of the socket, so that the qdisc
+	 * orders the devices sharing an uplink.
+	 */
+	unsigned int tx_rate;
+	unsigned int tx_burst;
+	long tx_tokens;
+	ktime_t tx_stamp;
+	int tx_throttled;
+	struct hrtimer tx_timer;
+	unsigned int tx_priority;
+
+	/* by transfer type, indexed like the prio scheduler's queues */
+	struct stub_tx_stats tx_stats[STUB_TX_QUEUES];
+
+	struct stub_pool pool;
+
+	/*
+	 * Endpoint contexts indexed by USBIP_DIR_* and endpoint number. The
+	 * table is only used by stub_rx; anyone who may have changed the
+	 * endpoints (set_interface, reset) sets ep_stale and stub_rx rebuilds
+	 * it before the next lookup.
+	 */
+	struct stub_ep ep_ctx[2][STUB_EP_MAX];
+	int ep_stale;
+
+	/*
+	 * Bulk streams set up on each endpoint, by the first CMD_SUBMIT with
+	 * a stream id; released when the interface settings change. Only
+	 * stub_rx touches them while the connection is up.
+	 */
+	unsigned int streams[2][STUB_EP_MAX];
+
+	/*
+	 * Consecutive CMD_SUBMITs to a bulk out endpoint in merge_mask are
+	 * submitted as one transfer, see stub_merge_flush(). merge holds the
+	 * requests received but not submitted yet; they are on priv_init
+	 * already. Only stub_rx touches merge.
+	 */
+	unsigned int merge_mask;
+	struct stub_priv *merge[STUB_MERGE_MAX_URBS];
+	int merge_count;
+	int merge_len;
+
+	/*
+	 * Every submitted urb is anchored here so that teardown can cancel
+	 * all of them at once and then wait for them together. While
+	 * cancelling is set, completions are left for
+	 * stub_device_cleanup_urbs() instead of being sent.
+	 */
+	struct usb_anchor submitted;
+	int cancelling;
+
+	/*
+	 * In-flight budget, see stub_budget_exhausted(). Every request is
+	 * charged from CMD_SUBMIT until its stub_priv is freed, to the device
+	 * and to the module-wide budget. stub_rx stops reading CMD_SUBMITs
+	 * while either is used up, and sets throttled; whoever uncharges
+	 * wakes it up again. CMD_UNLINKs are still read, since they are what
+	 * frees the budget of urbs that would otherwise stay pending; rx_data
+	 * is set when more arrives for stub_rx to peek at. A zero budget is
+	 * no limit. With credits set, the window is also announced to the
+	 * peer in every RET_*.
+	 */
+	unsigned int budget_bytes;
+	unsigned int budget_urbs;
+	atomic_long_t inflight_bytes;
+	atomic_t inflight_urbs;
+	int throttled;
+	int rx_data;
+	struct list_head throttled_list;
+	wait_queue_head_t budget_waitq;
+	unsigned long throttle_count;
+	int credits;
+
+	/* cost of tearing down a connection, shown in usbip_teardown */
+	unsigned long teardown_count;
+	unsigned int teardown_urbs;
+	u64 teardown_last_us;
+	u64 teardown_max_us;
 };
 
+/* default in-flight budget of a device */
+#define STUB_BUDGET_BYTES	(32 * 1024 * 1024)
+#define STUB_BUDGET_URBS	1024
+
+/* default flush policy of stub_tx */
+#define STUB_TX_MAX_BYTES	(64 * 1024)
+#define STUB_TX_MAX_URBS	64
+#define STUB_TX_MAX_DELAY	0
+#define STUB_TX_SCHED		STUB_TX_SCHED_PRIO
+#define STUB_TX_BULK_QUANTUM	(64 * 1024)
+#define STUB_TX_BURST		(64 * 1024)
+
+/* initial size of the kvec array and the header area of tx_batch */
+#define STUB_TX_IOVMAX		256
+#define STUB_TX_SCRATCH		(16 * 1024)
+
 /* private data into urb->priv */
 struct stub_priv {
 	unsigned long seqnum;
@@ -73,6 +303,41 @@ struct stub_priv {
     void *priv;
 
 	int unlinking;
+
+	/* link in priv_tx and the tx queue it is sent from */
+	struct llist_node tx_node;
+	int tx_queue;
+
+	/* when the urb completed, for the tx statistics */
+	ktime_t done;
+
+	/* pool classes of urb and xbuf, -1 if not recycled */
+	int urb_class;
+	int xbuf_class;
+
+	/* transfer buffer owned by this request, if any */
+	void *xbuf;
+
+	/* pre-mapped transfer buffer, see stub_pool_get_dma() */
+	struct stub_dma_buf *dma_buf;
+
+	/* page list of a scatter-gather urb, see stub_pool_get_sg() */
+	struct scatterlist *sgl;
+	int nents;
+
+	/* urb->setup_packet of control requests */
+	unsigned char setup[8];
+
+	/*
+	 * A merged transfer owns the requests it was built from, linked by
+	 * their list in submission order. It is on priv_init in their place.
+	 */
+	struct list_head pieces;
+	int npieces;
+
+	/* transfer bytes charged to the budget, if charged */
+	unsigned int charge;
+	int charged;
 };
 
 struct stub_unlink {
@@ -90,6 +355,10 @@ struct bus_id_priv {
 	int interf_count;
 	struct stub_device *sdev;
 	char shutdown_busid;
+
+	/* link in the busid hash table, see stub_main.c */
+	struct hlist_node node;
+	struct kref kref;
 };
 
 /* stub_priv is allocated from stub_priv_cache */
@@ -100,11 +369,42 @@ extern struct usb_driver stub_driver;
 
 /* stub_main.c */
 struct bus_id_priv *get_busid_priv(const char *busid);
+void put_busid_priv(struct bus_id_priv *bid);
 int del_match_busid(char *busid);
+int stub_device_unlink_urbs(struct stub_device *sdev);
 void stub_device_cleanup_urbs(struct stub_device *sdev);
+void stub_budget_charge(struct stub_priv *priv, unsigned int len);
+void stub_budget_uncharge(struct stub_priv *priv);
+int stub_budget_exhausted(struct stub_device *sdev);
+void stub_budget_stop(struct stub_device *sdev);
+void stub_budget_update(struct stub_device *sdev);
+__u32 stub_budget_credit(struct stub_device *sdev);
+
+/* stub_pool.c */
+void stub_pool_init(struct stub_pool *pool, struct usb_device *udev);
+void stub_pool_drain(struct stub_pool *pool);
+struct stub_priv *stub_pool_get_priv(struct stub_pool *pool,
+				     int number_of_packets, gfp_t mem_flags);
+void *stub_pool_get_buf(struct stub_pool *pool, struct stub_priv *priv,
+			size_t size, gfp_t mem_flags);
+void *stub_pool_get_dma(struct stub_pool *pool, struct stub_priv *priv,
+			size_t size, gfp_t mem_flags);
+void stub_pool_dma_release(struct stub_pool *pool);
+int stub_pool_get_sg(struct stub_pool *pool, struct stub_priv *priv,
+		     size_t size, gfp_t mem_flags);
+void stub_pool_put_priv(struct stub_pool *pool, struct stub_priv *priv);
+ssize_t stub_pool_show(struct stub_pool *pool, char *buf);
 
 /* stub_rx.c */
 int stub_rx_loop(void *data);
+void stub_rx_pdu(struct usbip_device *ud);
+int stub_rx_pdu_size(struct usbip_device *ud, struct usbip_header *pdu);
+void stub_ep_build(struct stub_device *sdev);
+void stub_ep_free_streams(struct stub_device *sdev);
+void stub_rx_idle(struct usbip_device *ud);
+int stub_rx_pdu_blocks(struct usbip_device *ud, struct usbip_header *pdu);
+int stub_rx_throttled(struct usbip_device *ud);
+void stub_rx_data(struct usbip_device *ud);
 int stub_submit_urb(struct stub_device *sdev,
         struct usbip_header *pdu, struct urb *urb);
 struct urb *stub_build_urb(struct stub_device *sdev,
@@ -115,6 +415,11 @@ void stub_free_priv_and_urb(struct stub_priv *priv);
 void stub_enqueue_ret_unlink(struct stub_device *sdev, __u32 seqnum,
 			     __u32 status);
 void stub_complete(struct urb *urb);
+void stub_merge_complete(struct urb *urb);
 int stub_tx_loop(void *data);
+void stub_tx_work(struct usbip_device *ud);
+void stub_tx_init(struct stub_device *sdev);
+void stub_tx_stop(struct stub_device *sdev);
+ssize_t stub_tx_stats_show(struct stub_device *sdev, char *buf);
 
 #endif /* __USBIP_STUB_H */
@@ -20,7 +20,10 @@
 #include <linux/device.h>
 #include <linux/file.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/module.h>
+#include <linux/pkt_sched.h>
+#include <net/sock.h>
 
 #include "usbip_common.h"
 #include "stub.h"
@@ -110,13 +113,21 @@ static ssize_t store_sockfd(struct device *dev, struct device_attribute *attr,
 			goto err;
 
 		sdev->ud.tcp_socket = socket;
+		socket->sk->sk_priority = sdev->tx_priority;
 
 		spin_unlock_irq(&sdev->ud.lock);
 
-		sdev->ud.tcp_rx = kthread_get_run(stub_rx_loop, &sdev->ud,
-						  "stub_rx");
-		sdev->ud.tcp_tx = kthread_get_run(stub_tx_loop, &sdev->ud,
-						  "stub_tx");
+		stub_ep_build(sdev);
+		usbip_rx_start(&sdev->ud);
+
+		if (sdev->ud.use_wq) {
+			usbip_wq_start(&sdev->ud);
+		} else {
+			sdev->ud.tcp_rx = kthread_get_run(stub_rx_loop,
+							  &sdev->ud, "stub_rx");
+			sdev->ud.tcp_tx = kthread_get_run(stub_tx_loop,
+							  &sdev->ud, "stub_tx");
+		}
 
 		spin_lock_irq(&sdev->ud.lock);
 		sdev->ud.status = SDEV_ST_USED;
@@ -142,56 +153,464 @@ err:
 }
 static DEVICE_ATTR(usbip_sockfd, S_IWUSR, NULL, store_sockfd);
 
-static int stub_add_files(struct device *dev)
+/*
+ * usbip_tx_max_bytes, usbip_tx_max_urbs and usbip_tx_max_delay set the flush
+ * policy of stub_tx (see struct usbip_xmit_policy). Results are pushed to the
+ * socket once a batch holds max_bytes or max_urbs; max_delay is the time in
+ * usecs stub_tx waits for more completions before flushing a partial batch.
+ */
+#define STUB_TX_ATTR(field, member)					\
+static ssize_t show_tx_##field(struct device *dev,			\
+			       struct device_attribute *attr, char *buf) \
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	return snprintf(buf, PAGE_SIZE, "%u\n",			\
+			ACCESS_ONCE(sdev->member));			\
+}									\
+static ssize_t store_tx_##field(struct device *dev,			\
+				struct device_attribute *attr,		\
+				const char *buf, size_t count)		\
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+	unsigned int val;						\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	if (sscanf(buf, "%u", &val) != 1)				\
+		return -EINVAL;						\
+									\
+	ACCESS_ONCE(sdev->member) = val;				\
+	return count;							\
+}									\
+static DEVICE_ATTR(usbip_tx_##field, S_IRUGO | S_IWUSR,		\
+		   show_tx_##field, store_tx_##field)
+
+STUB_TX_ATTR(max_bytes, tx_policy.max_bytes);
+STUB_TX_ATTR(max_urbs, tx_policy.max_urbs);
+STUB_TX_ATTR(max_delay, tx_policy.max_delay);
+
+/*
+ * usbip_tx_sched selects how stub_tx orders the results: "fifo" sends them in
+ * completion order, "prio" sends control, interrupt and iso results ahead of
+ * bulk ones. usbip_tx_bulk_quantum bounds the bulk bytes batched in a row
+ * under "prio" (0 = no bound). A single result is never split because the
+ * pdu payload must follow its header on the wire.
+ */
+static const char * const stub_tx_sched_names[] = {
+	[STUB_TX_SCHED_FIFO] = "fifo",
+	[STUB_TX_SCHED_PRIO] = "prio",
+};
+
+static ssize_t show_tx_sched(struct device *dev, struct device_attribute *attr,
+			     char *buf)
 {
-	int err = 0;
+	struct stub_device *sdev = dev_get_drvdata(dev);
 
-	err = device_create_file(dev, &dev_attr_usbip_status);
-	if (err)
-		goto err_status;
+	if (!sdev)
+		return -ENODEV;
 
-	err = device_create_file(dev, &dev_attr_usbip_sockfd);
-	if (err)
-		goto err_sockfd;
+	return snprintf(buf, PAGE_SIZE, "%s\n",
+			stub_tx_sched_names[ACCESS_ONCE(sdev->tx_sched)]);
+}
 
-	err = device_create_file(dev, &dev_attr_usbip_debug);
-	if (err)
-		goto err_debug;
+static ssize_t store_tx_sched(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	int i;
 
-	return 0;
+	if (!sdev)
+		return -ENODEV;
 
-err_debug:
-	device_remove_file(dev, &dev_attr_usbip_sockfd);
-err_sockfd:
-	device_remove_file(dev, &dev_attr_usbip_status);
-err_status:
-	return err;
+	for (i = 0; i < ARRAY_SIZE(stub_tx_sched_names); i++) {
+		if (sysfs_streq(buf, stub_tx_sched_names[i])) {
+			ACCESS_ONCE(sdev->tx_sched) = i;
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+static DEVICE_ATTR(usbip_tx_sched, S_IRUGO | S_IWUSR, show_tx_sched,
+		   store_tx_sched);
+
+STUB_TX_ATTR(bulk_quantum, tx_bulk_quantum);
+
+/*
+ * usbip_tx_rate shapes the results sent to the client to that many bytes per
+ * second (0 = unlimited), in bursts of up to usbip_tx_burst bytes. Results
+ * held back by the shaper still leave in the order of usbip_tx_sched.
+ */
+STUB_TX_ATTR(rate, tx_rate);
+STUB_TX_ATTR(burst, tx_burst);
+
+/*
+ * usbip_tx_priority is the socket priority (SO_PRIORITY) of the connection,
+ * which the qdisc of the uplink uses to order the traffic of the devices
+ * sharing it; e.g. pfifo_fast sends 6 (interactive) ahead of 0 (best effort)
+ * ahead of 2 (bulk).
+ */
+static ssize_t show_tx_priority(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return snprintf(buf, PAGE_SIZE, "%u\n", ACCESS_ONCE(sdev->tx_priority));
+}
+
+static ssize_t store_tx_priority(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	unsigned int val;
+
+	if (!sdev)
+		return -ENODEV;
+
+	if (sscanf(buf, "%u", &val) != 1 || val > TC_PRIO_MAX)
+		return -EINVAL;
+
+	spin_lock_irq(&sdev->ud.lock);
+	sdev->tx_priority = val;
+	if (sdev->ud.tcp_socket)
+		sdev->ud.tcp_socket->sk->sk_priority = val;
+	spin_unlock_irq(&sdev->ud.lock);
+
+	return count;
+}
+static DEVICE_ATTR(usbip_tx_priority, S_IRUGO | S_IWUSR, show_tx_priority,
+		   store_tx_priority);
+
+/*
+ * usbip_tx_stats shows, per transfer type, how many results have been sent,
+ * their total and longest delay from completion to the socket, and how many
+ * bytes had to wait for the shaper.
+ */
+static ssize_t show_tx_stats(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return stub_tx_stats_show(sdev, buf);
+}
+static DEVICE_ATTR(usbip_tx_stats, S_IRUGO, show_tx_stats, NULL);
+
+/*
+ * usbip_rx_mode selects the receive engine of the next connection:
+ * "recvmsg" (blocking kernel_recvmsg() per pdu part) or "readsock"
+ * (tcp_read_sock() driven by the socket callbacks).
+ */
+static const char * const stub_rx_mode_names[] = {
+	[USBIP_RX_RECVMSG]  = "recvmsg",
+	[USBIP_RX_READSOCK] = "readsock",
+};
+
+static ssize_t show_rx_mode(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return snprintf(buf, PAGE_SIZE, "%s\n",
+			stub_rx_mode_names[sdev->ud.rx_mode]);
+}
+
+static ssize_t store_rx_mode(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	int i;
+
+	if (!sdev)
+		return -ENODEV;
+
+	for (i = 0; i < ARRAY_SIZE(stub_rx_mode_names); i++) {
+		if (sysfs_streq(buf, stub_rx_mode_names[i])) {
+			spin_lock_irq(&sdev->ud.lock);
+			if (sdev->ud.status == SDEV_ST_USED) {
+				spin_unlock_irq(&sdev->ud.lock);
+				return -EBUSY;
+			}
+			sdev->ud.rx_mode = i;
+			spin_unlock_irq(&sdev->ud.lock);
+			return count;
+		}
+	}
+
+	return -EINVAL;
+}
+static DEVICE_ATTR(usbip_rx_mode, S_IRUGO | S_IWUSR, show_rx_mode,
+		   store_rx_mode);
+
+/*
+ * usbip_pool shows how often requests and transfer buffers have been
+ * recycled (hit) or allocated (miss), and how many are cached now.
+ */
+static ssize_t show_pool(struct device *dev, struct device_attribute *attr,
+			 char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return stub_pool_show(&sdev->pool, buf);
+}
+static DEVICE_ATTR(usbip_pool, S_IRUGO, show_pool, NULL);
+
+/*
+ * usbip_merge_out is a mask of bulk out endpoint numbers (bit n for endpoint
+ * n) whose consecutive requests are merged into one transfer while more of
+ * them are already waiting in the socket. Off for all endpoints by default;
+ * merging is never done while a filter is attached.
+ */
+static ssize_t show_merge_out(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return snprintf(buf, PAGE_SIZE, "0x%04x\n",
+			ACCESS_ONCE(sdev->merge_mask));
+}
+
+static ssize_t store_merge_out(struct device *dev,
+			       struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+	unsigned int val;
+
+	if (!sdev)
+		return -ENODEV;
+
+	if (sscanf(buf, "%x", &val) != 1 || val > 0xffff)
+		return -EINVAL;
+
+	ACCESS_ONCE(sdev->merge_mask) = val;
+	sdev->ep_stale = 1;
+	return count;
+}
+static DEVICE_ATTR(usbip_merge_out, S_IRUGO | S_IWUSR, show_merge_out,
+		   store_merge_out);
+
+/*
+ * usbip_dma turns on transfer buffers allocated with usb_alloc_coherent() on
+ * the host controller's node, which are submitted without being mapped per
+ * urb. usbip_dma_bufs bounds how many are allocated and usbip_dma_buf_size
+ * sets their size; transfers that do not fit use kmalloc buffers as before.
+ * Any change frees the buffers not in use; they are allocated again on
+ * demand.
+ */
+#define STUB_DMA_ATTR(field, member)					\
+static ssize_t show_##field(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	return snprintf(buf, PAGE_SIZE, "%u\n",			\
+			ACCESS_ONCE(sdev->pool.member));		\
+}									\
+static ssize_t store_##field(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+	unsigned int val;						\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	if (sscanf(buf, "%u", &val) != 1)				\
+		return -EINVAL;						\
+									\
+	ACCESS_ONCE(sdev->pool.member) = val;				\
+	stub_pool_dma_release(&sdev->pool);				\
+	return count;							\
+}									\
+static DEVICE_ATTR(usbip_##field, S_IRUGO | S_IWUSR,			\
+		   show_##field, store_##field)
+
+STUB_DMA_ATTR(dma, dma);
+STUB_DMA_ATTR(dma_bufs, dma_bufs);
+STUB_DMA_ATTR(dma_buf_size, dma_size);
+
+/*
+ * usbip_budget_bytes and usbip_budget_urbs bound the transfer bytes and the
+ * requests in flight on this device (0 = no limit); stub_rx stops reading
+ * the socket while either is used up, as it does for the module-wide
+ * max_inflight_bytes and max_inflight_urbs. usbip_credits announces the
+ * window to the client in every reply so that it can pace itself.
+ */
+#define STUB_BUDGET_ATTR(field, member)					\
+static ssize_t show_##field(struct device *dev,				\
+			    struct device_attribute *attr, char *buf)	\
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	return snprintf(buf, PAGE_SIZE, "%u\n",			\
+			ACCESS_ONCE(sdev->member));			\
+}									\
+static ssize_t store_##field(struct device *dev,			\
+			     struct device_attribute *attr,		\
+			     const char *buf, size_t count)		\
+{									\
+	struct stub_device *sdev = dev_get_drvdata(dev);		\
+	unsigned int val;						\
+									\
+	if (!sdev)							\
+		return -ENODEV;						\
+									\
+	if (sscanf(buf, "%u", &val) != 1)				\
+		return -EINVAL;						\
+									\
+	ACCESS_ONCE(sdev->member) = val;				\
+	stub_budget_update(sdev);					\
+	return count;							\
+}									\
+static DEVICE_ATTR(usbip_##field, S_IRUGO | S_IWUSR,			\
+		   show_##field, store_##field)
+
+STUB_BUDGET_ATTR(budget_bytes, budget_bytes);
+STUB_BUDGET_ATTR(budget_urbs, budget_urbs);
+STUB_BUDGET_ATTR(credits, credits);
+
+/*
+ * usbip_inflight shows what is charged to the budget of this device now, and
+ * how often stub_rx had to stop reading because a budget was used up.
+ */
+static ssize_t show_inflight(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return snprintf(buf, PAGE_SIZE, "urbs %d bytes %ld throttled %lu\n",
+			atomic_read(&sdev->inflight_urbs),
+			atomic_long_read(&sdev->inflight_bytes),
+			sdev->throttle_count);
+}
+static DEVICE_ATTR(usbip_inflight, S_IRUGO, show_inflight, NULL);
+
+/*
+ * usbip_teardown shows how many connections have been torn down, and how
+ * long the last and the slowest one took. urbs is the number of requests
+ * the last one had to cancel.
+ */
+static ssize_t show_teardown(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct stub_device *sdev = dev_get_drvdata(dev);
+
+	if (!sdev)
+		return -ENODEV;
+
+	return snprintf(buf, PAGE_SIZE,
+			"count %lu urbs %u last_us %llu max_us %llu\n",
+			sdev->teardown_count, sdev->teardown_urbs,
+			sdev->teardown_last_us, sdev->teardown_max_us);
+}
+static DEVICE_ATTR(usbip_teardown, S_IRUGO, show_teardown, NULL);
+
+static struct attribute *stub_attrs[] = {
+	&dev_attr_usbip_status.attr,
+	&dev_attr_usbip_sockfd.attr,
+	&dev_attr_usbip_debug.attr,
+	&dev_attr_usbip_tx_max_bytes.attr,
+	&dev_attr_usbip_tx_max_urbs.attr,
+	&dev_attr_usbip_tx_max_delay.attr,
+	&dev_attr_usbip_tx_sched.attr,
+	&dev_attr_usbip_tx_bulk_quantum.attr,
+	&dev_attr_usbip_tx_rate.attr,
+	&dev_attr_usbip_tx_burst.attr,
+	&dev_attr_usbip_tx_priority.attr,
+	&dev_attr_usbip_tx_stats.attr,
+	&dev_attr_usbip_rx_mode.attr,
+	&dev_attr_usbip_pool.attr,
+	&dev_attr_usbip_merge_out.attr,
+	&dev_attr_usbip_dma.attr,
+	&dev_attr_usbip_dma_bufs.attr,
+	&dev_attr_usbip_dma_buf_size.attr,
+	&dev_attr_usbip_teardown.attr,
+	&dev_attr_usbip_budget_bytes.attr,
+	&dev_attr_usbip_budget_urbs.attr,
+	&dev_attr_usbip_credits.attr,
+	&dev_attr_usbip_inflight.attr,
+	NULL,
+};
+
+static struct attribute_group stub_attr_group = {
+	.attrs = stub_attrs,
+};
+
+static int stub_add_files(struct device *dev)
+{
+	return sysfs_create_group(&dev->kobj, &stub_attr_group);
 }
 
 static void stub_remove_files(struct device *dev)
 {
-	device_remove_file(dev, &dev_attr_usbip_status);
-	device_remove_file(dev, &dev_attr_usbip_sockfd);
-	device_remove_file(dev, &dev_attr_usbip_debug);
+	sysfs_remove_group(&dev->kobj, &stub_attr_group);
 }
 
 static void stub_shutdown_connection(struct usbip_device *ud)
 {
 	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	ktime_t start = ktime_get();
+	unsigned int urbs;
+	u64 us;
 
 	/*
 	 * When removing an exported device, kernel panic sometimes occurred
 	 * and then EIP was sk_wait_data of stub_rx thread. Is this because
 	 * sk_wait_data returned though stub_rx thread was already finished by
 	 * step 1?
+	 *
+	 * Shutting the socket down first makes stub_rx and stub_tx return
+	 * from the socket at once, so stopping them below does not wait.
 	 */
 	if (ud->tcp_socket) {
 		dev_dbg(&sdev->udev->dev, "shutdown tcp_socket %p\n",
 			ud->tcp_socket);
 		kernel_sock_shutdown(ud->tcp_socket, SHUT_RDWR);
 	}
+	wake_up_interruptible(&sdev->tx_waitq);
+
+	/*
+	 * 0. cancel all urbs; the host controller gives them back while the
+	 * threads are being stopped.
+	 */
+	urbs = stub_device_unlink_urbs(sdev);
 
 	/* 1. stop threads */
+	if (ud->use_wq)
+		usbip_wq_stop(ud);
 	if (ud->tcp_rx) {
 		kthread_stop_put(ud->tcp_rx);
 		ud->tcp_rx = NULL;
@@ -200,6 +619,8 @@ static void stub_shutdown_connection(struct usbip_device *ud)
 		kthread_stop_put(ud->tcp_tx);
 		ud->tcp_tx = NULL;
 	}
+	stub_budget_stop(sdev);
+	stub_tx_stop(sdev);
 
 	/*
 	 * 2. close the socket
@@ -208,12 +629,16 @@ static void stub_shutdown_connection(struct usbip_device *ud)
 	 * not touch NULL socket.
 	 */
 	if (ud->tcp_socket) {
+		usbip_rx_stop(ud);
 		fput(ud->tcp_socket->file);
 		ud->tcp_socket = NULL;
 	}
 
 	/* 3. free used data */
 	stub_device_cleanup_urbs(sdev);
+	stub_ep_free_streams(sdev);
+	sdev->merge_count = 0;
+	sdev->merge_len = 0;
 
 	/* 4. free stub_unlink */
 	{
@@ -225,6 +650,11 @@ static void stub_shutdown_connection(struct usbip_device *ud)
 			list_del(&unlink->list);
 			kfree(unlink);
 		}
+		list_for_each_entry_safe(unlink, tmp, &sdev->tx_unlinks,
+					 list) {
+			list_del(&unlink->list);
+			kfree(unlink);
+		}
 		list_for_each_entry_safe(unlink, tmp, &sdev->unlink_free,
 					 list) {
 			list_del(&unlink->list);
@@ -232,6 +662,16 @@ static void stub_shutdown_connection(struct usbip_device *ud)
 		}
 		spin_unlock_irqrestore(&sdev->priv_lock, flags);
 	}
+
+	us = ktime_to_us(ktime_sub(ktime_get(), start));
+	sdev->teardown_count++;
+	sdev->teardown_urbs = urbs;
+	sdev->teardown_last_us = us;
+	if (us > sdev->teardown_max_us)
+		sdev->teardown_max_us = us;
+
+	dev_dbg(&sdev->udev->dev, "teardown took %llu us, %u urbs cancelled\n",
+		us, urbs);
 }
 
 static void stub_device_reset(struct usbip_device *ud)
@@ -305,23 +745,57 @@ static struct stub_device *stub_device_alloc(struct usb_device *udev,
 	sdev->ud.side		= USBIP_STUB;
 	sdev->ud.status		= SDEV_ST_AVAILABLE;
 	spin_lock_init(&sdev->ud.lock);
+	spin_lock_init(&sdev->ud.wq_lock);
 	sdev->ud.tcp_socket	= NULL;
     INIT_LIST_HEAD(&sdev->ud.filters);
 	spin_lock_init(&sdev->ud.filter_lock);
 
 	INIT_LIST_HEAD(&sdev->priv_init);
-	INIT_LIST_HEAD(&sdev->priv_tx);
+	init_llist_head(&sdev->priv_tx);
 	INIT_LIST_HEAD(&sdev->priv_free);
 	INIT_LIST_HEAD(&sdev->unlink_free);
 	INIT_LIST_HEAD(&sdev->unlink_tx);
 	spin_lock_init(&sdev->priv_lock);
 
 	init_waitqueue_head(&sdev->tx_waitq);
+	init_usb_anchor(&sdev->submitted);
+	stub_tx_init(sdev);
+
+	sdev->budget_bytes = STUB_BUDGET_BYTES;
+	sdev->budget_urbs = STUB_BUDGET_URBS;
+	atomic_long_set(&sdev->inflight_bytes, 0);
+	atomic_set(&sdev->inflight_urbs, 0);
+	INIT_LIST_HEAD(&sdev->throttled_list);
+	init_waitqueue_head(&sdev->budget_waitq);
+
+	stub_pool_init(&sdev->pool, sdev->udev);
+
+	if (usbip_xmit_batch_init(&sdev->tx_batch, &sdev->ud, STUB_TX_IOVMAX,
+				  STUB_TX_SCRATCH)) {
+		usb_put_dev(sdev->udev);
+		usb_put_intf(sdev->interface);
+		kfree(sdev);
+		return NULL;
+	}
+	sdev->tx_policy.max_bytes = STUB_TX_MAX_BYTES;
+	sdev->tx_policy.max_urbs  = STUB_TX_MAX_URBS;
+	sdev->tx_policy.max_delay = STUB_TX_MAX_DELAY;
+	sdev->tx_sched		  = STUB_TX_SCHED;
+	sdev->tx_bulk_quantum	  = STUB_TX_BULK_QUANTUM;
+	sdev->ep_stale		  = 1;
 
 	sdev->ud.eh_ops.shutdown = stub_shutdown_connection;
 	sdev->ud.eh_ops.reset    = stub_device_reset;
 	sdev->ud.eh_ops.unusable = stub_device_unusable;
 
+	sdev->ud.wq_ops.rx_pdu   = stub_rx_pdu;
+	sdev->ud.wq_ops.pdu_size = stub_rx_pdu_size;
+	sdev->ud.wq_ops.pdu_blocks = stub_rx_pdu_blocks;
+	sdev->ud.wq_ops.tx       = stub_tx_work;
+	sdev->ud.wq_ops.rx_idle  = stub_rx_idle;
+	sdev->ud.wq_ops.rx_throttled = stub_rx_throttled;
+	sdev->ud.wq_ops.rx_data  = stub_rx_data;
+
 	usbip_start_eh(&sdev->ud);
 
 	dev_dbg(&interface->dev, "register new interface\n");
@@ -331,6 +805,8 @@ static struct stub_device *stub_device_alloc(struct usb_device *udev,
 
 static void stub_device_free(struct stub_device *sdev)
 {
+	usbip_xmit_batch_free(&sdev->tx_batch);
+	stub_pool_drain(&sdev->pool);
 	kfree(sdev);
 }
 
@@ -367,25 +843,31 @@ static int stub_probe(struct usb_interface *interface,
 		 * other matched drivers by the driver core.
 		 * See driver_probe_device() in driver/base/dd.c
 		 */
-		return -ENODEV;
+		err = -ENODEV;
+		goto out;
 	}
 
 	if (udev->descriptor.bDeviceClass == USB_CLASS_HUB) {
 		dev_dbg(&udev->dev, "%s is a usb hub device... skip!\n",
 			 udev_busid);
-		return -ENODEV;
+		err = -ENODEV;
+		goto out;
 	}
 
-	if (!strcmp(udev->bus->bus_name, "vhci_hcd")) {
+	/* vhci_hcd, or vhci_hcd.N when vhci-hcd runs several controllers */
+	if (!strncmp(udev->bus->bus_name, "vhci_hcd", 8)) {
 		dev_dbg(&udev->dev, "%s is attached on vhci_hcd... skip!\n",
 			 udev_busid);
-		return -ENODEV;
+		err = -ENODEV;
+		goto out;
 	}
 
 	if (busid_priv->status == STUB_BUSID_ALLOC) {
 		sdev = busid_priv->sdev;
-		if (!sdev)
-			return -ENODEV;
+		if (!sdev) {
+			err = -ENODEV;
+			goto out;
+		}
 
 		busid_priv->interf_count++;
 		dev_info(&interface->dev, "usbip-host: register new interface "
@@ -402,17 +884,19 @@ static int stub_probe(struct usb_interface *interface,
 				udev_busid);
 			usb_set_intfdata(interface, NULL);
 			busid_priv->interf_count--;
-			return err;
+			goto out;
 		}
 
 		usb_get_intf(interface);
-		return 0;
+		goto out;
 	}
 
 	/* ok, this is my device */
 	sdev = stub_device_alloc(udev, interface);
-	if (!sdev)
-		return -ENOMEM;
+	if (!sdev) {
+		err = -ENOMEM;
+		goto out;
+	}
 
 	dev_info(&interface->dev, "usbip-host: register new device "
 		 "(bus %u dev %u ifn %u)\n", udev->bus->busnum, udev->devnum,
@@ -430,19 +914,24 @@ static int stub_probe(struct usb_interface *interface,
 	if (err) {
 		dev_err(&interface->dev, "stub_add_files for %s\n", udev_busid);
 		usb_set_intfdata(interface, NULL);
-		usb_put_intf(interface);
-		usb_put_dev(udev);
-		kthread_stop_put(sdev->ud.eh);
+		usbip_stop_eh(&sdev->ud);
 
 		busid_priv->interf_count = 0;
 		busid_priv->sdev = NULL;
+		/* the dma pool is freed against udev */
 		stub_device_free(sdev);
-		return err;
+		usb_put_intf(interface);
+		usb_put_dev(udev);
+		goto out;
 	}
 	busid_priv->status = STUB_BUSID_ALLOC;
 
     usbip_filter_probe(&sdev->ud,interface);
-	return 0;
+
+out:
+	if (busid_priv)
+		put_busid_priv(busid_priv);
+	return err;
 }
 
 static void shutdown_busid(struct bus_id_priv *busid_priv)
@@ -463,6 +952,7 @@ static void shutdown_busid(struct bus_id_priv *busid_priv)
 static void stub_disconnect(struct usb_interface *interface)
 {
 	struct stub_device *sdev;
+	struct usb_device *udev;
 	const char *udev_busid = dev_name(interface->dev.parent);
 	struct bus_id_priv *busid_priv;
 
@@ -479,7 +969,7 @@ static void stub_disconnect(struct usb_interface *interface)
 	/* get stub_device */
 	if (!sdev) {
 		dev_err(&interface->dev, "could not get device");
-		return;
+		goto out;
 	}
 
     usbip_filter_remove(&sdev->ud,NULL);
@@ -492,16 +982,16 @@ static void stub_disconnect(struct usb_interface *interface)
 	stub_remove_files(&interface->dev);
 
 	/* If usb reset is called from event handler */
-	if (busid_priv->sdev->ud.eh == current) {
+	if (busid_priv->sdev->ud.eh_task == current) {
 		busid_priv->interf_count--;
-		return;
+		goto out;
 	}
 
 	if (busid_priv->interf_count > 1) {
 		busid_priv->interf_count--;
 		shutdown_busid(busid_priv);
 		usb_put_intf(interface);
-		return;
+		goto out;
 	}
 
 	busid_priv->interf_count = 0;
@@ -509,19 +999,23 @@ static void stub_disconnect(struct usb_interface *interface)
 	/* shutdown the current connection */
 	shutdown_busid(busid_priv);
 
-	usb_put_dev(sdev->udev);
-	usb_put_intf(interface);
-
-	/* free sdev */
+	/* free sdev, and its dma pool while udev is still held */
+	udev = sdev->udev;
 	busid_priv->sdev = NULL;
 	stub_device_free(sdev);
 
+	usb_put_dev(udev);
+	usb_put_intf(interface);
+
 	if (busid_priv->status == STUB_BUSID_ALLOC) {
 		busid_priv->status = STUB_BUSID_ADDED;
 	} else {
 		busid_priv->status = STUB_BUSID_OTHER;
 		del_match_busid((char *)udev_busid);
 	}
+
+out:
+	put_busid_priv(busid_priv);
 }
 
 /*
@@ -537,7 +1031,13 @@ static int stub_pre_reset(struct usb_interface *interface)
 
 static int stub_post_reset(struct usb_interface *interface)
 {
+	struct stub_device *sdev = usb_get_intfdata(interface);
+
 	dev_dbg(&interface->dev, "post_reset\n");
+
+	/* the endpoints may have been changed by the reset */
+	if (sdev)
+		sdev->ep_stale = 1;
 	return 0;
 }
 
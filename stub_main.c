@@ -17,8 +17,11 @@
  * USA.
  */
 
+#include <linux/ctype.h>
+#include <linux/jhash.h>
 #include <linux/string.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 
 #include "usbip_common.h"
 #include "stub.h"
@@ -28,161 +31,252 @@
 
 struct kmem_cache *stub_priv_cache;
 /*
- * busid_tables defines matching busids that usbip can grab. A user can change
+ * busid_table holds the busids that usbip can grab. A user can change
  * dynamically what device is locally used and what device is exported to a
  * remote host.
+ *
+ * Entries are allocated on demand and hashed by name, and every bucket has
+ * its own lock, so there is no limit on the number of busids and lookups do
+ * not walk all of them. The table holds a reference on each entry;
+ * get_busid_priv() takes another one that the caller drops with
+ * put_busid_priv(), so that an entry deleted meanwhile stays valid.
  */
-#define MAX_BUSID 16
-static struct bus_id_priv busid_table[MAX_BUSID];
-static spinlock_t busid_table_lock;
+#define BUSID_HASH_BITS 8
+#define BUSID_HASH_SIZE (1 << BUSID_HASH_BITS)
+
+struct busid_bucket {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+static struct busid_bucket busid_table[BUSID_HASH_SIZE];
 
 static void init_busid_table(void)
 {
-	/*
-	 * This also sets the bus_table[i].status to
-	 * STUB_BUSID_OTHER, which is 0.
-	 */
-	memset(busid_table, 0, sizeof(busid_table));
+	int i;
 
-	spin_lock_init(&busid_table_lock);
+	for (i = 0; i < BUSID_HASH_SIZE; i++) {
+		spin_lock_init(&busid_table[i].lock);
+		INIT_HLIST_HEAD(&busid_table[i].head);
+	}
+}
+
+static struct busid_bucket *busid_bucket(const char *busid)
+{
+	u32 hash = jhash(busid, strnlen(busid, BUSID_SIZE), 0);
+
+	return &busid_table[hash & (BUSID_HASH_SIZE - 1)];
 }
 
 /*
- * Find the index of the busid by name.
- * Must be called with busid_table_lock held.
+ * Find the entry of the busid by name.
+ * Must be called with the lock of its bucket held.
  */
-static int get_busid_idx(const char *busid)
+static struct bus_id_priv *busid_lookup(struct busid_bucket *bucket,
+					const char *busid)
+{
+	struct hlist_node *pos;
+	struct bus_id_priv *bid;
+
+	hlist_for_each(pos, &bucket->head) {
+		bid = hlist_entry(pos, struct bus_id_priv, node);
+		if (!strncmp(bid->name, busid, BUSID_SIZE))
+			return bid;
+	}
+
+	return NULL;
+}
+
+static void busid_priv_release(struct kref *kref)
+{
+	kfree(container_of(kref, struct bus_id_priv, kref));
+}
+
+/* drop the entries left at module unload, every device is unbound now */
+static void free_busid_table(void)
 {
+	struct hlist_node *pos, *tmp;
+	struct bus_id_priv *bid;
 	int i;
-	int idx = -1;
 
-	for (i = 0; i < MAX_BUSID; i++)
-		if (busid_table[i].name[0])
-			if (!strncmp(busid_table[i].name, busid, BUSID_SIZE)) {
-				idx = i;
-				break;
-			}
-	return idx;
+	for (i = 0; i < BUSID_HASH_SIZE; i++) {
+		hlist_for_each_safe(pos, tmp, &busid_table[i].head) {
+			bid = hlist_entry(pos, struct bus_id_priv, node);
+			hlist_del(&bid->node);
+			put_busid_priv(bid);
+		}
+	}
 }
 
 struct bus_id_priv *get_busid_priv(const char *busid)
 {
-	int idx;
-	struct bus_id_priv *bid = NULL;
+	struct busid_bucket *bucket = busid_bucket(busid);
+	struct bus_id_priv *bid;
 
-	spin_lock(&busid_table_lock);
-	idx = get_busid_idx(busid);
-	if (idx >= 0)
-		bid = &(busid_table[idx]);
-	spin_unlock(&busid_table_lock);
+	spin_lock(&bucket->lock);
+	bid = busid_lookup(bucket, busid);
+	if (bid)
+		kref_get(&bid->kref);
+	spin_unlock(&bucket->lock);
 
 	return bid;
 }
 
-static int add_match_busid(char *busid)
+void put_busid_priv(struct bus_id_priv *bid)
 {
-	int i;
-	int ret = -1;
+	kref_put(&bid->kref, busid_priv_release);
+}
 
-	spin_lock(&busid_table_lock);
+static int add_match_busid(const char *busid)
+{
+	struct busid_bucket *bucket = busid_bucket(busid);
+	struct bus_id_priv *bid;
+
+	/* allocated up front, most busids are new */
+	bid = kzalloc(sizeof(*bid), GFP_KERNEL);
+	if (!bid)
+		return -ENOMEM;
+
+	strncpy(bid->name, busid, BUSID_SIZE);
+	bid->status = STUB_BUSID_ADDED;
+	kref_init(&bid->kref);
+
+	spin_lock(&bucket->lock);
 	/* already registered? */
-	if (get_busid_idx(busid) >= 0) {
-		ret = 0;
-		goto out;
+	if (!busid_lookup(bucket, busid)) {
+		hlist_add_head(&bid->node, &bucket->head);
+		bid = NULL;
 	}
+	spin_unlock(&bucket->lock);
 
-	for (i = 0; i < MAX_BUSID; i++)
-		if (!busid_table[i].name[0]) {
-			strncpy(busid_table[i].name, busid, BUSID_SIZE);
-			if ((busid_table[i].status != STUB_BUSID_ALLOC) &&
-			    (busid_table[i].status != STUB_BUSID_REMOV))
-				busid_table[i].status = STUB_BUSID_ADDED;
-			ret = 0;
-			break;
-		}
-
-out:
-	spin_unlock(&busid_table_lock);
+	kfree(bid);
 
-	return ret;
+	return 0;
 }
 
 int del_match_busid(char *busid)
 {
-	int idx;
+	struct busid_bucket *bucket = busid_bucket(busid);
+	struct bus_id_priv *bid, *unhashed = NULL;
 	int ret = -1;
 
-	spin_lock(&busid_table_lock);
-	idx = get_busid_idx(busid);
-	if (idx < 0)
+	spin_lock(&bucket->lock);
+	bid = busid_lookup(bucket, busid);
+	if (!bid)
 		goto out;
 
 	/* found */
 	ret = 0;
 
-	if (busid_table[idx].status == STUB_BUSID_OTHER)
-		memset(busid_table[idx].name, 0, BUSID_SIZE);
+	if (bid->status == STUB_BUSID_OTHER) {
+		hlist_del(&bid->node);
+		unhashed = bid;
+	}
 
-	if ((busid_table[idx].status != STUB_BUSID_OTHER) &&
-	    (busid_table[idx].status != STUB_BUSID_ADDED))
-		busid_table[idx].status = STUB_BUSID_REMOV;
+	if ((bid->status != STUB_BUSID_OTHER) &&
+	    (bid->status != STUB_BUSID_ADDED))
+		bid->status = STUB_BUSID_REMOV;
 
 out:
-	spin_unlock(&busid_table_lock);
+	spin_unlock(&bucket->lock);
+
+	if (unhashed)
+		put_busid_priv(unhashed);
 
 	return ret;
 }
 
+/* as many busids as fit in one page, in no particular order */
 static ssize_t show_match_busid(struct device_driver *drv, char *buf)
 {
-	int i;
+	struct hlist_node *pos;
+	struct bus_id_priv *bid;
 	char *out = buf;
+	size_t len;
+	int i;
+
+	for (i = 0; i < BUSID_HASH_SIZE; i++) {
+		spin_lock(&busid_table[i].lock);
+		hlist_for_each(pos, &busid_table[i].head) {
+			bid = hlist_entry(pos, struct bus_id_priv, node);
+			len = strnlen(bid->name, BUSID_SIZE);
 
-	spin_lock(&busid_table_lock);
-	for (i = 0; i < MAX_BUSID; i++)
-		if (busid_table[i].name[0])
-			out += sprintf(out, "%s ", busid_table[i].name);
-	spin_unlock(&busid_table_lock);
+			/* keep room for the separator and the newline */
+			if (out - buf + len + 2 > PAGE_SIZE)
+				break;
+
+			out += sprintf(out, "%s ", bid->name);
+		}
+		spin_unlock(&busid_table[i].lock);
+	}
 	out += sprintf(out, "\n");
 
 	return out - buf;
 }
 
+/*
+ * Takes one or more lines of "add <busid>..." or "del <busid>...", with the
+ * busids separated by blanks. The busids are processed in order; the first
+ * one that fails ends the write with an error, leaving the ones before it
+ * done.
+ */
 static ssize_t store_match_busid(struct device_driver *dev, const char *buf,
 				 size_t count)
 {
-	int len;
+	const char *p = buf;
+	const char *end = buf + strnlen(buf, count);
 	char busid[BUSID_SIZE];
+	size_t len;
+	int add, n;
+
+	while (p < end) {
+		if (end - p < 5)
+			return -EINVAL;
+
+		if (!strncmp(p, "add ", 4))
+			add = 1;
+		else if (!strncmp(p, "del ", 4))
+			add = 0;
+		else
+			return -EINVAL;
+		p += 4;
+
+		for (n = 0; ; n++) {
+			while (p < end && (*p == ' ' || *p == '\t'))
+				p++;
+			if (p == end || *p == '\n')
+				break;
 
-	if (count < 5)
-		return -EINVAL;
-
-	/* strnlen() does not include \0 */
-	len = strnlen(buf + 4, BUSID_SIZE);
-
-	/* busid needs to include \0 termination */
-	if (!(len < BUSID_SIZE))
-		return -EINVAL;
-
-	strncpy(busid, buf + 4, BUSID_SIZE);
-
-	if (!strncmp(buf, "add ", 4)) {
-		if (add_match_busid(busid) < 0)
-			return -ENOMEM;
-
-		pr_debug("add busid %s\n", busid);
-		return count;
-	}
+			for (len = 0; p + len < end && !isspace(p[len]); len++)
+				;
+
+			/* busid needs to include \0 termination */
+			if (!(len < BUSID_SIZE))
+				return -EINVAL;
+
+			memcpy(busid, p, len);
+			busid[len] = '\0';
+			p += len;
+
+			if (add) {
+				if (add_match_busid(busid) < 0)
+					return -ENOMEM;
+				pr_debug("add busid %s\n", busid);
+			} else {
+				if (del_match_busid(busid) < 0)
+					return -ENODEV;
+				pr_debug("del busid %s\n", busid);
+			}
+		}
 
-	if (!strncmp(buf, "del ", 4)) {
-		if (del_match_busid(busid) < 0)
-			return -ENODEV;
+		if (!n)
+			return -EINVAL;
 
-		pr_debug("del busid %s\n", busid);
-		return count;
+		while (p < end && isspace(*p))
+			p++;
 	}
 
-	return -EINVAL;
+	return count;
 }
 static DRIVER_ATTR(match_busid, S_IRUSR | S_IWUSR, show_match_busid,
 		   store_match_busid);
@@ -203,6 +297,8 @@ static struct stub_priv *stub_priv_pop(struct stub_device *sdev)
 {
 	unsigned long flags;
 	struct stub_priv *priv;
+	struct llist_node *node;
+	int q;
 
 	spin_lock_irqsave(&sdev->priv_lock, flags);
 
@@ -210,9 +306,18 @@ static struct stub_priv *stub_priv_pop(struct stub_device *sdev)
 	if (priv)
 		goto done;
 
-	priv = stub_priv_pop_from_listhead(&sdev->priv_tx);
-	if (priv)
+	/* stub_tx is not running any more */
+	node = llist_del_first(&sdev->priv_tx);
+	if (node) {
+		priv = llist_entry(node, struct stub_priv, tx_node);
 		goto done;
+	}
+
+	for (q = 0; q < STUB_TX_QUEUES; q++) {
+		priv = stub_priv_pop_from_listhead(&sdev->tx_submits[q]);
+		if (priv)
+			goto done;
+	}
 
 	priv = stub_priv_pop_from_listhead(&sdev->priv_free);
 
@@ -222,6 +327,29 @@ done:
 	return priv;
 }
 
+/*
+ * Start cancelling every submitted urb without waiting for any of them, so
+ * that the host controller works on all of them at the same time. Their
+ * completions are ignored from now on; stub_device_cleanup_urbs() waits for
+ * them and frees them. Returns the number of urbs cancelled.
+ */
+int stub_device_unlink_urbs(struct stub_device *sdev)
+{
+	struct urb *urb;
+	int count = 0;
+
+	sdev->cancelling = 1;
+	smp_wmb();
+
+	while ((urb = usb_get_from_anchor(&sdev->submitted))) {
+		usb_unlink_urb(urb);
+		usb_put_urb(urb);
+		count++;
+	}
+
+	return count;
+}
+
 void stub_device_cleanup_urbs(struct stub_device *sdev)
 {
 	struct stub_priv *priv;
@@ -229,19 +357,228 @@ void stub_device_cleanup_urbs(struct stub_device *sdev)
 
 	dev_dbg(&sdev->udev->dev, "free sdev %p\n", sdev);
 
+	/* in case someone submitted after stub_device_unlink_urbs() */
+	stub_device_unlink_urbs(sdev);
+
+	/*
+	 * usb_kill_urb() returns at once for the urbs whose cancellation
+	 * has completed already, and waits for the others.
+	 */
 	while ((priv = stub_priv_pop(sdev))) {
 		urb = priv->urb;
 		dev_dbg(&sdev->udev->dev, "free urb %p\n", urb);
 		usb_kill_urb(urb);
 
-		kmem_cache_free(stub_priv_cache, priv);
+		stub_pool_put_priv(&sdev->pool, priv);
+	}
+
+	sdev->cancelling = 0;
+}
+
+/*
+ * The module-wide in-flight budget, shared by all exported devices. Each
+ * device has its own budget as well, see usbip_budget_* in stub_dev.c.
+ */
+static unsigned long max_inflight_bytes;
+module_param(max_inflight_bytes, ulong, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(max_inflight_bytes, "transfer bytes in flight on all "
+		 "devices (0 = no limit)");
+
+static unsigned int max_inflight_urbs;
+module_param(max_inflight_urbs, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(max_inflight_urbs, "requests in flight on all devices "
+		 "(0 = no limit)");
+
+static atomic_long_t inflight_bytes = ATOMIC_LONG_INIT(0);
+static atomic_t inflight_urbs = ATOMIC_INIT(0);
+
+/* devices waiting for the module-wide budget */
+static LIST_HEAD(throttled_devs);
+static DEFINE_SPINLOCK(throttled_lock);
+
+static int global_exhausted(void)
+{
+	unsigned long bytes = ACCESS_ONCE(max_inflight_bytes);
+	unsigned int urbs = ACCESS_ONCE(max_inflight_urbs);
+
+	return (bytes && atomic_long_read(&inflight_bytes) >= bytes) ||
+	       (urbs && atomic_read(&inflight_urbs) >= urbs);
+}
+
+static int device_exhausted(struct stub_device *sdev)
+{
+	unsigned int bytes = ACCESS_ONCE(sdev->budget_bytes);
+	unsigned int urbs = ACCESS_ONCE(sdev->budget_urbs);
+
+	return (bytes && atomic_long_read(&sdev->inflight_bytes) >= bytes) ||
+	       (urbs && atomic_read(&sdev->inflight_urbs) >= urbs);
+}
+
+void stub_budget_charge(struct stub_priv *priv, unsigned int len)
+{
+	struct stub_device *sdev = priv->sdev;
+
+	priv->charge = len;
+	priv->charged = 1;
+
+	atomic_long_add(len, &sdev->inflight_bytes);
+	atomic_inc(&sdev->inflight_urbs);
+	atomic_long_add(len, &inflight_bytes);
+	atomic_inc(&inflight_urbs);
+}
+
+static void stub_budget_wake(struct stub_device *sdev)
+{
+	sdev->throttled = 0;
+	wake_up(&sdev->budget_waitq);
+	usbip_queue_rx(&sdev->ud);
+}
+
+/* may be called in interrupt context */
+void stub_budget_uncharge(struct stub_priv *priv)
+{
+	struct stub_device *sdev = priv->sdev;
+	struct stub_device *waiter, *tmp;
+	unsigned long flags;
+
+	if (!priv->charged)
+		return;
+	priv->charged = 0;
+
+	atomic_long_sub(priv->charge, &sdev->inflight_bytes);
+	atomic_dec(&sdev->inflight_urbs);
+	atomic_long_sub(priv->charge, &inflight_bytes);
+	atomic_dec(&inflight_urbs);
+
+	/* pairs with the one in stub_budget_exhausted() */
+	smp_mb();
+
+	if (sdev->throttled && !device_exhausted(sdev))
+		stub_budget_wake(sdev);
+
+	if (list_empty(&throttled_devs) || global_exhausted())
+		return;
+
+	spin_lock_irqsave(&throttled_lock, flags);
+	list_for_each_entry_safe(waiter, tmp, &throttled_devs,
+				 throttled_list) {
+		list_del_init(&waiter->throttled_list);
+		stub_budget_wake(waiter);
+	}
+	spin_unlock_irqrestore(&throttled_lock, flags);
+}
+
+/* the budget of sdev has changed, let stub_rx look at it again */
+void stub_budget_update(struct stub_device *sdev)
+{
+	if (sdev->throttled)
+		stub_budget_wake(sdev);
+}
+
+/* forget that sdev waits for the budget */
+void stub_budget_stop(struct stub_device *sdev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&throttled_lock, flags);
+	list_del_init(&sdev->throttled_list);
+	spin_unlock_irqrestore(&throttled_lock, flags);
+
+	sdev->throttled = 0;
+}
+
+/*
+ * Whether stub_rx has to stop reading requests because the budget of sdev
+ * or the module-wide one is used up. If so, sdev is marked so that the
+ * uncharge that makes room again wakes stub_rx up.
+ */
+int stub_budget_exhausted(struct stub_device *sdev)
+{
+	unsigned long flags;
+
+	if (!device_exhausted(sdev) && !global_exhausted())
+		return 0;
+
+	sdev->throttled = 1;
+	if (global_exhausted()) {
+		spin_lock_irqsave(&throttled_lock, flags);
+		if (list_empty(&sdev->throttled_list))
+			list_add_tail(&sdev->throttled_list, &throttled_devs);
+		spin_unlock_irqrestore(&throttled_lock, flags);
+	}
+
+	/* pairs with the one in stub_budget_uncharge() */
+	smp_mb();
+
+	if (!device_exhausted(sdev) && !global_exhausted()) {
+		stub_budget_stop(sdev);
+		return 0;
+	}
+
+	sdev->throttle_count++;
+	return 1;
+}
+
+/*
+ * The credit window announced to the peer in the devid of RET_SUBMIT and
+ * RET_UNLINK, see usbip_protocol.txt: how much sdev may have in flight,
+ * given what the other devices use of the module-wide budget.
+ */
+__u32 stub_budget_credit(struct stub_device *sdev)
+{
+	unsigned long bytes = ACCESS_ONCE(sdev->budget_bytes);
+	unsigned long urbs = ACCESS_ONCE(sdev->budget_urbs);
+	unsigned long max_bytes = ACCESS_ONCE(max_inflight_bytes);
+	unsigned long max_urbs = ACCESS_ONCE(max_inflight_urbs);
+	int bytes_limited = bytes != 0, urbs_limited = urbs != 0;
+	unsigned long units, window;
+	long left;
+
+	if (max_bytes) {
+		left = max_bytes - atomic_long_read(&inflight_bytes);
+		window = atomic_long_read(&sdev->inflight_bytes) +
+			max_t(long, left, 0);
+		if (!bytes_limited || window < bytes)
+			bytes = window;
+		bytes_limited = 1;
+	}
 
-		kfree(urb->transfer_buffer);
-		kfree(urb->setup_packet);
-		usb_free_urb(urb);
+	if (max_urbs) {
+		left = max_urbs - atomic_read(&inflight_urbs);
+		window = atomic_read(&sdev->inflight_urbs) +
+			max_t(long, left, 0);
+		if (!urbs_limited || window < urbs)
+			urbs = window;
+		urbs_limited = 1;
 	}
+
+	/*
+	 * A window that is used up is still announced as one unit or urb,
+	 * which a client with nothing outstanding may send anyway, and a
+	 * limited one never as the value meaning no limit.
+	 */
+	if (bytes_limited)
+		units = clamp_t(unsigned long, bytes >> USBIP_CREDIT_UNIT_SHIFT,
+				1, USBIP_CREDIT_UNITS_MAX - 1);
+	else
+		units = USBIP_CREDIT_UNITS_MAX;
+
+	if (urbs_limited)
+		urbs = clamp_t(unsigned long, urbs, 1,
+			       USBIP_CREDIT_URBS_MAX - 1);
+	else
+		urbs = USBIP_CREDIT_URBS_MAX;
+
+	return USBIP_CREDIT_VALID | (units << 16) | urbs;
 }
 
+static ssize_t show_inflight(struct device_driver *drv, char *buf)
+{
+	return sprintf(buf, "urbs %d bytes %ld\n", atomic_read(&inflight_urbs),
+		       atomic_long_read(&inflight_bytes));
+}
+static DRIVER_ATTR(inflight, S_IRUSR, show_inflight, NULL);
+
 static int __init usbip_host_init(void)
 {
 	int ret;
@@ -267,9 +604,19 @@ static int __init usbip_host_init(void)
 		goto err_create_file;
 	}
 
+	ret = driver_create_file(&stub_driver.drvwrap.driver,
+				 &driver_attr_inflight);
+	if (ret < 0) {
+		pr_err("driver_create_file failed\n");
+		goto err_create_inflight;
+	}
+
 	pr_info(DRIVER_DESC " v" USBIP_VERSION "\n");
 	return ret;
 
+err_create_inflight:
+	driver_remove_file(&stub_driver.drvwrap.driver,
+			   &driver_attr_match_busid);
 err_create_file:
 	usb_deregister(&stub_driver);
 err_usb_register:
@@ -279,6 +626,8 @@ err_usb_register:
 
 static void __exit usbip_host_exit(void)
 {
+	driver_remove_file(&stub_driver.drvwrap.driver,
+			   &driver_attr_inflight);
 	driver_remove_file(&stub_driver.drvwrap.driver,
 			   &driver_attr_match_busid);
 
@@ -288,6 +637,7 @@ static void __exit usbip_host_exit(void)
 	 */
 	usb_deregister(&stub_driver);
 
+	free_busid_table();
 	kmem_cache_destroy(stub_priv_cache);
 }
 
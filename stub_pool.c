@@ -0,0 +1,532 @@
+/*
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+#include <linux/gfp.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/scatterlist.h>
+#include <linux/slab.h>
+#include <linux/usb.h>
+#include <linux/version.h>
+
+#include "usbip_common.h"
+#include "stub.h"
+
+/*
+ * Per-device recycling of the objects needed by every CMD_SUBMIT.
+ *
+ * A stub_priv is kept together with its urb. Pairs are classed by the
+ * number of iso packets the urb has room for, so that a streaming iso
+ * endpoint gets back an urb of the right size. Transfer buffers are kept in
+ * power-of-four size classes; a free buffer is linked through its first
+ * bytes. Objects that do not fit any class are allocated and freed as
+ * before. All lists are protected by pool->lock, which may be taken from
+ * the completion handler.
+ *
+ * Memory is allocated on the NUMA node of the host controller. With dma
+ * enabled, transfers that fit are given a buffer from usb_alloc_coherent()
+ * and submitted with URB_NO_TRANSFER_DMA_MAP, which saves mapping every urb
+ * through the IOMMU.
+ */
+
+static const int urb_class_packets[STUB_POOL_URB_CLASSES] = {
+	0, 8, 32, 128
+};
+
+static const int urb_class_depth[STUB_POOL_URB_CLASSES] = {
+	64, 32, 32, 16
+};
+
+static const size_t buf_class_size[STUB_POOL_BUF_CLASSES] = {
+	512, 2048, 8192, 32768, 131072
+};
+
+static const int buf_class_depth[STUB_POOL_BUF_CLASSES] = {
+	64, 64, 32, 16, 8
+};
+
+struct stub_pool_buf {
+	struct list_head list;
+};
+
+static int urb_class(int number_of_packets)
+{
+	int i;
+
+	for (i = 0; i < STUB_POOL_URB_CLASSES; i++)
+		if (number_of_packets <= urb_class_packets[i])
+			return i;
+
+	return -1;
+}
+
+static int buf_class(size_t size)
+{
+	int i;
+
+	for (i = 0; i < STUB_POOL_BUF_CLASSES; i++)
+		if (size <= buf_class_size[i])
+			return i;
+
+	return -1;
+}
+
+/*
+ * The host controller drops its reference to an urb only after the
+ * completion handler has returned, so an urb may be recycled only once we
+ * hold the last reference.
+ */
+static int urb_idle(struct urb *urb)
+{
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0))
+	return kref_read(&urb->kref) == 1;
+#else
+	return atomic_read(&urb->kref.refcount) == 1;
+#endif
+}
+
+void stub_pool_init(struct stub_pool *pool, struct usb_device *udev)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+	spin_lock_init(&pool->lock);
+
+	pool->udev = udev;
+	pool->node = dev_to_node(udev->bus->controller);
+	pool->dma_size = STUB_DMA_SIZE;
+	pool->dma_bufs = STUB_DMA_BUFS;
+	INIT_LIST_HEAD(&pool->dma_free);
+
+	for (i = 0; i < STUB_POOL_URB_CLASSES; i++)
+		INIT_LIST_HEAD(&pool->urbs[i]);
+	for (i = 0; i < STUB_POOL_BUF_CLASSES; i++)
+		INIT_LIST_HEAD(&pool->bufs[i]);
+}
+
+/* free everything held by the pool; no request may be in flight */
+void stub_pool_drain(struct stub_pool *pool)
+{
+	struct stub_priv *priv, *ptmp;
+	struct stub_pool_buf *buf, *btmp;
+	unsigned long flags;
+	LIST_HEAD(privs);
+	LIST_HEAD(bufs);
+	int i;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	for (i = 0; i < STUB_POOL_URB_CLASSES; i++) {
+		list_splice_init(&pool->urbs[i], &privs);
+		pool->nr_urbs[i] = 0;
+	}
+	for (i = 0; i < STUB_POOL_BUF_CLASSES; i++) {
+		list_splice_init(&pool->bufs[i], &bufs);
+		pool->nr_bufs[i] = 0;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	list_for_each_entry_safe(priv, ptmp, &privs, list) {
+		list_del(&priv->list);
+		usb_free_urb(priv->urb);
+		kmem_cache_free(stub_priv_cache, priv);
+	}
+
+	list_for_each_entry_safe(buf, btmp, &bufs, list) {
+		list_del(&buf->list);
+		kfree(buf);
+	}
+
+	stub_pool_dma_release(pool);
+}
+
+/**
+ * stub_pool_get_priv - get a stub_priv with an urb attached
+ * @pool: pool of the stub device
+ * @number_of_packets: iso packets the urb must have room for
+ * @mem_flags: allocation flags used on a pool miss
+ *
+ * The returned stub_priv is zeroed except for priv->urb, which is freshly
+ * initialized.
+ */
+struct stub_priv *stub_pool_get_priv(struct stub_pool *pool,
+				     int number_of_packets, gfp_t mem_flags)
+{
+	struct stub_priv *priv = NULL;
+	struct urb *urb;
+	unsigned long flags;
+	int class = urb_class(number_of_packets);
+
+	if (class >= 0) {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (!list_empty(&pool->urbs[class])) {
+			priv = list_first_entry(&pool->urbs[class],
+						struct stub_priv, list);
+			list_del(&priv->list);
+			pool->nr_urbs[class]--;
+			pool->urb_hit++;
+		} else {
+			pool->urb_miss++;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+	}
+
+	if (priv) {
+		urb = priv->urb;
+		memset(priv, 0, sizeof(*priv));
+
+		usb_init_urb(urb);
+		if (number_of_packets)
+			memset(urb->iso_frame_desc, 0, number_of_packets *
+			       sizeof(struct usb_iso_packet_descriptor));
+		priv->urb = urb;
+		priv->urb_class = class;
+
+		return priv;
+	}
+
+	priv = kmem_cache_zalloc(stub_priv_cache, mem_flags);
+	if (!priv)
+		return NULL;
+
+	urb = usb_alloc_urb(class >= 0 ? urb_class_packets[class] :
+			    number_of_packets, mem_flags);
+	if (!urb) {
+		kmem_cache_free(stub_priv_cache, priv);
+		return NULL;
+	}
+
+	priv->urb = urb;
+	priv->urb_class = class;
+
+	return priv;
+}
+
+/**
+ * stub_pool_get_buf - allocate the transfer buffer of a request
+ * @pool: pool of the stub device
+ * @priv: request the buffer belongs to
+ * @size: transfer_buffer_length
+ * @mem_flags: allocation flags used on a pool miss
+ *
+ * The buffer is owned by priv and given back by stub_pool_put_priv(), even
+ * if urb->transfer_buffer has been replaced in the meantime. Unlike the
+ * kzalloc() it replaces, a recycled buffer is not cleared.
+ */
+void *stub_pool_get_buf(struct stub_pool *pool, struct stub_priv *priv,
+			size_t size, gfp_t mem_flags)
+{
+	void *buf = NULL;
+	unsigned long flags;
+	int class = buf_class(size);
+
+	if (class >= 0) {
+		spin_lock_irqsave(&pool->lock, flags);
+		if (!list_empty(&pool->bufs[class])) {
+			struct stub_pool_buf *pbuf;
+
+			pbuf = list_first_entry(&pool->bufs[class],
+						struct stub_pool_buf, list);
+			list_del(&pbuf->list);
+			pool->nr_bufs[class]--;
+			pool->buf_hit++;
+			buf = pbuf;
+		} else {
+			pool->buf_miss++;
+		}
+		spin_unlock_irqrestore(&pool->lock, flags);
+
+		if (!buf)
+			buf = kmalloc_node(buf_class_size[class], mem_flags,
+					   pool->node);
+	} else {
+		buf = kmalloc_node(size, mem_flags, pool->node);
+	}
+
+	if (!buf)
+		return NULL;
+
+	priv->xbuf = buf;
+	priv->xbuf_class = class;
+
+	return buf;
+}
+
+/**
+ * stub_pool_get_dma - give a request a pre-mapped transfer buffer
+ * @pool: pool of the stub device
+ * @priv: request the buffer belongs to
+ * @size: transfer_buffer_length
+ * @mem_flags: allocation flags, must allow sleeping
+ *
+ * On success priv->urb->transfer_dma is set and the buffer is returned; the
+ * caller sets URB_NO_TRANSFER_DMA_MAP. Returns NULL if dma is off, @size
+ * does not fit or all buffers are in use.
+ */
+void *stub_pool_get_dma(struct stub_pool *pool, struct stub_priv *priv,
+			size_t size, gfp_t mem_flags)
+{
+	struct stub_dma_buf *dbuf = NULL, *stale = NULL, *pos;
+	unsigned long flags;
+	size_t dma_size = ACCESS_ONCE(pool->dma_size);
+	int alloc = 0;
+
+	if (!ACCESS_ONCE(pool->dma) || size > dma_size)
+		return NULL;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_for_each_entry(pos, &pool->dma_free, list) {
+		if (pos->size >= size) {
+			dbuf = pos;
+			break;
+		}
+	}
+	if (dbuf) {
+		list_del(&dbuf->list);
+		pool->dma_hit++;
+	} else if (!list_empty(&pool->dma_free)) {
+		/*
+		 * Only buffers left from before dma_size was raised: replace
+		 * one of them, which keeps its place in nr_dma.
+		 */
+		stale = list_first_entry(&pool->dma_free, struct stub_dma_buf,
+					 list);
+		list_del(&stale->list);
+		alloc = 1;
+		pool->dma_miss++;
+	} else {
+		if (pool->nr_dma < (int) pool->dma_bufs) {
+			pool->nr_dma++;
+			alloc = 1;
+		}
+		pool->dma_miss++;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	if (stale) {
+		usb_free_coherent(pool->udev, stale->size, stale->vaddr,
+				  stale->dma);
+		kfree(stale);
+	}
+
+	if (alloc) {
+		dbuf = kmalloc_node(sizeof(*dbuf), mem_flags, pool->node);
+		if (dbuf) {
+			dbuf->size = dma_size;
+			dbuf->vaddr = usb_alloc_coherent(pool->udev, dma_size,
+							 mem_flags, &dbuf->dma);
+		}
+		if (!dbuf || !dbuf->vaddr) {
+			kfree(dbuf);
+			spin_lock_irqsave(&pool->lock, flags);
+			pool->nr_dma--;
+			spin_unlock_irqrestore(&pool->lock, flags);
+			return NULL;
+		}
+	}
+
+	if (!dbuf)
+		return NULL;
+
+	priv->dma_buf = dbuf;
+	priv->urb->transfer_dma = dbuf->dma;
+
+	return dbuf->vaddr;
+}
+
+/* free the pre-mapped buffers not in use; must be able to sleep */
+void stub_pool_dma_release(struct stub_pool *pool)
+{
+	struct stub_dma_buf *dbuf, *tmp;
+	unsigned long flags;
+	LIST_HEAD(free);
+
+	spin_lock_irqsave(&pool->lock, flags);
+	list_for_each_entry_safe(dbuf, tmp, &pool->dma_free, list) {
+		list_move(&dbuf->list, &free);
+		pool->nr_dma--;
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	list_for_each_entry_safe(dbuf, tmp, &free, list) {
+		list_del(&dbuf->list);
+		usb_free_coherent(pool->udev, dbuf->size, dbuf->vaddr,
+				  dbuf->dma);
+		kfree(dbuf);
+	}
+}
+
+/*
+ * A buffer sent by reference (see usbip_xmit_batch_add_buf()) may still be
+ * queued in the socket. It is freed rather than recycled then; kfree() only
+ * drops our reference to its pages.
+ */
+static int buf_busy(void *buf)
+{
+	struct page *page = virt_to_head_page(buf);
+
+	return !PageSlab(page) && page_count(page) > 1;
+}
+
+static void stub_pool_free_sg(struct stub_priv *priv)
+{
+	struct scatterlist *sg;
+	int i;
+
+	if (!priv->sgl)
+		return;
+
+	for_each_sg(priv->sgl, sg, priv->nents, i)
+		if (sg_page(sg))
+			__free_page(sg_page(sg));
+
+	kfree(priv->sgl);
+	priv->sgl = NULL;
+	priv->nents = 0;
+}
+
+/**
+ * stub_pool_get_sg - back the transfer buffer of a request with pages
+ * @pool: pool of the stub device
+ * @priv: request the pages belong to
+ * @size: transfer_buffer_length
+ * @mem_flags: allocation flags
+ *
+ * Builds a scatterlist of order-0 lowmem pages covering @size bytes and
+ * attaches it to priv->urb as urb->sg, so that no contiguous buffer is
+ * needed. The pages are freed by stub_pool_put_priv().
+ */
+int stub_pool_get_sg(struct stub_pool *pool, struct stub_priv *priv,
+		     size_t size, gfp_t mem_flags)
+{
+	struct scatterlist *sg;
+	int nents = DIV_ROUND_UP(size, PAGE_SIZE);
+	int i;
+
+	priv->sgl = kmalloc(nents * sizeof(*priv->sgl), mem_flags);
+	if (!priv->sgl)
+		return -ENOMEM;
+
+	sg_init_table(priv->sgl, nents);
+	priv->nents = nents;
+
+	for_each_sg(priv->sgl, sg, nents, i) {
+		struct page *page = alloc_pages_node(pool->node, mem_flags, 0);
+		size_t len = min_t(size_t, size, PAGE_SIZE);
+
+		if (!page) {
+			stub_pool_free_sg(priv);
+			return -ENOMEM;
+		}
+
+		sg_set_page(sg, page, len, 0);
+		size -= len;
+	}
+
+	priv->urb->sg = priv->sgl;
+	priv->urb->num_sgs = nents;
+	priv->urb->transfer_buffer = NULL;
+
+	return 0;
+}
+
+/* give back priv, its urb and its transfer buffer; priv must be unlinked */
+void stub_pool_put_priv(struct stub_pool *pool, struct stub_priv *priv)
+{
+	struct urb *urb = priv->urb;
+	void *xbuf = priv->xbuf;
+	struct stub_dma_buf *dbuf = priv->dma_buf;
+	int uclass = priv->urb_class;
+	int bclass = priv->xbuf_class;
+	unsigned long flags;
+
+	stub_budget_uncharge(priv);
+	stub_pool_free_sg(priv);
+
+	/* a merged transfer that has not handed back its pieces */
+	if (priv->npieces) {
+		struct stub_priv *piece, *tmp;
+
+		list_for_each_entry_safe(piece, tmp, &priv->pieces, list) {
+			list_del(&piece->list);
+			stub_pool_put_priv(pool, piece);
+		}
+		priv->npieces = 0;
+	}
+
+	if (urb && uclass >= 0 && !urb_idle(urb))
+		uclass = -1;
+
+	spin_lock_irqsave(&pool->lock, flags);
+
+	if (dbuf)
+		list_add(&dbuf->list, &pool->dma_free);
+
+	if (xbuf && bclass >= 0 && !buf_busy(xbuf) &&
+	    pool->nr_bufs[bclass] < buf_class_depth[bclass]) {
+		struct stub_pool_buf *pbuf = xbuf;
+
+		list_add(&pbuf->list, &pool->bufs[bclass]);
+		pool->nr_bufs[bclass]++;
+		xbuf = NULL;
+	}
+
+	if (urb && uclass >= 0 &&
+	    pool->nr_urbs[uclass] < urb_class_depth[uclass]) {
+		list_add(&priv->list, &pool->urbs[uclass]);
+		pool->nr_urbs[uclass]++;
+		urb = NULL;
+		priv = NULL;
+	}
+
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	kfree(xbuf);
+	if (priv) {
+		usb_free_urb(urb);
+		kmem_cache_free(stub_priv_cache, priv);
+	}
+}
+
+ssize_t stub_pool_show(struct stub_pool *pool, char *buf)
+{
+	unsigned long flags;
+	unsigned long urb_hit, urb_miss, buf_hit, buf_miss, dma_hit, dma_miss;
+	int nr_urbs = 0, nr_bufs = 0, nr_dma;
+	int i;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	urb_hit = pool->urb_hit;
+	urb_miss = pool->urb_miss;
+	buf_hit = pool->buf_hit;
+	buf_miss = pool->buf_miss;
+	dma_hit = pool->dma_hit;
+	dma_miss = pool->dma_miss;
+	nr_dma = pool->nr_dma;
+	for (i = 0; i < STUB_POOL_URB_CLASSES; i++)
+		nr_urbs += pool->nr_urbs[i];
+	for (i = 0; i < STUB_POOL_BUF_CLASSES; i++)
+		nr_bufs += pool->nr_bufs[i];
+	spin_unlock_irqrestore(&pool->lock, flags);
+
+	return snprintf(buf, PAGE_SIZE,
+			"urb hit %lu miss %lu free %d\n"
+			"buf hit %lu miss %lu free %d\n"
+			"dma hit %lu miss %lu allocated %d\n",
+			urb_hit, urb_miss, nr_urbs,
+			buf_hit, buf_miss, nr_bufs,
+			dma_hit, dma_miss, nr_dma);
+}
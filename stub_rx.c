@@ -19,50 +19,43 @@
 
 #include <asm/byteorder.h>
 #include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 
 #include "usbip_common.h"
 #include "stub.h"
 
-static int is_clear_halt_cmd(struct urb *urb)
-{
-	struct usb_ctrlrequest *req;
-
-	req = (struct usb_ctrlrequest *) urb->setup_packet;
+static unsigned int sg_min_size = 64 * 1024;
+module_param(sg_min_size, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(sg_min_size, "smallest bulk transfer backed by a page list "
+		 "instead of one contiguous buffer (0 = never)");
 
+static int is_clear_halt_cmd(struct usb_ctrlrequest *req)
+{
 	 return (req->bRequest == USB_REQ_CLEAR_FEATURE) &&
 		 (req->bRequestType == USB_RECIP_ENDPOINT) &&
 		 (req->wValue == USB_ENDPOINT_HALT);
 }
 
-static int is_set_interface_cmd(struct urb *urb)
+static int is_set_interface_cmd(struct usb_ctrlrequest *req)
 {
-	struct usb_ctrlrequest *req;
-
-	req = (struct usb_ctrlrequest *) urb->setup_packet;
-
 	return (req->bRequest == USB_REQ_SET_INTERFACE) &&
 		(req->bRequestType == USB_RECIP_INTERFACE);
 }
 
-static int is_set_configuration_cmd(struct urb *urb)
+static int is_set_configuration_cmd(struct usb_ctrlrequest *req)
 {
-	struct usb_ctrlrequest *req;
-
-	req = (struct usb_ctrlrequest *) urb->setup_packet;
-
 	return (req->bRequest == USB_REQ_SET_CONFIGURATION) &&
 		(req->bRequestType == USB_RECIP_DEVICE);
 }
 
-static int is_reset_device_cmd(struct urb *urb)
+static int is_reset_device_cmd(struct usb_ctrlrequest *req)
 {
-	struct usb_ctrlrequest *req;
 	__u16 value;
 	__u16 index;
 
-	req = (struct usb_ctrlrequest *) urb->setup_packet;
 	value = le16_to_cpu(req->wValue);
 	index = le16_to_cpu(req->wIndex);
 
@@ -75,6 +68,13 @@ static int is_reset_device_cmd(struct urb *urb)
 		return 0;
 }
 
+/* the requests that tweak_special_requests() waits on the device for */
+static int is_blocking_request(struct usb_ctrlrequest *req)
+{
+	return is_clear_halt_cmd(req) || is_set_interface_cmd(req) ||
+		is_reset_device_cmd(req);
+}
+
 static int tweak_clear_halt_cmd(struct urb *urb)
 {
 	struct usb_ctrlrequest *req;
@@ -113,6 +113,7 @@ static int tweak_clear_halt_cmd(struct urb *urb)
 
 static int tweak_set_interface_cmd(struct urb *urb)
 {
+	struct stub_priv *priv = (struct stub_priv *) urb->context;
 	struct usb_ctrlrequest *req;
 	__u16 alternate;
 	__u16 interface;
@@ -125,7 +126,9 @@ static int tweak_set_interface_cmd(struct urb *urb)
 	usbip_dbg_stub_rx("set_interface: inf %u alt %u\n",
 			  interface, alternate);
 
+	stub_ep_free_streams(priv->sdev);
 	ret = usb_set_interface(urb->dev, interface, alternate);
+	priv->sdev->ep_stale = 1;
 	if (ret < 0)
 		dev_err(&urb->dev->dev, "usb_set_interface error: inf %u alt "
 			"%u ret %d\n", interface, alternate, ret);
@@ -138,6 +141,7 @@ static int tweak_set_interface_cmd(struct urb *urb)
 
 static int tweak_set_configuration_cmd(struct urb *urb)
 {
+	struct stub_priv *priv = (struct stub_priv *) urb->context;
 	struct usb_ctrlrequest *req;
 	__u16 config;
 
@@ -162,6 +166,7 @@ static int tweak_set_configuration_cmd(struct urb *urb)
 	 */
 	dev_info(&urb->dev->dev, "usb_set_configuration %d to %s... skip!\n",
 		 config, dev_name(&urb->dev->dev));
+	priv->sdev->ep_stale = 1;
 
 	return 0;
 }
@@ -182,6 +187,7 @@ static int tweak_reset_device_cmd(struct urb *urb)
 		dev_err(&urb->dev->dev, "could not obtain lock to reset device\n");
 		return 0;
 	}
+	stub_ep_free_streams(sdev);
 	usb_reset_device(sdev->udev);
 	usb_unlock_device(sdev->udev);
 
@@ -193,30 +199,47 @@ static int tweak_reset_device_cmd(struct urb *urb)
  */
 static void tweak_special_requests(struct urb *urb)
 {
+	struct usb_ctrlrequest *req;
+
 	if (!urb || !urb->setup_packet)
 		return;
 
 	if (usb_pipetype(urb->pipe) != PIPE_CONTROL)
 		return;
 
-	if (is_clear_halt_cmd(urb))
+	req = (struct usb_ctrlrequest *) urb->setup_packet;
+
+	if (is_clear_halt_cmd(req))
 		/* tweak clear_halt */
 		 tweak_clear_halt_cmd(urb);
 
-	else if (is_set_interface_cmd(urb))
+	else if (is_set_interface_cmd(req))
 		/* tweak set_interface */
 		tweak_set_interface_cmd(urb);
 
-	else if (is_set_configuration_cmd(urb))
+	else if (is_set_configuration_cmd(req))
 		/* tweak set_configuration */
 		tweak_set_configuration_cmd(urb);
 
-	else if (is_reset_device_cmd(urb))
+	else if (is_reset_device_cmd(req))
 		tweak_reset_device_cmd(urb);
 	else
 		usbip_dbg_stub_rx("no need to tweak\n");
 }
 
+/* the piece of a merged transfer with seqnum, if any */
+static struct stub_priv *stub_merge_find(struct stub_priv *carrier,
+					 unsigned long seqnum)
+{
+	struct stub_priv *priv;
+
+	list_for_each_entry(priv, &carrier->pieces, list)
+		if (priv->seqnum == seqnum)
+			return priv;
+
+	return NULL;
+}
+
 /*
  * stub_recv_unlink() unlinks the URB by a call to usb_unlink_urb().
  * By unlinking the urb asynchronously, stub_rx can continuously
@@ -235,7 +258,13 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 	spin_lock_irqsave(&sdev->priv_lock, flags);
 
 	list_for_each_entry(priv, &sdev->priv_init, list) {
-		if (priv->seqnum != pdu->u.cmd_unlink.seqnum)
+		struct stub_priv *target = priv;
+
+		if (priv->npieces)
+			target = stub_merge_find(priv, pdu->u.cmd_unlink.seqnum);
+		else if (priv->seqnum != pdu->u.cmd_unlink.seqnum)
+			target = NULL;
+		if (!target)
 			continue;
 
 		dev_info(&priv->urb->dev->dev, "unlink urb %p\n",
@@ -249,7 +278,7 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 * submission request, but going to return a result pdu
 		 * of the unlink request.
 		 */
-		priv->unlinking = 1;
+		target->unlinking = 1;
 
 		/*
 		 * In the case that unlinking flag is on, prev->seqnum
@@ -257,10 +286,19 @@ static int stub_recv_cmd_unlink(struct stub_device *sdev,
 		 * the seqnum of the unlink request. This will be used
 		 * to make the result pdu of the unlink request.
 		 */
-		priv->seqnum = pdu->base.seqnum;
+		target->seqnum = pdu->base.seqnum;
 
 		spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
+		/*
+		 * A piece of a merged transfer cannot be cancelled without
+		 * its siblings, which the peer did not unlink. The transfer
+		 * is left to finish, and stub_merge_complete() answers the
+		 * unlink with the outcome of the piece.
+		 */
+		if (target != priv)
+			return 0;
+
 		/*
 		 * usb_unlink_urb() is now out of spinlocking to avoid
 		 * spinlock recursion since stub_complete() is
@@ -319,122 +357,70 @@ static int valid_request(struct stub_device *sdev, struct usbip_header *pdu)
 }
 
 static struct stub_priv *stub_priv_alloc(struct stub_device *sdev,
-					 struct usbip_header *pdu)
+					 struct usbip_header *pdu,
+					 int number_of_packets)
 {
 	struct stub_priv *priv;
 	struct usbip_device *ud = &sdev->ud;
 	unsigned long flags;
 
-	spin_lock_irqsave(&sdev->priv_lock, flags);
-
-	priv = kmem_cache_zalloc(stub_priv_cache, GFP_ATOMIC);
+	priv = stub_pool_get_priv(&sdev->pool, number_of_packets, GFP_KERNEL);
 	if (!priv) {
 		dev_err(&sdev->interface->dev, "alloc stub_priv\n");
-		spin_unlock_irqrestore(&sdev->priv_lock, flags);
 		usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
 		return NULL;
 	}
 
 	priv->seqnum = pdu->base.seqnum;
 	priv->sdev = sdev;
+	stub_budget_charge(priv, pdu->u.cmd_submit.transfer_buffer_length);
 
 	/*
 	 * After a stub_priv is linked to a list_head,
 	 * our error handler can free allocated data.
 	 */
+	spin_lock_irqsave(&sdev->priv_lock, flags);
 	list_add_tail(&priv->list, &sdev->priv_init);
-
 	spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
 	return priv;
 }
 
-static int get_pipe(struct stub_device *sdev, int epnum, int dir)
+static unsigned int ep_pipe(struct usb_device *udev, int epnum, int dir,
+			    int type)
 {
-	struct usb_device *udev = sdev->udev;
-	struct usb_host_endpoint *ep;
-	struct usb_endpoint_descriptor *epd = NULL;
-
-	if (dir == USBIP_DIR_IN)
-		ep = udev->ep_in[epnum & 0x7f];
-	else
-		ep = udev->ep_out[epnum & 0x7f];
-	if (!ep) {
-		dev_err(&sdev->interface->dev, "no such endpoint?, %d\n",
-			epnum);
-		BUG();
-	}
-
-	epd = &ep->desc;
-	if (usb_endpoint_xfer_control(epd)) {
+	switch (type) {
+	case USB_ENDPOINT_XFER_CONTROL:
 		if (dir == USBIP_DIR_OUT)
 			return usb_sndctrlpipe(udev, epnum);
 		else
 			return usb_rcvctrlpipe(udev, epnum);
-	}
-
-	if (usb_endpoint_xfer_bulk(epd)) {
+	case USB_ENDPOINT_XFER_BULK:
 		if (dir == USBIP_DIR_OUT)
 			return usb_sndbulkpipe(udev, epnum);
 		else
 			return usb_rcvbulkpipe(udev, epnum);
-	}
-
-	if (usb_endpoint_xfer_int(epd)) {
+	case USB_ENDPOINT_XFER_INT:
 		if (dir == USBIP_DIR_OUT)
 			return usb_sndintpipe(udev, epnum);
 		else
 			return usb_rcvintpipe(udev, epnum);
-	}
-
-	if (usb_endpoint_xfer_isoc(epd)) {
+	default:
 		if (dir == USBIP_DIR_OUT)
 			return usb_sndisocpipe(udev, epnum);
 		else
 			return usb_rcvisocpipe(udev, epnum);
 	}
-
-	/* NOT REACHED */
-	dev_err(&sdev->interface->dev, "get pipe, epnum %d\n", epnum);
-	return 0;
 }
 
-static void masking_bogus_flags(struct urb *urb)
+/* the simple/standard policy of usb_submit_urb() */
+static unsigned int ep_allowed_flags(int type, int is_out)
 {
-	int				xfertype;
-	struct usb_device		*dev;
-	struct usb_host_endpoint	*ep;
-	int				is_out;
-	unsigned int	allowed;
-
-	if (!urb || urb->hcpriv || !urb->complete)
-		return;
-	dev = urb->dev;
-	if ((!dev) || (dev->state < USB_STATE_UNAUTHENTICATED))
-		return;
-
-	ep = (usb_pipein(urb->pipe) ? dev->ep_in : dev->ep_out)
-		[usb_pipeendpoint(urb->pipe)];
-	if (!ep)
-		return;
+	unsigned int allowed;
 
-	xfertype = usb_endpoint_type(&ep->desc);
-	if (xfertype == USB_ENDPOINT_XFER_CONTROL) {
-		struct usb_ctrlrequest *setup =
-			(struct usb_ctrlrequest *) urb->setup_packet;
-
-		if (!setup)
-			return;
-		is_out = !(setup->bRequestType & USB_DIR_IN) ||
-			!setup->wLength;
-	} else {
-		is_out = usb_endpoint_dir_out(&ep->desc);
-	}
-
-	/* enforce simple/standard policy */
 	allowed = (URB_NO_TRANSFER_DMA_MAP | URB_NO_INTERRUPT |
 		   URB_DIR_MASK | URB_FREE_BUFFER);
-	switch (xfertype) {
+	switch (type) {
 	case USB_ENDPOINT_XFER_BULK:
 		if (is_out)
 			allowed |= URB_ZERO_PACKET;
@@ -450,7 +436,184 @@ static void masking_bogus_flags(struct urb *urb)
 		allowed |= URB_ISO_ASAP;
 		break;
 	}
-	urb->transfer_flags &= allowed;
+
+	return allowed;
+}
+
+static void ep_ctx_init(struct stub_ep *ctx, struct stub_device *sdev,
+			struct usb_host_endpoint *ep, int epnum, int dir)
+{
+	struct usb_device *udev = sdev->udev;
+	struct usb_endpoint_descriptor *epd;
+	int is_out;
+
+	memset(ctx, 0, sizeof(*ctx));
+	if (!ep) {
+		ctx->type = -1;
+		return;
+	}
+
+	epd = &ep->desc;
+	ctx->type = usb_endpoint_type(epd);
+	ctx->pipe = ep_pipe(udev, epnum, dir, ctx->type);
+	ctx->maxpacket = le16_to_cpu(epd->wMaxPacketSize) & 0x7ff;
+
+	if (ctx->type == USB_ENDPOINT_XFER_CONTROL) {
+		ctx->allowed[0] = ep_allowed_flags(ctx->type, 0);
+		ctx->allowed[1] = ep_allowed_flags(ctx->type, 1);
+		ctx->tweak = 1;
+	} else {
+		is_out = usb_endpoint_dir_out(epd);
+		ctx->allowed[0] = ctx->allowed[1] =
+			ep_allowed_flags(ctx->type, is_out);
+	}
+
+	ctx->hep = ep;
+	if (udev->speed == USB_SPEED_SUPER)
+		ctx->max_streams = usbip_ep_max_streams(ep);
+
+	/* requests on different streams cannot share one transfer */
+	ctx->merge = ctx->type == USB_ENDPOINT_XFER_BULK &&
+		dir == USBIP_DIR_OUT && ctx->maxpacket &&
+		!ctx->max_streams &&
+		(ACCESS_ONCE(sdev->merge_mask) & (1 << epnum));
+}
+
+/* (re)compute the endpoint contexts from the current configuration */
+void stub_ep_build(struct stub_device *sdev)
+{
+	struct usb_device *udev = sdev->udev;
+	int i;
+
+	sdev->ep_stale = 0;
+	smp_mb();
+
+	for (i = 0; i < STUB_EP_MAX; i++) {
+		ep_ctx_init(&sdev->ep_ctx[USBIP_DIR_OUT][i], sdev,
+			    udev->ep_out[i], i, USBIP_DIR_OUT);
+		ep_ctx_init(&sdev->ep_ctx[USBIP_DIR_IN][i], sdev,
+			    udev->ep_in[i], i, USBIP_DIR_IN);
+	}
+}
+
+static struct stub_ep *stub_get_ep(struct stub_device *sdev, int epnum,
+				   int dir)
+{
+	if (sdev->ep_stale)
+		stub_ep_build(sdev);
+
+	if (epnum < 0 || epnum >= STUB_EP_MAX)
+		return NULL;
+
+	return &sdev->ep_ctx[dir == USBIP_DIR_IN][epnum];
+}
+
+/* set up the streams of an endpoint on its first stream request */
+static int stub_ep_streams(struct stub_device *sdev, struct stub_ep *ep,
+			   int epnum, int dir)
+{
+	unsigned int *streams = &sdev->streams[dir == USBIP_DIR_IN][epnum];
+	struct usb_host_endpoint *hep = ep->hep;
+	int ret;
+
+	if (*streams)
+		return 0;
+
+	if (!ep->max_streams) {
+		dev_err(&sdev->interface->dev, "ep %d has no streams\n", epnum);
+		return -EINVAL;
+	}
+
+	ret = usb_alloc_streams(sdev->interface, &hep, 1, ep->max_streams,
+				GFP_KERNEL);
+	if (ret < 0) {
+		dev_err(&sdev->interface->dev, "alloc streams on ep %d, %d\n",
+			epnum, ret);
+		return ret;
+	}
+
+	usbip_dbg_stub_rx("%d streams on ep %d\n", ret, epnum);
+	*streams = ret;
+	return 0;
+}
+
+void stub_ep_free_streams(struct stub_device *sdev)
+{
+	struct usb_device *udev = sdev->udev;
+	struct usb_host_endpoint *hep;
+	int i;
+
+	for (i = 0; i < STUB_EP_MAX; i++) {
+		if (sdev->streams[USBIP_DIR_OUT][i]) {
+			hep = udev->ep_out[i];
+			if (hep)
+				usb_free_streams(sdev->interface, &hep, 1,
+						 GFP_KERNEL);
+			sdev->streams[USBIP_DIR_OUT][i] = 0;
+		}
+		if (sdev->streams[USBIP_DIR_IN][i]) {
+			hep = udev->ep_in[i];
+			if (hep)
+				usb_free_streams(sdev->interface, &hep, 1,
+						 GFP_KERNEL);
+			sdev->streams[USBIP_DIR_IN][i] = 0;
+		}
+	}
+}
+
+static void masking_bogus_flags(struct urb *urb, struct stub_ep *ep)
+{
+	int is_out;
+
+	if (!urb || urb->hcpriv || !urb->complete)
+		return;
+	if ((!urb->dev) || (urb->dev->state < USB_STATE_UNAUTHENTICATED))
+		return;
+
+	if (ep->type == USB_ENDPOINT_XFER_CONTROL) {
+		struct usb_ctrlrequest *setup =
+			(struct usb_ctrlrequest *) urb->setup_packet;
+
+		if (!setup)
+			return;
+		is_out = !(setup->bRequestType & USB_DIR_IN) ||
+			!setup->wLength;
+	} else {
+		is_out = usb_pipeout(urb->pipe);
+	}
+
+	urb->transfer_flags &= ep->allowed[is_out];
+}
+
+/*
+ * Large bulk transfers are built as scatter-gather urbs if the host
+ * controller can take them. Filters work on urb->transfer_buffer, so no
+ * filter may be attached.
+ */
+static int stub_use_sg(struct stub_device *sdev, int pipe, size_t size)
+{
+	unsigned int sg_tablesize = sdev->udev->bus->sg_tablesize;
+
+	if (!sg_min_size || size < sg_min_size || !usb_pipebulk(pipe))
+		return 0;
+
+	if (!sg_tablesize || DIV_ROUND_UP(size, PAGE_SIZE) > sg_tablesize)
+		return 0;
+
+	return list_empty(&sdev->ud.filters);
+}
+
+/*
+ * Pre-mapped buffers are handed out when enabled for the device. Filters
+ * may replace urb->transfer_buffer, so not while one is attached.
+ */
+static void *stub_get_dma(struct stub_device *sdev, struct stub_priv *priv,
+			  size_t size)
+{
+	if (!list_empty(&sdev->ud.filters))
+		return NULL;
+
+	return stub_pool_get_dma(&sdev->pool, priv, size, GFP_KERNEL);
 }
 
 struct urb *stub_build_urb(struct stub_device *sdev,
@@ -459,48 +622,53 @@ struct urb *stub_build_urb(struct stub_device *sdev,
 	struct stub_priv *priv;
 	struct usbip_device *ud = &sdev->ud;
 	struct usb_device *udev = sdev->udev;
-	int pipe = get_pipe(sdev, pdu->base.ep, pdu->base.direction);
+	struct stub_ep *ep = stub_get_ep(sdev, pdu->base.ep,
+					 pdu->base.direction);
+	int pipe;
 
-	priv = stub_priv_alloc(sdev, pdu);
-	if (!priv)
-		return NULL;
+	if (!ep || ep->type < 0) {
+		dev_err(&sdev->interface->dev, "no such endpoint?, %d\n",
+			pdu->base.ep);
+		BUG();
+	}
+	pipe = ep->pipe;
 
 	/* setup a urb */
-	if (usb_pipeisoc(pipe))
-		priv->urb = usb_alloc_urb(pdu->u.cmd_submit.number_of_packets,
-					  GFP_KERNEL);
-	else
-		priv->urb = usb_alloc_urb(0, GFP_KERNEL);
-
-	if (!priv->urb) {
-		dev_err(&sdev->interface->dev, "malloc urb\n");
-		usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
+	priv = stub_priv_alloc(sdev, pdu, usb_pipeisoc(pipe) ?
+			       pdu->u.cmd_submit.number_of_packets : 0);
+	if (!priv)
 		return NULL;
-	}
 
 	/* allocate urb transfer buffer, if needed */
 	if (pdu->u.cmd_submit.transfer_buffer_length > 0) {
         if(data) 
             priv->urb->transfer_buffer = data;
-            /* priv->urb->transfer_buffer = kmemdup(data, */
-                    /* pdu->u.cmd_submit.transfer_buffer_length, GFP_KERNEL); */
-        else
+        else if (stub_get_dma(sdev, priv,
+                    pdu->u.cmd_submit.transfer_buffer_length))
+            priv->urb->transfer_buffer = priv->dma_buf->vaddr;
+        else if (stub_use_sg(sdev, pipe,
+                    pdu->u.cmd_submit.transfer_buffer_length)) {
+            if (stub_pool_get_sg(&sdev->pool, priv,
+                        pdu->u.cmd_submit.transfer_buffer_length,
+                        GFP_KERNEL) < 0) {
+                usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
+                return NULL;
+            }
+        } else
             priv->urb->transfer_buffer =
-                kzalloc(pdu->u.cmd_submit.transfer_buffer_length,
+                stub_pool_get_buf(&sdev->pool, priv,
+                    pdu->u.cmd_submit.transfer_buffer_length,
                     GFP_KERNEL);
-		if (!priv->urb->transfer_buffer) {
+		if (!priv->urb->transfer_buffer && !priv->urb->num_sgs) {
 			usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
 			return NULL;
 		}
 	}
 
-	/* copy urb setup packet */
-	priv->urb->setup_packet = kmemdup(&pdu->u.cmd_submit.setup, 8,
-					  GFP_KERNEL);
-	if (!priv->urb->setup_packet) {
-		dev_err(&sdev->interface->dev, "allocate setup_packet\n");
-		usbip_event_add(ud, SDEV_EVENT_ERROR_MALLOC);
-		return NULL;
+	/* copy urb setup packet; only control requests use it */
+	if (usb_pipecontrol(pipe)) {
+		memcpy(priv->setup, &pdu->u.cmd_submit.setup, 8);
+		priv->urb->setup_packet = priv->setup;
 	}
 
 	/* set other members from the base header of pdu */
@@ -511,6 +679,10 @@ struct urb *stub_build_urb(struct stub_device *sdev,
 
 	usbip_pack_pdu(pdu, priv->urb, USBIP_CMD_SUBMIT, 0);
 
+	/* a failure shows up as a submit error */
+	if (priv->urb->stream_id)
+		stub_ep_streams(sdev, ep, pdu->base.ep, pdu->base.direction);
+
     if(!data) {
         if (usbip_recv_xbuff(ud, priv->urb) < 0)
             return NULL;
@@ -520,9 +692,13 @@ struct urb *stub_build_urb(struct stub_device *sdev,
     }
 
 	/* no need to submit an intercepted request, but harmless? */
-	tweak_special_requests(priv->urb);
+	if (ep->tweak)
+		tweak_special_requests(priv->urb);
+
+	masking_bogus_flags(priv->urb, ep);
 
-	masking_bogus_flags(priv->urb);
+	if (priv->dma_buf)
+		priv->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
 
     return priv->urb;
 }
@@ -534,12 +710,14 @@ int stub_submit_urb(struct stub_device *sdev,
 	struct usbip_device *ud = &sdev->ud;
     int ret;
 	/* urb is now ready to submit */
+	usb_anchor_urb(urb, &sdev->submitted);
 	ret = usb_submit_urb(urb, GFP_KERNEL);
 
 	if (ret == 0) {
         if(pdu) usbip_dbg_stub_rx("submit urb ok, seqnum %u\n",
 				  pdu->base.seqnum);
     }else {
+		usb_unanchor_urb(urb);
 		dev_err(&sdev->interface->dev, "submit_urb error, %d\n", ret);
         if(pdu) usbip_dump_header(pdu);
 		usbip_dump_urb(urb);
@@ -554,6 +732,140 @@ int stub_submit_urb(struct stub_device *sdev,
 }
 EXPORT_SYMBOL_GPL(stub_submit_urb);
 
+/*
+ * Submit the requests held for merging. Two or more are copied into one
+ * transfer whose completion is handed back to each of them by
+ * stub_merge_complete(). If that transfer cannot be allocated, they are
+ * submitted one by one as usual. A request that cannot be submitted is
+ * completed with the error, as are the ones held behind it, so that each
+ * gets its RET_SUBMIT.
+ */
+static void stub_merge_flush(struct stub_device *sdev)
+{
+	struct stub_priv *carrier = NULL;
+	struct urb *urb, *last;
+	unsigned long flags;
+	int count = sdev->merge_count;
+	int len = sdev->merge_len;
+	char *buf = NULL;
+	int i, ret = 0;
+
+	if (!count)
+		return;
+
+	sdev->merge_count = 0;
+	sdev->merge_len = 0;
+
+	if (count > 1)
+		carrier = stub_pool_get_priv(&sdev->pool, 0, GFP_KERNEL);
+	if (carrier) {
+		buf = stub_pool_get_buf(&sdev->pool, carrier, len, GFP_KERNEL);
+		if (!buf) {
+			stub_pool_put_priv(&sdev->pool, carrier);
+			carrier = NULL;
+		}
+	}
+
+	if (!carrier) {
+		for (i = 0; i < count; i++) {
+			ret = stub_submit_urb(sdev, NULL, sdev->merge[i]->urb);
+			if (ret)
+				break;
+		}
+		for (; i < count; i++) {
+			urb = sdev->merge[i]->urb;
+			urb->status = ret;
+			urb->actual_length = 0;
+			stub_complete(urb);
+		}
+		return;
+	}
+
+	usbip_dbg_stub_rx("merged %d urbs, %d bytes\n", count, len);
+
+	for (i = 0; i < count; i++) {
+		urb = sdev->merge[i]->urb;
+		memcpy(buf, urb->transfer_buffer, urb->transfer_buffer_length);
+		buf += urb->transfer_buffer_length;
+	}
+
+	last = sdev->merge[count - 1]->urb;
+	urb = carrier->urb;
+	urb->context			= (void *) carrier;
+	urb->dev			= last->dev;
+	urb->pipe			= last->pipe;
+	urb->transfer_buffer		= carrier->xbuf;
+	urb->transfer_buffer_length	= len;
+	urb->transfer_flags		= last->transfer_flags & URB_ZERO_PACKET;
+	urb->complete			= stub_merge_complete;
+
+	carrier->sdev = sdev;
+	carrier->npieces = count;
+	INIT_LIST_HEAD(&carrier->pieces);
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	for (i = 0; i < count; i++)
+		list_move_tail(&sdev->merge[i]->list, &carrier->pieces);
+	list_add_tail(&carrier->list, &sdev->priv_init);
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	ret = stub_submit_urb(sdev, NULL, urb);
+	if (ret) {
+		urb->status = ret;
+		urb->actual_length = 0;
+		stub_merge_complete(urb);
+	}
+}
+
+/*
+ * Hold a bulk out request for merging with the ones that follow it. Only
+ * the last piece of a transfer may be short or need a zero length packet,
+ * so such a request closes the merge.
+ */
+static int stub_merge_add(struct stub_device *sdev, struct usbip_header *pdu,
+			  struct urb *urb)
+{
+	struct stub_ep *ep = stub_get_ep(sdev, pdu->base.ep,
+					 pdu->base.direction);
+	int len = urb->transfer_buffer_length;
+
+	if (pdu->base.direction != USBIP_DIR_OUT || !ep || !ep->merge ||
+	    !urb->transfer_buffer || len <= 0 || len > STUB_MERGE_MAX_BYTES ||
+	    !list_empty(&sdev->ud.filters)) {
+		stub_merge_flush(sdev);
+		return 0;
+	}
+
+	if (sdev->merge_len + len > STUB_MERGE_MAX_BYTES)
+		stub_merge_flush(sdev);
+
+	sdev->merge[sdev->merge_count++] = urb->context;
+	sdev->merge_len += len;
+
+	if ((len % ep->maxpacket) || (urb->transfer_flags & URB_ZERO_PACKET) ||
+	    sdev->merge_count == STUB_MERGE_MAX_URBS)
+		stub_merge_flush(sdev);
+
+	return 1;
+}
+
+/* whether pdu may go into the merge in progress */
+static int stub_merge_continues(struct stub_device *sdev,
+				struct usbip_header *pdu)
+{
+	return pdu->base.command == USBIP_CMD_SUBMIT &&
+		pdu->base.direction == USBIP_DIR_OUT &&
+		pdu->base.ep == usb_pipeendpoint(sdev->merge[0]->urb->pipe);
+}
+
+/* nothing complete is left in the socket: do not hold requests back */
+void stub_rx_idle(struct usbip_device *ud)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+
+	stub_merge_flush(sdev);
+}
+
 static void stub_recv_cmd_submit(struct stub_device *sdev,
 		struct usbip_header *pdu)
 {
@@ -563,11 +875,13 @@ static void stub_recv_cmd_submit(struct stub_device *sdev,
     urb = stub_build_urb(sdev,pdu,NULL);
     if(!urb || usbip_filter_on_rx(ud,pdu,urb))
         return;
+	if (stub_merge_add(sdev, pdu, urb))
+		return;
     stub_submit_urb(sdev,pdu,urb);
 }
 
 /* recv a pdu */
-static void stub_rx_pdu(struct usbip_device *ud)
+void stub_rx_pdu(struct usbip_device *ud)
 {
 	int ret;
 	struct usbip_header pdu;
@@ -578,8 +892,11 @@ static void stub_rx_pdu(struct usbip_device *ud)
 
 	memset(&pdu, 0, sizeof(pdu));
 
+	if (sdev->merge_count && usbip_rx_avail(ud) < (int) sizeof(pdu))
+		stub_merge_flush(sdev);
+
 	/* receive a pdu header */
-	ret = usbip_recv(ud->tcp_socket, &pdu, sizeof(pdu));
+	ret = usbip_recv_data(ud, &pdu, sizeof(pdu));
 	if (ret != sizeof(pdu)) {
 		dev_err(dev, "recv a header, %d\n", ret);
 		usbip_event_add(ud, SDEV_EVENT_ERROR_TCP);
@@ -597,6 +914,9 @@ static void stub_rx_pdu(struct usbip_device *ud)
 		return;
 	}
 
+	if (sdev->merge_count && !stub_merge_continues(sdev, &pdu))
+		stub_merge_flush(sdev);
+
 	switch (pdu.base.command) {
 	case USBIP_CMD_UNLINK:
 		stub_recv_cmd_unlink(sdev, &pdu);
@@ -614,14 +934,97 @@ static void stub_rx_pdu(struct usbip_device *ud)
 	}
 }
 
+/* bytes following the header of pdu, for the shared worker pool */
+int stub_rx_pdu_size(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	struct stub_ep *ep;
+	int size = 0;
+
+	if (pdu->base.command != USBIP_CMD_SUBMIT)
+		return 0;
+
+	if (pdu->base.direction == USBIP_DIR_OUT)
+		size += pdu->u.cmd_submit.transfer_buffer_length;
+
+	ep = stub_get_ep(sdev, pdu->base.ep, pdu->base.direction);
+	if (ep && ep->type == USB_ENDPOINT_XFER_ISOC &&
+	    pdu->u.cmd_submit.number_of_packets > 0)
+		size += pdu->u.cmd_submit.number_of_packets *
+			sizeof(struct usbip_iso_packet_descriptor);
+
+	return size;
+}
+
+/*
+ * Whether receiving pdu may sleep on the device: clear_halt, set_interface
+ * and a port reset are carried out synchronously before the urb is
+ * submitted, which must not hold up a worker of the bounded pool. Only the
+ * setup packet is looked at; a non-control urb never matches in practice,
+ * and one that did would merely take the slow path.
+ */
+int stub_rx_pdu_blocks(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	if (pdu->base.command != USBIP_CMD_SUBMIT)
+		return 0;
+
+	return is_blocking_request((struct usb_ctrlrequest *)
+				   pdu->u.cmd_submit.setup);
+}
+
+/*
+ * Whether the in-flight budget is used up and the next pdu has to wait for
+ * it. Requests held for merging are submitted first, since nothing would
+ * make room for them otherwise. A CMD_UNLINK at the head of the socket is
+ * let through: it takes no budget and may be what gives some back.
+ */
+int stub_rx_throttled(struct usbip_device *ud)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+	struct usbip_header pdu;
+
+	if (!stub_budget_exhausted(sdev))
+		return 0;
+
+	stub_merge_flush(sdev);
+
+	if (usbip_rx_peek(ud, &pdu) > 0 &&
+	    pdu.base.command == USBIP_CMD_UNLINK)
+		return 0;
+
+	return 1;
+}
+
+/* more has arrived; a throttled stub_rx looks for a CMD_UNLINK in it */
+void stub_rx_data(struct usbip_device *ud)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+
+	if (sdev->throttled) {
+		sdev->rx_data = 1;
+		wake_up(&sdev->budget_waitq);
+	}
+}
+
 int stub_rx_loop(void *data)
 {
 	struct usbip_device *ud = data;
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
 
 	while (!kthread_should_stop()) {
 		if (usbip_event_happened(ud))
 			break;
 
+		/* leave the requests in the socket; tcp throttles the peer */
+		sdev->rx_data = 0;
+		if (stub_rx_throttled(ud)) {
+			wait_event_interruptible(sdev->budget_waitq,
+						 (!sdev->throttled ||
+						  sdev->rx_data ||
+						  kthread_should_stop()));
+			continue;
+		}
+
 		stub_rx_pdu(ud);
 	}
 
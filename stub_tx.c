@@ -17,21 +17,19 @@
  * USA.
  */
 
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
+#include <linux/scatterlist.h>
 #include <linux/socket.h>
+#include <linux/version.h>
 
 #include "usbip_common.h"
 #include "stub.h"
 
 void stub_free_priv_and_urb(struct stub_priv *priv)
 {
-	struct urb *urb = priv->urb;
-
-	kfree(urb->setup_packet);
-	kfree(urb->transfer_buffer);
 	list_del(&priv->list);
-	kmem_cache_free(stub_priv_cache, priv);
-	usb_free_urb(urb);
+	stub_pool_put_priv(&priv->sdev->pool, priv);
 }
 EXPORT_SYMBOL_GPL(stub_free_priv_and_urb);
 
@@ -53,6 +51,28 @@ void stub_enqueue_ret_unlink(struct stub_device *sdev, __u32 seqnum,
 	list_add_tail(&unlink->list, &sdev->unlink_tx);
 }
 
+static int stub_tx_class(struct urb *urb)
+{
+	switch (usb_pipetype(urb->pipe)) {
+	case PIPE_CONTROL:
+		return STUB_TX_Q_CTRL;
+	case PIPE_INTERRUPT:
+		return STUB_TX_Q_INT;
+	case PIPE_ISOCHRONOUS:
+		return STUB_TX_Q_ISOC;
+	default:
+		return STUB_TX_Q_BULK;
+	}
+}
+
+static int stub_tx_queue(struct stub_device *sdev, struct urb *urb)
+{
+	if (sdev->tx_sched != STUB_TX_SCHED_PRIO)
+		return STUB_TX_Q_CTRL;
+
+	return stub_tx_class(urb);
+}
+
 /**
  * stub_complete - completion handler of a usbip urb
  * @urb: pointer to the urb completed
@@ -68,11 +88,16 @@ void stub_complete(struct urb *urb)
 	struct stub_priv *priv = (struct stub_priv *) urb->context;
 	struct stub_device *sdev = priv->sdev;
 	unsigned long flags;
+	int wake;
 
 	usbip_dbg_stub_tx("complete! status %d\n", urb->status);
 
     ret = usbip_filter_on_tx(&sdev->ud,urb);
 
+	/* stub_device_cleanup_urbs() frees it along with the others */
+	if (sdev->cancelling)
+		return;
+
 	switch (urb->status) {
 	case 0:
 		/* OK */
@@ -100,21 +125,89 @@ void stub_complete(struct urb *urb)
 
     if(ret) return;
 
-	/* link a urb to the queue of tx. */
+	/*
+	 * link a urb to the queue of tx. stub_tx is only woken up if it may
+	 * have seen priv_tx empty; otherwise it is going to take this urb
+	 * along with the ones queued before.
+	 */
 	spin_lock_irqsave(&sdev->priv_lock, flags);
 	if (priv->unlinking) {
 		stub_enqueue_ret_unlink(sdev, priv->seqnum, urb->status);
 		stub_free_priv_and_urb(priv);
+		wake = 1;
 	} else {
-		list_move_tail(&priv->list, &sdev->priv_tx);
+		list_del_init(&priv->list);
+		priv->tx_queue = stub_tx_queue(sdev, urb);
+		priv->done = ktime_get();
+		wake = llist_add(&priv->tx_node, &sdev->priv_tx);
 	}
 	spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
 	/* wake up tx_thread */
-	wake_up(&sdev->tx_waitq);
+	if (wake)
+		usbip_wake_tx(&sdev->ud, &sdev->tx_waitq);
 }
 EXPORT_SYMBOL_GPL(stub_complete);
 
+/*
+ * stub_merge_complete - completion handler of a merged bulk out transfer
+ * @urb: the transfer built by stub_merge_flush()
+ *
+ * Each piece is completed in order with its share of actual_length. The
+ * pieces sent in full succeed; the others get the status of the transfer.
+ */
+void stub_merge_complete(struct urb *urb)
+{
+	struct stub_priv *carrier = (struct stub_priv *) urb->context;
+	struct stub_device *sdev = carrier->sdev;
+	struct stub_priv *priv, *tmp;
+	int left = urb->actual_length;
+	unsigned long flags;
+	ktime_t done;
+	int wake = 0;
+
+	usbip_dbg_stub_tx("merged complete! status %d\n", urb->status);
+
+	/* stub_device_cleanup_urbs() frees the pieces with the transfer */
+	if (urb->status == -ENOENT || sdev->cancelling)
+		return;
+
+	done = ktime_get();
+
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	list_for_each_entry_safe(priv, tmp, &carrier->pieces, list) {
+		struct urb *piece = priv->urb;
+
+		piece->actual_length = min_t(int, left,
+					      piece->transfer_buffer_length);
+		left -= piece->actual_length;
+		if (piece->actual_length < piece->transfer_buffer_length)
+			piece->status = urb->status;
+		else
+			piece->status = 0;
+
+		/* the transfer was not unlinked for it, see stub_rx.c */
+		if (priv->unlinking) {
+			stub_enqueue_ret_unlink(sdev, priv->seqnum,
+						piece->status);
+			stub_free_priv_and_urb(priv);
+			wake = 1;
+		} else {
+			list_del_init(&priv->list);
+			priv->tx_queue = stub_tx_queue(sdev, piece);
+			priv->done = done;
+			if (llist_add(&priv->tx_node, &sdev->priv_tx))
+				wake = 1;
+		}
+	}
+	carrier->npieces = 0;
+	stub_free_priv_and_urb(carrier);
+	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+
+	if (wake)
+		usbip_wake_tx(&sdev->ud, &sdev->tx_waitq);
+}
+
 static inline void setup_base_pdu(struct usbip_header_basic *base,
 				  __u32 command, __u32 seqnum)
 {
@@ -140,229 +233,509 @@ static void setup_ret_unlink_pdu(struct usbip_header *rpdu,
 	rpdu->u.ret_unlink.status = unlink->status;
 }
 
-static struct stub_priv *dequeue_from_priv_tx(struct stub_device *sdev)
+/* whether stub_tx has something to send now; only called by stub_tx */
+static int stub_tx_pending(struct stub_device *sdev)
 {
-	unsigned long flags;
-	struct stub_priv *priv, *tmp;
+	int q;
 
-	spin_lock_irqsave(&sdev->priv_lock, flags);
+	if (sdev->tx_throttled)
+		return 0;
 
-	list_for_each_entry_safe(priv, tmp, &sdev->priv_tx, list) {
-		list_move_tail(&priv->list, &sdev->priv_free);
-		spin_unlock_irqrestore(&sdev->priv_lock, flags);
-		return priv;
-	}
+	if (!llist_empty(&sdev->priv_tx) || !list_empty(&sdev->unlink_tx) ||
+	    !list_empty(&sdev->tx_unlinks))
+		return 1;
 
-	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+	for (q = 0; q < STUB_TX_QUEUES; q++)
+		if (!list_empty(&sdev->tx_submits[q]))
+			return 1;
 
-	return NULL;
+	return 0;
 }
 
-static int stub_send_ret_submit(struct stub_device *sdev)
+/* bytes a result costs in the token bucket */
+static unsigned int stub_tx_cost(struct stub_priv *priv)
 {
-	unsigned long flags;
-	struct stub_priv *priv, *tmp;
+	struct urb *urb = priv->urb;
+	unsigned int cost = sizeof(struct usbip_header);
 
-	struct msghdr msg;
-	size_t txsize;
+	if (usb_pipein(urb->pipe))
+		cost += urb->actual_length;
+	if (usb_pipeisoc(urb->pipe))
+		cost += urb->number_of_packets *
+			sizeof(struct usbip_iso_packet_descriptor);
 
-	size_t total_size = 0;
+	return cost;
+}
 
-	while ((priv = dequeue_from_priv_tx(sdev)) != NULL) {
-		int ret;
-		struct urb *urb = priv->urb;
-		struct usbip_header pdu_header;
-		struct usbip_iso_packet_descriptor *iso_buffer = NULL;
-		struct kvec *iov = NULL;
-		int iovnum = 0;
-
-		txsize = 0;
-		memset(&pdu_header, 0, sizeof(pdu_header));
-		memset(&msg, 0, sizeof(msg));
-
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS)
-			iovnum = 2 + urb->number_of_packets;
-		else
-			iovnum = 2;
+/*
+ * stub_tx_shape - take the tokens for one result from the bucket
+ *
+ * Returns 0 if the result may be sent now, otherwise the nsecs until the
+ * bucket is refilled enough. A result is sent whenever the bucket is not in
+ * debt, and may put it in debt, so that results larger than tx_burst still
+ * go.
+ */
+static u64 stub_tx_shape(struct stub_device *sdev, struct stub_priv *priv)
+{
+	unsigned int rate = ACCESS_ONCE(sdev->tx_rate);
+	unsigned int burst = ACCESS_ONCE(sdev->tx_burst);
+	ktime_t now;
+	s64 ns;
+
+	if (!rate)
+		return 0;
+
+	now = ktime_get();
+	ns = ktime_to_ns(ktime_sub(now, sdev->tx_stamp));
+	sdev->tx_stamp = now;
+	if (ns > NSEC_PER_SEC)
+		ns = NSEC_PER_SEC;
+	if (ns > 0)
+		sdev->tx_tokens += div_u64((u64) ns * rate, NSEC_PER_SEC);
+	if (sdev->tx_tokens > (long) burst)
+		sdev->tx_tokens = burst;
+
+	if (sdev->tx_tokens < 0)
+		return div_u64((u64) -sdev->tx_tokens * NSEC_PER_SEC, rate) + 1;
+
+	sdev->tx_tokens -= stub_tx_cost(priv);
+	return 0;
+}
 
-		iov = kzalloc(iovnum * sizeof(struct kvec), GFP_KERNEL);
+static void stub_tx_throttle(struct stub_device *sdev, struct stub_priv *priv,
+			     u64 ns)
+{
+	sdev->tx_stats[stub_tx_class(priv->urb)].throttled_bytes +=
+		stub_tx_cost(priv);
 
-		if (!iov) {
-			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_MALLOC);
-			return -1;
-		}
+	sdev->tx_throttled = 1;
+	hrtimer_start(&sdev->tx_timer, ns_to_ktime(ns), HRTIMER_MODE_REL);
+}
 
-		iovnum = 0;
-
-		/* 1. setup usbip_header */
-		setup_ret_submit_pdu(&pdu_header, urb);
-		usbip_dbg_stub_tx("setup txdata seqnum: %d urb: %p\n",
-				  pdu_header.base.seqnum, urb);
-		usbip_header_correct_endian(&pdu_header, 1);
-
-		iov[iovnum].iov_base = &pdu_header;
-		iov[iovnum].iov_len  = sizeof(pdu_header);
-		iovnum++;
-		txsize += sizeof(pdu_header);
-
-		/* 2. setup transfer buffer */
-		if (usb_pipein(urb->pipe) &&
-		    usb_pipetype(urb->pipe) != PIPE_ISOCHRONOUS &&
-		    urb->actual_length > 0) {
-			iov[iovnum].iov_base = urb->transfer_buffer;
-			iov[iovnum].iov_len  = urb->actual_length;
-			iovnum++;
-			txsize += urb->actual_length;
-		} else if (usb_pipein(urb->pipe) &&
-			   usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
-			/*
-			 * For isochronous packets: actual length is the sum of
-			 * the actual length of the individual, packets, but as
-			 * the packet offsets are not changed there will be
-			 * padding between the packets. To optimally use the
-			 * bandwidth the padding is not transmitted.
-			 */
-
-			int i;
-			for (i = 0; i < urb->number_of_packets; i++) {
-				iov[iovnum].iov_base = urb->transfer_buffer +
-					urb->iso_frame_desc[i].offset;
-				iov[iovnum].iov_len =
-					urb->iso_frame_desc[i].actual_length;
-				iovnum++;
-				txsize += urb->iso_frame_desc[i].actual_length;
-			}
+static enum hrtimer_restart stub_tx_unthrottle(struct hrtimer *timer)
+{
+	struct stub_device *sdev = container_of(timer, struct stub_device,
+						tx_timer);
 
-			if (txsize != sizeof(pdu_header) + urb->actual_length) {
-				dev_err(&sdev->interface->dev,
-					"actual length of urb %d does not "
-					"match iso packet sizes %zu\n",
-					urb->actual_length,
-					txsize-sizeof(pdu_header));
-				kfree(iov);
-				usbip_event_add(&sdev->ud,
-						SDEV_EVENT_ERROR_TCP);
-			   return -1;
-			}
-		}
+	sdev->tx_throttled = 0;
+	usbip_wake_tx(&sdev->ud, &sdev->tx_waitq);
 
-		/* 3. setup iso_packet_descriptor */
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
-			ssize_t len = 0;
+	return HRTIMER_NORESTART;
+}
 
-			iso_buffer = usbip_alloc_iso_desc_pdu(urb, &len);
-			if (!iso_buffer) {
-				usbip_event_add(&sdev->ud,
-						SDEV_EVENT_ERROR_MALLOC);
-				kfree(iov);
-				return -1;
-			}
+static void stub_tx_account(struct stub_device *sdev, struct stub_priv *priv)
+{
+	struct stub_tx_stats *stats = &sdev->tx_stats[stub_tx_class(priv->urb)];
+	s64 us = ktime_us_delta(ktime_get(), priv->done);
 
-			iov[iovnum].iov_base = iso_buffer;
-			iov[iovnum].iov_len  = len;
-			txsize += len;
-			iovnum++;
-		}
+	if (us < 0)
+		us = 0;
+
+	stats->urbs++;
+	stats->delay_us += us;
+	if (us > stats->max_delay_us)
+		stats->max_delay_us = us;
+}
+
+void stub_tx_init(struct stub_device *sdev)
+{
+	int q;
+
+	for (q = 0; q < STUB_TX_QUEUES; q++)
+		INIT_LIST_HEAD(&sdev->tx_submits[q]);
+	INIT_LIST_HEAD(&sdev->tx_unlinks);
+
+	sdev->tx_burst = STUB_TX_BURST;
+	sdev->tx_stamp = ktime_get();
+	hrtimer_init(&sdev->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sdev->tx_timer.function = stub_tx_unthrottle;
+}
+
+/* after stub_tx has been stopped */
+void stub_tx_stop(struct stub_device *sdev)
+{
+	hrtimer_cancel(&sdev->tx_timer);
+	sdev->tx_throttled = 0;
+	sdev->tx_tokens = 0;
+}
+
+ssize_t stub_tx_stats_show(struct stub_device *sdev, char *buf)
+{
+	static const char * const names[STUB_TX_QUEUES] = {
+		[STUB_TX_Q_CTRL] = "ctrl",
+		[STUB_TX_Q_INT]  = "int",
+		[STUB_TX_Q_ISOC] = "isoc",
+		[STUB_TX_Q_BULK] = "bulk",
+	};
+	char *out = buf;
+	int q;
+
+	for (q = 0; q < STUB_TX_QUEUES; q++) {
+		struct stub_tx_stats *stats = &sdev->tx_stats[q];
+
+		out += sprintf(out, "%s urbs %lu delay_us %llu max_delay_us %u "
+			       "throttled_bytes %llu\n", names[q], stats->urbs,
+			       stats->delay_us, stats->max_delay_us,
+			       stats->throttled_bytes);
+	}
+
+	return out - buf;
+}
+
+/* queue the RET_SUBMIT pdu of a completed urb into the tx batch */
+static int stub_queue_ret_submit(struct stub_device *sdev,
+				 struct stub_priv *priv)
+{
+	struct usbip_xmit_batch *batch = &sdev->tx_batch;
+	struct urb *urb = priv->urb;
+	struct usbip_header *pdu_header;
+	struct usbip_iso_packet_descriptor *iso_buffer;
+	size_t len;
+
+	/* 1. setup usbip_header */
+	pdu_header = usbip_xmit_batch_scratch(batch, sizeof(*pdu_header));
+	if (!pdu_header)
+		return -1;
+
+	memset(pdu_header, 0, sizeof(*pdu_header));
+	setup_ret_submit_pdu(pdu_header, urb);
+	if (sdev->credits)
+		pdu_header->base.devid = stub_budget_credit(sdev);
+	usbip_dbg_stub_tx("setup txdata seqnum: %d urb: %p\n",
+			  pdu_header->base.seqnum, urb);
+	usbip_header_correct_endian(pdu_header, 1);
+
+	if (usbip_xmit_batch_add(batch, pdu_header, sizeof(*pdu_header)) < 0)
+		return -1;
+
+	/* 2. setup transfer buffer */
+	if (usb_pipein(urb->pipe) &&
+	    usb_pipetype(urb->pipe) != PIPE_ISOCHRONOUS &&
+	    urb->actual_length > 0 && urb->num_sgs) {
+		if (usbip_xmit_batch_add_sg(batch, urb->sg, urb->num_sgs,
+					    urb->actual_length) < 0)
+			return -1;
+	} else if (usb_pipein(urb->pipe) &&
+	    usb_pipetype(urb->pipe) != PIPE_ISOCHRONOUS &&
+	    urb->actual_length > 0) {
+		int ret;
+
+		/*
+		 * Coherent buffers go back to the pool on their own, and
+		 * filters may keep using theirs, so only buffers from the
+		 * pool are sent by reference; see stub_pool_put_priv().
+		 */
+		if (priv->dma_buf || !list_empty(&sdev->ud.filters))
+			ret = usbip_xmit_batch_add(batch, urb->transfer_buffer,
+						   urb->actual_length);
+		else
+			ret = usbip_xmit_batch_add_buf(batch,
+						       urb->transfer_buffer,
+						       urb->actual_length);
+		if (ret < 0)
+			return -1;
+	} else if (usb_pipein(urb->pipe) &&
+		   usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		/*
+		 * For isochronous packets: actual length is the sum of
+		 * the actual length of the individual, packets, but as
+		 * the packet offsets are not changed there will be
+		 * padding between the packets. To optimally use the
+		 * bandwidth the padding is not transmitted.
+		 */
+
+		int i;
+
+		len = 0;
+		for (i = 0; i < urb->number_of_packets; i++)
+			len += urb->iso_frame_desc[i].actual_length;
 
-		ret = kernel_sendmsg(sdev->ud.tcp_socket, &msg,
-						iov,  iovnum, txsize);
-		if (ret != txsize) {
+		if (len != urb->actual_length) {
 			dev_err(&sdev->interface->dev,
-				"sendmsg failed!, retval %d for %zd\n",
-				ret, txsize);
-			kfree(iov);
-			kfree(iso_buffer);
+				"actual length of urb %d does not "
+				"match iso packet sizes %zu\n",
+				urb->actual_length, len);
 			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
 			return -1;
 		}
 
-		kfree(iov);
-		kfree(iso_buffer);
+		for (i = 0; i < urb->number_of_packets; i++) {
+			if (usbip_xmit_batch_add(batch, urb->transfer_buffer +
+					urb->iso_frame_desc[i].offset,
+					urb->iso_frame_desc[i].actual_length) < 0)
+				return -1;
+		}
+	}
+
+	/* 3. setup iso_packet_descriptor */
+	if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		len = urb->number_of_packets * sizeof(*iso_buffer);
+
+		iso_buffer = usbip_xmit_batch_scratch(batch, len);
+		if (!iso_buffer)
+			return -1;
+
+		usbip_fill_iso_desc_pdu(urb, iso_buffer);
 
-		total_size += txsize;
+		if (usbip_xmit_batch_add(batch, iso_buffer, len) < 0)
+			return -1;
 	}
 
+	batch->count++;
+
+	return 0;
+}
+
+/* queue the RET_UNLINK pdu of an unlink request into the tx batch */
+static int stub_queue_ret_unlink(struct stub_device *sdev,
+				 struct stub_unlink *unlink)
+{
+	struct usbip_xmit_batch *batch = &sdev->tx_batch;
+	struct usbip_header *pdu_header;
+
+	usbip_dbg_stub_tx("setup ret unlink %lu\n", unlink->seqnum);
+
+	pdu_header = usbip_xmit_batch_scratch(batch, sizeof(*pdu_header));
+	if (!pdu_header)
+		return -1;
+
+	memset(pdu_header, 0, sizeof(*pdu_header));
+	setup_ret_unlink_pdu(pdu_header, unlink);
+	if (sdev->credits)
+		pdu_header->base.devid = stub_budget_credit(sdev);
+	usbip_header_correct_endian(pdu_header, 1);
+
+	if (usbip_xmit_batch_add(batch, pdu_header, sizeof(*pdu_header)) < 0)
+		return -1;
+
+	batch->count++;
+
+	return 0;
+}
+
+/* free requests whose results have been pushed to the socket */
+static void stub_tx_release(struct stub_device *sdev,
+			    struct list_head *submits,
+			    struct list_head *unlinks)
+{
+	unsigned long flags;
+	struct stub_priv *priv, *ptmp;
+	struct stub_unlink *unlink, *utmp;
+
 	spin_lock_irqsave(&sdev->priv_lock, flags);
-	list_for_each_entry_safe(priv, tmp, &sdev->priv_free, list) {
+
+	list_for_each_entry_safe(priv, ptmp, submits, list)
 		stub_free_priv_and_urb(priv);
+
+	list_for_each_entry_safe(unlink, utmp, unlinks, list) {
+		list_del(&unlink->list);
+		kfree(unlink);
 	}
+
 	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+}
 
-	return total_size;
+static void stub_tx_linger(struct stub_device *sdev, ktime_t deadline)
+{
+	ktime_t timeout = ktime_sub(deadline, ktime_get());
+
+	if (ktime_to_ns(timeout) <= 0)
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0))
+	wait_event_interruptible_hrtimeout(sdev->tx_waitq,
+					   (stub_tx_pending(sdev) ||
+					    kthread_should_stop()),
+					   timeout);
+#else
+	wait_event_interruptible_timeout(sdev->tx_waitq,
+					 (stub_tx_pending(sdev) ||
+					  kthread_should_stop()),
+					 usecs_to_jiffies(ktime_to_us(timeout)));
+#endif
 }
 
-static struct stub_unlink *dequeue_from_unlink_tx(struct stub_device *sdev)
+/*
+ * move newly completed requests to the lists of stub_tx. unlink_tx must be
+ * taken before priv_tx: a urb that completed before its RET_UNLINK was
+ * queued is then always taken no later than the RET_UNLINK.
+ */
+static void stub_tx_take(struct stub_device *sdev, struct list_head *submits,
+			 struct list_head *unlinks)
 {
 	unsigned long flags;
-	struct stub_unlink *unlink, *tmp;
-
-	spin_lock_irqsave(&sdev->priv_lock, flags);
+	struct llist_node *node, *next, *first = NULL;
+	struct stub_priv *priv;
 
-	list_for_each_entry_safe(unlink, tmp, &sdev->unlink_tx, list) {
-		list_move_tail(&unlink->list, &sdev->unlink_free);
+	if (!list_empty(&sdev->unlink_tx)) {
+		spin_lock_irqsave(&sdev->priv_lock, flags);
+		list_splice_tail_init(&sdev->unlink_tx, unlinks);
 		spin_unlock_irqrestore(&sdev->priv_lock, flags);
-		return unlink;
 	}
 
-	spin_unlock_irqrestore(&sdev->priv_lock, flags);
+	node = llist_del_all(&sdev->priv_tx);
+
+	/* the lock-less list is LIFO, restore the completion order */
+	while (node) {
+		next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
 
-	return NULL;
+	for (node = first; node; node = next) {
+		next = node->next;
+		priv = llist_entry(node, struct stub_priv, tx_node);
+		list_add_tail(&priv->list, &submits[priv->tx_queue]);
+	}
 }
 
-static int stub_send_ret_unlink(struct stub_device *sdev)
+static int stub_tx_flush(struct stub_device *sdev,
+			 struct list_head *submits_done,
+			 struct list_head *unlinks_done, int more)
 {
-	unsigned long flags;
-	struct stub_unlink *unlink, *tmp;
+	if (usbip_xmit_batch_flush(&sdev->tx_batch, more) < 0)
+		return -1;
+
+	stub_tx_release(sdev, submits_done, unlinks_done);
 
-	struct msghdr msg;
-	struct kvec iov[1];
-	size_t txsize;
+	return 0;
+}
 
+/*
+ * stub_send_batch - send the results of completed requests
+ *
+ * Drains priv_tx and unlink_tx into the tx batch and pushes it to the socket
+ * with as few kernel_sendmsg() calls as the flush policy allows. Completions
+ * are taken again before every RET_SUBMIT, so that urgent results overtake
+ * queued bulk ones. RET_UNLINKs are queued only after every RET_SUBMIT taken
+ * along with or before them (see stub_tx_loop), and nothing new is taken
+ * while they wait. When the shaper runs out of tokens, the batch is flushed
+ * and the rest waits on tx_submits for stub_tx_unthrottle().
+ */
+static int stub_send_batch(struct stub_device *sdev)
+{
+	struct usbip_xmit_batch *batch = &sdev->tx_batch;
+	struct usbip_xmit_policy *policy = &sdev->tx_policy;
+	unsigned int quantum = ACCESS_ONCE(sdev->tx_bulk_quantum);
+	unsigned long flags;
+	struct stub_priv *priv;
+	struct stub_unlink *unlink, *utmp;
+	struct list_head *submits = sdev->tx_submits;
+	struct list_head *unlinks = &sdev->tx_unlinks;
+	LIST_HEAD(submits_done);
+	LIST_HEAD(unlinks_done);
+	ktime_t deadline = ktime_set(0, 0);
 	size_t total_size = 0;
+	size_t bulk_size = 0;
+	int urgent = 0;
+	u64 wait;
+	int q;
+
+	/* stub_tx_unthrottle() comes back */
+	if (sdev->tx_throttled)
+		return 0;
+
+	for (;;) {
+		if (list_empty(unlinks))
+			stub_tx_take(sdev, submits, unlinks);
+
+		for (q = 0; q < STUB_TX_QUEUES; q++)
+			if (!list_empty(&submits[q]))
+				break;
+
+		if (q < STUB_TX_QUEUES) {
+			priv = list_first_entry(&submits[q], struct stub_priv,
+						list);
+
+			wait = stub_tx_shape(sdev, priv);
+			if (wait) {
+				stub_tx_throttle(sdev, priv, wait);
+				break;
+			}
 
-	while ((unlink = dequeue_from_unlink_tx(sdev)) != NULL) {
-		int ret;
-		struct usbip_header pdu_header;
+			stub_tx_account(sdev, priv);
+			list_move_tail(&priv->list, &submits_done);
+
+			if (!batch->count)
+				deadline = ktime_add_us(ktime_get(),
+							policy->max_delay);
+
+			if (stub_queue_ret_submit(sdev, priv) < 0)
+				goto err;
+
+			if (q == STUB_TX_Q_BULK)
+				bulk_size += priv->urb->actual_length;
+			else if (sdev->tx_sched == STUB_TX_SCHED_PRIO &&
+				 q != STUB_TX_Q_ISOC)
+				urgent = 1;
+
+			if (!usbip_xmit_batch_full(batch, policy) &&
+			    !(quantum && bulk_size >= quantum))
+				continue;
+
+			total_size += batch->size;
+			if (stub_tx_flush(sdev, &submits_done, &unlinks_done,
+					  1) < 0)
+				goto err;
+			bulk_size = 0;
+			urgent = 0;
+			continue;
+		}
 
-		txsize = 0;
-		memset(&pdu_header, 0, sizeof(pdu_header));
-		memset(&msg, 0, sizeof(msg));
-		memset(&iov, 0, sizeof(iov));
+		if (!list_empty(unlinks)) {
+			list_for_each_entry_safe(unlink, utmp, unlinks, list) {
+				list_move_tail(&unlink->list, &unlinks_done);
 
-		usbip_dbg_stub_tx("setup ret unlink %lu\n", unlink->seqnum);
+				if (!batch->count)
+					deadline = ktime_add_us(ktime_get(),
+							policy->max_delay);
 
-		/* 1. setup usbip_header */
-		setup_ret_unlink_pdu(&pdu_header, unlink);
-		usbip_header_correct_endian(&pdu_header, 1);
+				if (stub_queue_ret_unlink(sdev, unlink) < 0)
+					goto err;
 
-		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+				if (!usbip_xmit_batch_full(batch, policy))
+					continue;
 
-		ret = kernel_sendmsg(sdev->ud.tcp_socket, &msg, iov,
-				     1, txsize);
-		if (ret != txsize) {
-			dev_err(&sdev->interface->dev,
-				"sendmsg failed!, retval %d for %zd\n",
-				ret, txsize);
-			usbip_event_add(&sdev->ud, SDEV_EVENT_ERROR_TCP);
-			return -1;
+				total_size += batch->size;
+				if (stub_tx_flush(sdev, &submits_done,
+						  &unlinks_done, 1) < 0)
+					goto err;
+			}
+			continue;
 		}
 
-		usbip_dbg_stub_tx("send txdata\n");
-		total_size += txsize;
+		if (!batch->count)
+			break;
+
+		/* linger for more requests if allowed to */
+		if (policy->max_delay && !urgent && !kthread_should_stop()) {
+			stub_tx_linger(sdev, deadline);
+			if (stub_tx_pending(sdev))
+				continue;
+		}
+		break;
 	}
 
-	spin_lock_irqsave(&sdev->priv_lock, flags);
+	total_size += batch->size;
+	if (stub_tx_flush(sdev, &submits_done, &unlinks_done, 0) < 0)
+		goto err;
 
-	list_for_each_entry_safe(unlink, tmp, &sdev->unlink_free, list) {
-		list_del(&unlink->list);
-		kfree(unlink);
-	}
+	return total_size;
+
+err:
+	/* leave whatever is left to stub_device_cleanup_urbs */
+	usbip_xmit_batch_reset(batch);
 
+	spin_lock_irqsave(&sdev->priv_lock, flags);
+	list_splice_tail(&submits_done, &sdev->priv_free);
+	for (q = 0; q < STUB_TX_QUEUES; q++)
+		list_splice_tail_init(&submits[q], &sdev->priv_free);
+	list_splice_tail(&unlinks_done, &sdev->unlink_free);
+	list_splice_tail_init(unlinks, &sdev->unlink_free);
 	spin_unlock_irqrestore(&sdev->priv_lock, flags);
 
-	return total_size;
+	return -1;
 }
 
 int stub_tx_loop(void *data)
@@ -388,17 +761,26 @@ int stub_tx_loop(void *data)
 		 * getting the status of the given-backed URB which has the
 		 * status of usb_submit_urb().
 		 */
-		if (stub_send_ret_submit(sdev) < 0)
-			break;
-
-		if (stub_send_ret_unlink(sdev) < 0)
+		if (stub_send_batch(sdev) < 0)
 			break;
 
 		wait_event_interruptible(sdev->tx_waitq,
-					 (!list_empty(&sdev->priv_tx) ||
-					  !list_empty(&sdev->unlink_tx) ||
+					 (stub_tx_pending(sdev) ||
 					  kthread_should_stop()));
 	}
 
 	return 0;
 }
+
+/* one run of the tx side on the shared worker pool */
+void stub_tx_work(struct usbip_device *ud)
+{
+	struct stub_device *sdev = container_of(ud, struct stub_device, ud);
+
+	if (stub_send_batch(sdev) < 0)
+		return;
+
+	/* come back later rather than keep a worker for this device */
+	if (stub_tx_pending(sdev))
+		usbip_queue_tx(ud);
+}
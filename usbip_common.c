@@ -20,12 +20,18 @@
 #include <asm/byteorder.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/highmem.h>
 #include <linux/kernel.h>
+#include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/stat.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/scatterlist.h>
 #include <net/sock.h>
+#include <net/tcp.h>
 
 #include <linux/version.h>
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(3,9,0))
@@ -49,6 +55,11 @@ EXPORT_SYMBOL_GPL(usbip_debug_flag);
 module_param(usbip_debug_flag, ulong, S_IRUGO|S_IWUSR);
 MODULE_PARM_DESC(usbip_debug_flag, "debug flags (defined in usbip_common.h)");
 
+static unsigned int usbip_zerocopy_min;
+module_param(usbip_zerocopy_min, uint, S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(usbip_zerocopy_min, "smallest urb payload handed to the "
+		 "socket by reference instead of copied (0 = never)");
+
 /* FIXME */
 struct device_attribute dev_attr_usbip_debug;
 EXPORT_SYMBOL_GPL(dev_attr_usbip_debug);
@@ -408,6 +419,491 @@ err:
 }
 EXPORT_SYMBOL_GPL(usbip_recv);
 
+/*
+ * The readsock receive engine.
+ *
+ * Instead of sleeping in kernel_recvmsg() for every part of a pdu, the rx
+ * thread pulls data straight out of the skbs queued on the socket with
+ * tcp_read_sock() and only sleeps when the receive queue is empty. The
+ * socket callbacks wake it up again. As long as data is queued, any number
+ * of pdus is parsed without a wakeup, and each part of a pdu is copied once
+ * from the skb into its final buffer (header, transfer buffer or iso
+ * descriptors).
+ */
+struct usbip_rx_segment {
+	char *buf;
+	int len;
+	int copied;
+};
+
+static int usbip_rx_actor(read_descriptor_t *desc, struct sk_buff *skb,
+			  unsigned int offset, size_t len)
+{
+	struct usbip_rx_segment *seg = desc->arg.data;
+	size_t want = min_t(size_t, seg->len - seg->copied, len);
+
+	if (!desc->count || !want)
+		return 0;
+
+	if (skb_copy_bits(skb, offset, seg->buf + seg->copied, want)) {
+		desc->error = -EFAULT;
+		return 0;
+	}
+
+	seg->copied += want;
+
+	/* stop at the end of the segment */
+	if (seg->copied == seg->len)
+		desc->count = 0;
+
+	return want;
+}
+
+static int usbip_rx_readable(struct sock *sk)
+{
+	return !skb_queue_empty(&sk->sk_receive_queue) || sk->sk_err ||
+		(sk->sk_shutdown & RCV_SHUTDOWN);
+}
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
+static void usbip_sk_data_ready(struct sock *sk)
+#else
+static void usbip_sk_data_ready(struct sock *sk, int bytes)
+#endif
+{
+	struct usbip_device *ud;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	ud = sk->sk_user_data;
+	if (ud) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
+		ud->saved_data_ready(sk);
+#else
+		ud->saved_data_ready(sk, bytes);
+#endif
+		wake_up_interruptible(&ud->rx_waitq);
+		if (ud->wq_ops.rx_data)
+			ud->wq_ops.rx_data(ud);
+		usbip_queue_rx(ud);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void usbip_sk_state_change(struct sock *sk)
+{
+	struct usbip_device *ud;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	ud = sk->sk_user_data;
+	if (ud) {
+		ud->saved_state_change(sk);
+		wake_up_interruptible(&ud->rx_waitq);
+		usbip_queue_rx(ud);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/*
+ * usbip_rx_start - set up the receive engine of a new connection
+ * @ud: device whose tcp_socket has just been set
+ *
+ * Must be called before the rx thread is started. Falls back to recvmsg
+ * if the socket cannot be read with tcp_read_sock(). Also decides whether
+ * the connection runs on the shared worker pool; if ud->use_wq is set on
+ * return, the caller starts it with usbip_wq_start() instead of threads.
+ */
+void usbip_rx_start(struct usbip_device *ud)
+{
+	struct sock *sk = ud->tcp_socket->sk;
+	int tcp = sk->sk_type == SOCK_STREAM && sk->sk_protocol == IPPROTO_TCP;
+
+	init_waitqueue_head(&ud->rx_waitq);
+	ud->use_wq = usbip_workers && tcp;
+
+	if (ud->rx_mode == USBIP_RX_READSOCK && !tcp) {
+		pr_warning("readsock needs a tcp socket, using recvmsg\n");
+		ud->rx_mode = USBIP_RX_RECVMSG;
+	}
+
+	if (ud->rx_mode != USBIP_RX_READSOCK && !ud->use_wq &&
+	    !ud->wq_ops.rx_data)
+		return;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	ud->saved_data_ready = sk->sk_data_ready;
+	ud->saved_state_change = sk->sk_state_change;
+	sk->sk_user_data = ud;
+	sk->sk_data_ready = usbip_sk_data_ready;
+	sk->sk_state_change = usbip_sk_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+EXPORT_SYMBOL_GPL(usbip_rx_start);
+
+/* restore the socket callbacks; the rx thread must have been stopped */
+void usbip_rx_stop(struct usbip_device *ud)
+{
+	struct sock *sk;
+
+	if (!ud->tcp_socket || !ud->saved_state_change)
+		return;
+
+	sk = ud->tcp_socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_data_ready = ud->saved_data_ready;
+	sk->sk_state_change = ud->saved_state_change;
+	sk->sk_user_data = NULL;
+	write_unlock_bh(&sk->sk_callback_lock);
+
+	ud->saved_data_ready = NULL;
+	ud->saved_state_change = NULL;
+}
+EXPORT_SYMBOL_GPL(usbip_rx_stop);
+
+/* same return values as usbip_recv() */
+static int usbip_recv_readsock(struct usbip_device *ud, void *buf, int size)
+{
+	struct sock *sk = ud->tcp_socket->sk;
+	struct usbip_rx_segment seg;
+	read_descriptor_t desc;
+	long timeo = sock_rcvtimeo(sk, 0);
+	int err, eof;
+
+	seg.buf = buf;
+	seg.len = size;
+	seg.copied = 0;
+
+	while (seg.copied < seg.len) {
+		memset(&desc, 0, sizeof(desc));
+		desc.arg.data = &seg;
+		desc.count = 1;
+
+		lock_sock(sk);
+		tcp_read_sock(sk, &desc, usbip_rx_actor);
+		err = sock_error(sk);
+		eof = skb_queue_empty(&sk->sk_receive_queue) &&
+			(sk->sk_shutdown & RCV_SHUTDOWN);
+		release_sock(sk);
+
+		if (desc.error)
+			return desc.error;
+		if (seg.copied == seg.len)
+			break;
+		if (err)
+			return err;
+		if (eof)
+			return 0;
+
+		timeo = wait_event_interruptible_timeout(ud->rx_waitq,
+					(usbip_rx_readable(sk) ||
+					 kthread_should_stop()), timeo);
+		if (timeo < 0)
+			return timeo;
+		if (!timeo)
+			return -EAGAIN;
+		if (kthread_should_stop())
+			return -ERESTARTSYS;
+	}
+
+	if (usbip_dbg_flag_xmit) {
+		pr_debug("%-10s: received by readsock\n", current->comm);
+		usbip_dump_buffer(buf, size);
+	}
+
+	return seg.copied;
+}
+
+/* receive data of a pdu with the receive engine of the connection */
+int usbip_recv_data(struct usbip_device *ud, void *buf, int size)
+{
+	if (ud->rx_mode == USBIP_RX_READSOCK)
+		return usbip_recv_readsock(ud, buf, size);
+
+	return usbip_recv(ud->tcp_socket, buf, size);
+}
+EXPORT_SYMBOL_GPL(usbip_recv_data);
+
+/* bytes that can be received without waiting, 0 if not known */
+int usbip_rx_avail(struct usbip_device *ud)
+{
+	struct sock *sk = ud->tcp_socket->sk;
+	int avail;
+
+	if (sk->sk_type != SOCK_STREAM || sk->sk_protocol != IPPROTO_TCP)
+		return 0;
+
+	lock_sock(sk);
+	avail = tcp_sk(sk)->rcv_nxt - tcp_sk(sk)->copied_seq;
+	release_sock(sk);
+
+	return avail;
+}
+EXPORT_SYMBOL_GPL(usbip_rx_avail);
+
+/*
+ * Peek at the header of the next pdu without taking it from the socket or
+ * waiting. Returns 1 if @pdu has been filled in, in host byte order, 0 if
+ * no complete header has arrived yet, or a negative error.
+ */
+int usbip_rx_peek(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	struct msghdr msg;
+	struct kvec iov;
+	int ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = pdu;
+	iov.iov_len = sizeof(*pdu);
+	ret = kernel_recvmsg(ud->tcp_socket, &msg, &iov, 1, sizeof(*pdu),
+			     MSG_PEEK | MSG_DONTWAIT);
+	if (ret == -EAGAIN || (ret >= 0 && ret < (int) sizeof(*pdu)))
+		return 0;
+	if (ret < 0)
+		return ret;
+
+	usbip_header_correct_endian(pdu, 0);
+
+	return 1;
+}
+EXPORT_SYMBOL_GPL(usbip_rx_peek);
+
+/* usbip_rx_pdu_ready(): the pdu can only be received by waiting for it */
+#define USBIP_RX_BLOCKING	2
+
+/*
+ * Whether the next pdu can be received without waiting for the peer. The
+ * header is peeked to learn the size of the payload from the side. A pdu
+ * too large to ever fit in the receive buffer has to be received by
+ * blocking, as the rx thread would, which is USBIP_RX_BLOCKING; so does one
+ * the side says may sleep while it is handled. Errors are left to the side
+ * to report.
+ */
+static int usbip_rx_pdu_ready(struct usbip_device *ud)
+{
+	struct sock *sk = ud->tcp_socket->sk;
+	struct usbip_header pdu;
+	int avail, size, ret;
+
+	if (sk->sk_err || (sk->sk_shutdown & RCV_SHUTDOWN))
+		return 1;
+
+	avail = usbip_rx_avail(ud);
+	if (avail < (int) sizeof(pdu))
+		return 0;
+
+	ret = usbip_rx_peek(ud, &pdu);
+	if (!ret)
+		return 0;
+	if (ret < 0)
+		return 1;
+
+	size = ud->wq_ops.pdu_size(ud, &pdu);
+	if (size < 0)
+		return 1;
+	size += sizeof(pdu);
+
+	if (avail >= size) {
+		if (ud->wq_ops.pdu_blocks && ud->wq_ops.pdu_blocks(ud, &pdu))
+			return USBIP_RX_BLOCKING;
+		return 1;
+	}
+
+	return size > (sk->sk_rcvbuf >> 1) ? USBIP_RX_BLOCKING : 0;
+}
+
+/* hand the next pdu over to rx_slow_work, off the bounded pool */
+static void usbip_queue_rx_slow(struct usbip_device *ud)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	if (ud->wq_active) {
+		ud->rx_slow = 1;
+		queue_work(usbip_io_wq, &ud->rx_slow_work);
+	}
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+}
+
+/* rx budget of one run, so that a busy connection does not hog a worker */
+#define USBIP_RX_WORK_PDUS	64
+
+static void usbip_rx_work(struct work_struct *work)
+{
+	struct usbip_device *ud = container_of(work, struct usbip_device,
+					       rx_work);
+	int budget = USBIP_RX_WORK_PDUS;
+	int ready;
+
+	/* rx_slow_work requeues us when it is done */
+	if (ACCESS_ONCE(ud->rx_slow))
+		return;
+
+	while (!usbip_event_happened(ud)) {
+		if (ud->wq_ops.rx_throttled && ud->wq_ops.rx_throttled(ud))
+			break;
+		ready = usbip_rx_pdu_ready(ud);
+		if (!ready) {
+			if (ud->wq_ops.rx_idle)
+				ud->wq_ops.rx_idle(ud);
+			break;
+		}
+		if (ready == USBIP_RX_BLOCKING) {
+			usbip_queue_rx_slow(ud);
+			break;
+		}
+		if (!budget--) {
+			usbip_queue_rx(ud);
+			break;
+		}
+		ud->wq_ops.rx_pdu(ud);
+	}
+}
+
+static void usbip_rx_slow_work(struct work_struct *work)
+{
+	struct usbip_device *ud = container_of(work, struct usbip_device,
+					       rx_slow_work);
+	unsigned long flags;
+
+	if (!usbip_event_happened(ud))
+		ud->wq_ops.rx_pdu(ud);
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	ud->rx_slow = 0;
+	if (ud->wq_active)
+		queue_work(usbip_wq, &ud->rx_work);
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+}
+
+static void usbip_tx_work(struct work_struct *work)
+{
+	struct usbip_device *ud = container_of(work, struct usbip_device,
+					       tx_work);
+
+	if (!usbip_event_happened(ud))
+		ud->wq_ops.tx(ud);
+}
+
+/* start a connection on the shared pool, after usbip_rx_start() */
+void usbip_wq_start(struct usbip_device *ud)
+{
+	unsigned long flags;
+
+	INIT_WORK(&ud->rx_work, usbip_rx_work);
+	INIT_WORK(&ud->rx_slow_work, usbip_rx_slow_work);
+	INIT_WORK(&ud->tx_work, usbip_tx_work);
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	ud->wq_active = 1;
+	ud->rx_slow = 0;
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+
+	/* the peer may have sent something already */
+	usbip_queue_rx(ud);
+}
+EXPORT_SYMBOL_GPL(usbip_wq_start);
+
+/* the counterpart of stopping the rx and tx threads */
+void usbip_wq_stop(struct usbip_device *ud)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	ud->wq_active = 0;
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+
+	cancel_work_sync(&ud->rx_work);
+	cancel_work_sync(&ud->rx_slow_work);
+	cancel_work_sync(&ud->tx_work);
+}
+EXPORT_SYMBOL_GPL(usbip_wq_stop);
+
+void usbip_queue_rx(struct usbip_device *ud)
+{
+	unsigned long flags;
+
+	if (!ud->use_wq)
+		return;
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	if (ud->wq_active && !ud->rx_slow)
+		queue_work(usbip_wq, &ud->rx_work);
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+}
+EXPORT_SYMBOL_GPL(usbip_queue_rx);
+
+void usbip_queue_tx(struct usbip_device *ud)
+{
+	unsigned long flags;
+
+	if (!ud->use_wq)
+		return;
+
+	spin_lock_irqsave(&ud->wq_lock, flags);
+	if (ud->wq_active)
+		queue_work(usbip_io_wq, &ud->tx_work);
+	spin_unlock_irqrestore(&ud->wq_lock, flags);
+}
+EXPORT_SYMBOL_GPL(usbip_queue_tx);
+
+/* wake up the tx side of a connection, thread or work */
+void usbip_wake_tx(struct usbip_device *ud, wait_queue_head_t *waitq)
+{
+	wake_up(waitq);
+	usbip_queue_tx(ud);
+}
+EXPORT_SYMBOL_GPL(usbip_wake_tx);
+
+/* whether a payload of @len bytes should be sent by reference */
+int usbip_xmit_zerocopy(size_t len)
+{
+	unsigned int min = ACCESS_ONCE(usbip_zerocopy_min);
+
+	return min && len >= min;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_zerocopy);
+
+/*
+ * Whether the pages of @buf may be referenced by the socket. Slab objects
+ * may not: the page stays allocated while another object takes the place
+ * of the one that was sent.
+ */
+int usbip_buf_pageable(const void *buf)
+{
+	return virt_addr_valid(buf) && !PageSlab(virt_to_head_page(buf));
+}
+EXPORT_SYMBOL_GPL(usbip_buf_pageable);
+
+/*
+ * Send @len bytes at @buf with kernel_sendpage(). The caller has checked
+ * usbip_buf_pageable(); same return values as kernel_sendmsg().
+ */
+int usbip_sendbuf(struct socket *sock, void *buf, size_t len, int more)
+{
+	size_t sent = 0;
+	int ret;
+
+	while (sent < len) {
+		int offset = offset_in_page(buf + sent);
+		size_t n = min_t(size_t, len - sent, PAGE_SIZE - offset);
+		int flags = MSG_NOSIGNAL;
+
+		if (more || sent + n < len)
+			flags |= MSG_MORE;
+
+		ret = kernel_sendpage(sock, virt_to_page(buf + sent), offset,
+				      n, flags);
+		if (ret < 0)
+			return ret;
+		sent += ret;
+		if (ret != n)
+			break;
+	}
+
+	return sent;
+}
+EXPORT_SYMBOL_GPL(usbip_sendbuf);
+
 struct socket *sockfd_to_socket(unsigned int sockfd)
 {
 	struct socket *socket;
@@ -448,18 +944,27 @@ static void usbip_pack_cmd_submit(struct usbip_header *pdu, struct urb *urb,
 	/*
 	 * Some members are not still implemented in usbip. I hope this issue
 	 * will be discussed when usbip is ported to other operating systems.
+	 *
+	 * A bulk transfer has no start frame; the field carries its stream id
+	 * instead, see usbip_protocol.txt. urb->pipe is set before unpacking.
 	 */
 	if (pack) {
 		spdu->transfer_flags =
 			tweak_transfer_flags(urb->transfer_flags);
 		spdu->transfer_buffer_length	= urb->transfer_buffer_length;
-		spdu->start_frame		= urb->start_frame;
+		if (usb_pipebulk(urb->pipe))
+			spdu->start_frame	= urb->stream_id;
+		else
+			spdu->start_frame	= urb->start_frame;
 		spdu->number_of_packets		= urb->number_of_packets;
 		spdu->interval			= urb->interval;
 	} else  {
 		urb->transfer_flags         = spdu->transfer_flags;
 		urb->transfer_buffer_length = spdu->transfer_buffer_length;
-		urb->start_frame            = spdu->start_frame;
+		if (usb_pipebulk(urb->pipe))
+			urb->stream_id      = spdu->start_frame;
+		else
+			urb->start_frame    = spdu->start_frame;
 		urb->number_of_packets      = spdu->number_of_packets;
 		urb->interval               = spdu->interval;
 	}
@@ -642,6 +1147,20 @@ static void usbip_pack_iso(struct usbip_iso_packet_descriptor *iso,
 	}
 }
 
+/* iso must have room for urb->number_of_packets descriptors */
+void usbip_fill_iso_desc_pdu(struct urb *urb,
+			     struct usbip_iso_packet_descriptor *iso)
+{
+	int np = urb->number_of_packets;
+	int i;
+
+	for (i = 0; i < np; i++) {
+		usbip_pack_iso(&iso[i], &urb->iso_frame_desc[i], 1);
+		usbip_iso_packet_correct_endian(&iso[i], 1);
+	}
+}
+EXPORT_SYMBOL_GPL(usbip_fill_iso_desc_pdu);
+
 /* must free buffer */
 struct usbip_iso_packet_descriptor*
 usbip_alloc_iso_desc_pdu(struct urb *urb, ssize_t *bufflen)
@@ -649,16 +1168,12 @@ usbip_alloc_iso_desc_pdu(struct urb *urb, ssize_t *bufflen)
 	struct usbip_iso_packet_descriptor *iso;
 	int np = urb->number_of_packets;
 	ssize_t size = np * sizeof(*iso);
-	int i;
 
 	iso = kzalloc(size, GFP_KERNEL);
 	if (!iso)
 		return NULL;
 
-	for (i = 0; i < np; i++) {
-		usbip_pack_iso(&iso[i], &urb->iso_frame_desc[i], 1);
-		usbip_iso_packet_correct_endian(&iso[i], 1);
-	}
+	usbip_fill_iso_desc_pdu(urb, iso);
 
 	*bufflen = size;
 
@@ -666,6 +1181,321 @@ usbip_alloc_iso_desc_pdu(struct urb *urb, ssize_t *bufflen)
 }
 EXPORT_SYMBOL_GPL(usbip_alloc_iso_desc_pdu);
 
+static void usbip_xmit_error(struct usbip_device *ud, int nomem)
+{
+	if (ud->side == USBIP_STUB)
+		usbip_event_add(ud, nomem ? SDEV_EVENT_ERROR_MALLOC :
+				SDEV_EVENT_ERROR_TCP);
+	else
+		usbip_event_add(ud, nomem ? VDEV_EVENT_ERROR_MALLOC :
+				VDEV_EVENT_ERROR_TCP);
+}
+
+int usbip_xmit_batch_init(struct usbip_xmit_batch *batch,
+			  struct usbip_device *ud, int iovmax,
+			  size_t scratch_size)
+{
+	memset(batch, 0, sizeof(*batch));
+
+	batch->iov = kcalloc(iovmax, sizeof(struct kvec), GFP_KERNEL);
+	if (!batch->iov)
+		return -ENOMEM;
+
+	batch->pages = kcalloc(iovmax, sizeof(*batch->pages), GFP_KERNEL);
+	batch->scratch = kmalloc(scratch_size, GFP_KERNEL);
+	if (!batch->pages || !batch->scratch) {
+		kfree(batch->iov);
+		kfree(batch->pages);
+		kfree(batch->scratch);
+		batch->iov = NULL;
+		batch->pages = NULL;
+		batch->scratch = NULL;
+		return -ENOMEM;
+	}
+
+	batch->ud = ud;
+	batch->iovmax = iovmax;
+	batch->scratch_size = scratch_size;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_init);
+
+void usbip_xmit_batch_free(struct usbip_xmit_batch *batch)
+{
+	kfree(batch->iov);
+	kfree(batch->pages);
+	kfree(batch->scratch);
+	memset(batch, 0, sizeof(*batch));
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_free);
+
+/* drop everything queued since the last flush */
+void usbip_xmit_batch_reset(struct usbip_xmit_batch *batch)
+{
+	batch->iovnum = 0;
+	batch->pagenum = 0;
+	batch->scratch_len = 0;
+	batch->size = 0;
+	batch->count = 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_reset);
+
+/* how long usbip_xmit_abort() waits for the socket to let go of pages */
+#define USBIP_XMIT_ABORT_MS	1000
+
+/*
+ * usbip_xmit_abort - forget everything not sent yet on a dead connection
+ * @sock: socket of the connection, its tx side stopped
+ * @batch: tx batch of the connection, or NULL
+ *
+ * Payloads may be queued by reference in @batch and in the socket. Before
+ * the requests they belong to are given back without an answer from the
+ * peer, the unflushed batch is dropped, the connection is reset so that the
+ * socket purges its send queue rather than transmitting it on close, and
+ * the skbs still out in the stack are waited for, up to a second.
+ */
+void usbip_xmit_abort(struct socket *sock, struct usbip_xmit_batch *batch)
+{
+	struct sock *sk = sock->sk;
+	int ms;
+
+	if (batch)
+		usbip_xmit_batch_reset(batch);
+
+	if (sk->sk_prot->disconnect) {
+		lock_sock(sk);
+		sk->sk_prot->disconnect(sk, 0);
+		release_sock(sk);
+	}
+
+	for (ms = 0; sk_wmem_alloc_get(sk) && ms < USBIP_XMIT_ABORT_MS;
+	     ms += 10)
+		msleep(10);
+
+	if (sk_wmem_alloc_get(sk))
+		pr_warning("tx pages still referenced by the socket\n");
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_abort);
+
+/*
+ * Queue @len bytes of @page by reference. The page may be reused by its
+ * owner as soon as the batch has been flushed; the socket holds a reference
+ * of its own until the data has been acked.
+ */
+int usbip_xmit_batch_add_page(struct usbip_xmit_batch *batch,
+			      struct page *page, int offset, size_t len)
+{
+	struct usbip_xmit_page *xp;
+
+	if (!len)
+		return 0;
+
+	if (batch->pagenum == batch->iovmax &&
+	    usbip_xmit_batch_flush(batch, 1) < 0)
+		return -EPIPE;
+
+	xp = &batch->pages[batch->pagenum++];
+	xp->page = page;
+	xp->offset = offset;
+	xp->len = len;
+	xp->iov_pos = batch->iovnum;
+	batch->size += len;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_add_page);
+
+/* queue a payload, by reference if it is large and page backed */
+int usbip_xmit_batch_add_buf(struct usbip_xmit_batch *batch, void *buf,
+			     size_t len)
+{
+	if (!usbip_xmit_zerocopy(len) || !usbip_buf_pageable(buf))
+		return usbip_xmit_batch_add(batch, buf, len);
+
+	while (len) {
+		int offset = offset_in_page(buf);
+		size_t n = min_t(size_t, len, PAGE_SIZE - offset);
+
+		if (usbip_xmit_batch_add_page(batch, virt_to_page(buf), offset,
+					      n) < 0)
+			return -EPIPE;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_add_buf);
+
+/*
+ * Queue the first @len bytes of a scatterlist, one page at a time. Highmem
+ * pages, and all pages of a payload large enough for zero-copy, are queued
+ * by reference; see usbip_xmit_batch_add_page().
+ */
+int usbip_xmit_batch_add_sg(struct usbip_xmit_batch *batch,
+			    struct scatterlist *sgl, int nents, size_t len)
+{
+	int zc = usbip_xmit_zerocopy(len);
+	struct scatterlist *sg;
+	int i, ret;
+
+	for_each_sg(sgl, sg, nents, i) {
+		size_t left = min_t(size_t, len, sg->length);
+		unsigned int offset = offset_in_page(sg->offset);
+		struct page *page = nth_page(sg_page(sg),
+					     sg->offset >> PAGE_SHIFT);
+
+		len -= left;
+		while (left) {
+			size_t n = min_t(size_t, left, PAGE_SIZE - offset);
+
+			if (zc || PageHighMem(page))
+				ret = usbip_xmit_batch_add_page(batch, page,
+								offset, n);
+			else
+				ret = usbip_xmit_batch_add(batch,
+						page_address(page) + offset, n);
+			if (ret < 0)
+				return -EPIPE;
+
+			left -= n;
+			offset = 0;
+			page = nth_page(page, 1);
+		}
+
+		if (!len)
+			break;
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_add_sg);
+
+/*
+ * Push everything queued in the batch to the socket. If @more is set, the
+ * caller is going to send more data right away and the stack may hold back
+ * a partial segment (MSG_MORE).
+ */
+int usbip_xmit_batch_flush(struct usbip_xmit_batch *batch, int more)
+{
+	struct socket *sock = batch->ud->tcp_socket;
+	struct msghdr msg;
+	size_t txsize = batch->size;
+	size_t sent = 0, len;
+	int start = 0, end, i, j;
+	int ret;
+
+	if (!batch->iovnum && !batch->pagenum) {
+		usbip_xmit_batch_reset(batch);
+		return 0;
+	}
+
+	/* kvec runs and pages alternate; only the last one may push */
+	for (i = 0; i <= batch->pagenum; i++) {
+		end = i < batch->pagenum ? batch->pages[i].iov_pos :
+			batch->iovnum;
+
+		if (end > start) {
+			len = 0;
+			for (j = start; j < end; j++)
+				len += batch->iov[j].iov_len;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_flags = MSG_NOSIGNAL;
+			if (more || i < batch->pagenum)
+				msg.msg_flags |= MSG_MORE;
+
+			ret = kernel_sendmsg(sock, &msg, batch->iov + start,
+					     end - start, len);
+			if (ret != len)
+				goto err;
+			sent += ret;
+			start = end;
+		}
+
+		if (i < batch->pagenum) {
+			struct usbip_xmit_page *xp = &batch->pages[i];
+			int flags = MSG_NOSIGNAL;
+
+			if (more || i + 1 < batch->pagenum ||
+			    end < batch->iovnum)
+				flags |= MSG_MORE;
+
+			ret = kernel_sendpage(sock, xp->page, xp->offset,
+					      xp->len, flags);
+			if (ret != xp->len)
+				goto err;
+			sent += ret;
+		}
+	}
+	usbip_xmit_batch_reset(batch);
+
+	usbip_dbg_xmit("sent batch of %zd bytes\n", txsize);
+
+	return sent;
+
+err:
+	usbip_xmit_batch_reset(batch);
+	pr_err("sendmsg failed!, ret=%d for %zd\n", ret, txsize);
+	usbip_xmit_error(batch->ud, 0);
+	return -EPIPE;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_flush);
+
+/*
+ * Reserve @size bytes in the scratch area of the batch. Queued data is
+ * flushed first if the scratch area is exhausted, so the returned memory is
+ * only valid until the next flush.
+ */
+void *usbip_xmit_batch_scratch(struct usbip_xmit_batch *batch, size_t size)
+{
+	void *buf;
+
+	if (batch->scratch_len + size > batch->scratch_size) {
+		if (usbip_xmit_batch_flush(batch, 1) < 0)
+			return NULL;
+
+		/* the scratch area is not referenced any more */
+		if (size > batch->scratch_size) {
+			buf = kmalloc(size, GFP_KERNEL);
+			if (!buf) {
+				usbip_xmit_error(batch->ud, 1);
+				return NULL;
+			}
+			kfree(batch->scratch);
+			batch->scratch = buf;
+			batch->scratch_size = size;
+		}
+	}
+
+	buf = batch->scratch + batch->scratch_len;
+	batch->scratch_len += size;
+
+	return buf;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_scratch);
+
+/* queue @len bytes at @base; they must stay untouched until the flush */
+int usbip_xmit_batch_add(struct usbip_xmit_batch *batch, void *base,
+			 size_t len)
+{
+	if (!len)
+		return 0;
+
+	if (batch->iovnum == batch->iovmax &&
+	    usbip_xmit_batch_flush(batch, 1) < 0)
+		return -EPIPE;
+
+	batch->iov[batch->iovnum].iov_base = base;
+	batch->iov[batch->iovnum].iov_len = len;
+	batch->iovnum++;
+	batch->size += len;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(usbip_xmit_batch_add);
+
 /* some members of urb must be substituted before. */
 int usbip_recv_iso(struct usbip_device *ud, struct urb *urb)
 {
@@ -688,7 +1518,7 @@ int usbip_recv_iso(struct usbip_device *ud, struct urb *urb)
 	if (!buff)
 		return -ENOMEM;
 
-	ret = usbip_recv(ud->tcp_socket, buff, size);
+	ret = usbip_recv_data(ud, buff, size);
 	if (ret != size) {
 		dev_err(&urb->dev->dev, "recv iso_frame_descriptor, %d\n",
 			ret);
@@ -769,6 +1599,41 @@ void usbip_pad_iso(struct usbip_device *ud, struct urb *urb)
 }
 EXPORT_SYMBOL_GPL(usbip_pad_iso);
 
+/* fill the pages of a scatter-gather urb, one page at a time */
+static int usbip_recv_sg(struct usbip_device *ud, struct urb *urb, int size)
+{
+	struct scatterlist *sg;
+	int total = 0;
+	int i, ret;
+
+	for_each_sg(urb->sg, sg, urb->num_sgs, i) {
+		int left = min_t(int, size - total, sg->length);
+		unsigned int offset = offset_in_page(sg->offset);
+		struct page *page = nth_page(sg_page(sg),
+					     sg->offset >> PAGE_SHIFT);
+
+		while (left) {
+			int len = min_t(int, left, PAGE_SIZE - offset);
+
+			/* highmem pages of a vhci urb, lowmem ones of stub */
+			ret = usbip_recv_data(ud, kmap(page) + offset, len);
+			kunmap(page);
+			if (ret != len)
+				return ret < 0 ? ret : total + ret;
+
+			total += len;
+			left -= len;
+			offset = 0;
+			page = nth_page(page, 1);
+		}
+
+		if (total == size)
+			break;
+	}
+
+	return total;
+}
+
 /* some members of urb must be substituted before. */
 int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb)
 {
@@ -793,7 +1658,10 @@ int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb)
 	if (!(size > 0))
 		return 0;
 
-	ret = usbip_recv(ud->tcp_socket, urb->transfer_buffer, size);
+	if (urb->num_sgs && !urb->transfer_buffer)
+		ret = usbip_recv_sg(ud, urb, size);
+	else
+		ret = usbip_recv_data(ud, urb->transfer_buffer, size);
 	if (ret != size) {
 		dev_err(&urb->dev->dev, "recv xbuf, %d\n", ret);
 		if (ud->side == USBIP_STUB) {
@@ -917,15 +1785,22 @@ EXPORT_SYMBOL_GPL(usbip_filter_on_tx);
 
 static int __init usbip_core_init(void)
 {
+	int ret;
+
 	spin_lock_init(&usbip_filters.lock);
     INIT_LIST_HEAD(&usbip_filters.list);
+
+	ret = usbip_wq_init();
+	if (ret)
+		return ret;
+
 	pr_info(DRIVER_DESC " v" USBIP_VERSION "\n");
 	return 0;
 }
 
 static void __exit usbip_core_exit(void)
 {
-	return;
+	usbip_wq_exit();
 }
 
 module_init(usbip_core_init);
@@ -28,7 +28,9 @@
 #include <linux/spinlock.h>
 #include <linux/types.h>
 #include <linux/usb.h>
+#include <linux/version.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #define USBIP_VERSION USBIP_VERSION_STRING
 
@@ -143,6 +145,16 @@ enum usbip_status {
 #define	VDEV_EVENT_ERROR_TCP	(USBIP_EH_SHUTDOWN | USBIP_EH_RESET)
 #define	VDEV_EVENT_ERROR_MALLOC	(USBIP_EH_SHUTDOWN | USBIP_EH_UNUSABLE)
 
+/* receive engines of a connection, see usbip_recv_data() */
+#define USBIP_RX_RECVMSG	0
+#define USBIP_RX_READSOCK	1
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0))
+typedef void (*usbip_data_ready_t)(struct sock *sk);
+#else
+typedef void (*usbip_data_ready_t)(struct sock *sk, int bytes);
+#endif
+
 struct usbip_device;
 struct usbip_filter;
 
@@ -199,6 +211,112 @@ struct usbip_device {
 
 	spinlock_t filter_lock;
 	struct list_head filters;
+
+	/*
+	 * rx_mode selects the receive engine when a connection is set up.
+	 * With USBIP_RX_READSOCK the socket callbacks are redirected to
+	 * rx_waitq and the saved ones are restored by usbip_rx_stop().
+	 */
+	int rx_mode;
+	wait_queue_head_t rx_waitq;
+	usbip_data_ready_t saved_data_ready;
+	void (*saved_state_change)(struct sock *sk);
+
+	/*
+	 * With usbip_workers set, the rx and tx threads of a connection are
+	 * replaced by rx_work on usbip_wq and tx_work on usbip_io_wq, and the
+	 * event handler thread by eh_work on usbip_io_wq. A pdu that cannot
+	 * be received without waiting, for the peer or for the device, is
+	 * received by rx_slow_work on usbip_io_wq instead; rx_work does not
+	 * run while rx_slow is set.
+	 * use_wq is chosen by usbip_rx_start(); wq_active is cleared under
+	 * wq_lock before the works are cancelled, so that nothing queues them
+	 * again. eh_task is the task running the event handler, in both
+	 * models.
+	 */
+	int use_wq;
+	int wq_active;
+	int rx_slow;
+	spinlock_t wq_lock;
+	struct work_struct rx_work;
+	struct work_struct rx_slow_work;
+	struct work_struct tx_work;
+
+	int eh_wq;
+	int eh_active;
+	struct work_struct eh_work;
+	struct task_struct *eh_task;
+
+	struct wq_ops {
+		void (*rx_pdu)(struct usbip_device *);
+		int (*pdu_size)(struct usbip_device *, struct usbip_header *);
+		void (*tx)(struct usbip_device *);
+		/*
+		 * optional, nonzero if receiving pdu may sleep, e.g. on the
+		 * device; such a pdu goes to rx_slow_work
+		 */
+		int (*pdu_blocks)(struct usbip_device *,
+				  struct usbip_header *);
+		/* optional, called when rx runs out of complete pdus */
+		void (*rx_idle)(struct usbip_device *);
+		/*
+		 * optional, nonzero while rx must not read; whoever lifts
+		 * that calls usbip_queue_rx()
+		 */
+		int (*rx_throttled)(struct usbip_device *);
+		/*
+		 * optional, called from sk_data_ready when data arrives, in
+		 * every model; usbip_rx_start() hooks the socket for it
+		 */
+		void (*rx_data)(struct usbip_device *);
+	} wq_ops;
+};
+
+/*
+ * Flush policy of a transmit batch. A batch is pushed to the socket when it
+ * holds max_bytes or max_urbs, whichever comes first. max_delay (usecs) is
+ * the time a sender may linger for more requests before flushing a batch
+ * that is not full. Zero disables the respective limit.
+ */
+struct usbip_xmit_policy {
+	unsigned int max_bytes;
+	unsigned int max_urbs;
+	unsigned int max_delay;
+};
+
+/* a payload segment sent by reference, ahead of iov[iov_pos] */
+struct usbip_xmit_page {
+	struct page *page;
+	int offset;
+	size_t len;
+	int iov_pos;
+};
+
+/*
+ * usbip_xmit_batch gathers the pdus of many requests into one kvec array so
+ * that they are sent with as few kernel_sendmsg() calls as possible. Headers
+ * and iso descriptors are built in the scratch area of the batch, and both
+ * arrays are reused across flushes. Large payloads may be queued as pages
+ * instead, which are handed to the socket with kernel_sendpage() in their
+ * place in the stream.
+ */
+struct usbip_xmit_batch {
+	struct usbip_device *ud;
+
+	struct kvec *iov;
+	int iovnum;
+	int iovmax;
+
+	struct usbip_xmit_page *pages;
+	int pagenum;
+
+	char *scratch;
+	size_t scratch_len;
+	size_t scratch_size;
+
+	/* bytes and pdus since the last flush */
+	size_t size;
+	int count;
 };
 
 #define kthread_get_run(threadfn, data, namefmt, ...)			   \
@@ -223,6 +341,16 @@ void usbip_dump_urb(struct urb *purb);
 void usbip_dump_header(struct usbip_header *pdu);
 
 int usbip_recv(struct socket *sock, void *buf, int size);
+void usbip_rx_start(struct usbip_device *ud);
+void usbip_rx_stop(struct usbip_device *ud);
+int usbip_recv_data(struct usbip_device *ud, void *buf, int size);
+int usbip_rx_avail(struct usbip_device *ud);
+int usbip_rx_peek(struct usbip_device *ud, struct usbip_header *pdu);
+void usbip_wq_start(struct usbip_device *ud);
+void usbip_wq_stop(struct usbip_device *ud);
+void usbip_queue_rx(struct usbip_device *ud);
+void usbip_queue_tx(struct usbip_device *ud);
+void usbip_wake_tx(struct usbip_device *ud, wait_queue_head_t *waitq);
 struct socket *sockfd_to_socket(unsigned int sockfd);
 
 void usbip_pack_pdu(struct usbip_header *pdu, struct urb *urb, int cmd,
@@ -231,6 +359,36 @@ void usbip_header_correct_endian(struct usbip_header *pdu, int send);
 
 struct usbip_iso_packet_descriptor*
 usbip_alloc_iso_desc_pdu(struct urb *urb, ssize_t *bufflen);
+void usbip_fill_iso_desc_pdu(struct urb *urb,
+			     struct usbip_iso_packet_descriptor *iso);
+
+int usbip_xmit_batch_init(struct usbip_xmit_batch *batch,
+			  struct usbip_device *ud, int iovmax,
+			  size_t scratch_size);
+void usbip_xmit_batch_free(struct usbip_xmit_batch *batch);
+void usbip_xmit_batch_reset(struct usbip_xmit_batch *batch);
+void *usbip_xmit_batch_scratch(struct usbip_xmit_batch *batch, size_t size);
+int usbip_xmit_batch_add(struct usbip_xmit_batch *batch, void *base,
+			 size_t len);
+int usbip_xmit_batch_add_page(struct usbip_xmit_batch *batch,
+			      struct page *page, int offset, size_t len);
+int usbip_xmit_batch_add_buf(struct usbip_xmit_batch *batch, void *buf,
+			     size_t len);
+int usbip_xmit_batch_add_sg(struct usbip_xmit_batch *batch,
+			    struct scatterlist *sgl, int nents, size_t len);
+int usbip_xmit_batch_flush(struct usbip_xmit_batch *batch, int more);
+void usbip_xmit_abort(struct socket *sock, struct usbip_xmit_batch *batch);
+
+int usbip_xmit_zerocopy(size_t len);
+int usbip_buf_pageable(const void *buf);
+int usbip_sendbuf(struct socket *sock, void *buf, size_t len, int more);
+
+static inline int usbip_xmit_batch_full(struct usbip_xmit_batch *batch,
+					struct usbip_xmit_policy *policy)
+{
+	return (policy->max_bytes && batch->size >= policy->max_bytes) ||
+		(policy->max_urbs && batch->count >= policy->max_urbs);
+}
 
 /* some members of urb must be substituted before. */
 int usbip_recv_iso(struct usbip_device *ud, struct urb *urb);
@@ -238,6 +396,12 @@ void usbip_pad_iso(struct usbip_device *ud, struct urb *urb);
 int usbip_recv_xbuff(struct usbip_device *ud, struct urb *urb);
 
 /* usbip_event.c */
+extern unsigned int usbip_workers;
+extern struct workqueue_struct *usbip_wq;
+extern struct workqueue_struct *usbip_io_wq;
+
+int usbip_wq_init(void);
+void usbip_wq_exit(void);
 int usbip_start_eh(struct usbip_device *ud);
 void usbip_stop_eh(struct usbip_device *ud);
 void usbip_event_add(struct usbip_device *ud, unsigned long event);
@@ -255,4 +419,15 @@ static inline int interface_to_devnum(struct usb_interface *interface)
 	return udev->devnum;
 }
 
+/* bulk streams a SuperSpeed endpoint supports, 0 if none */
+static inline unsigned int usbip_ep_max_streams(struct usb_host_endpoint *ep)
+{
+	int max = ep->ss_ep_comp.bmAttributes & 0x1f;
+
+	if (!usb_endpoint_xfer_bulk(&ep->desc) || !max)
+		return 0;
+
+	return 1 << max;
+}
+
 #endif /* __USBIP_COMMON_H */
@@ -18,7 +18,10 @@
  */
 
 #include <linux/kthread.h>
+#include <linux/moduleparam.h>
+#include <linux/stat.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,2,0))
 #include_next <linux/export.h>
 #else
@@ -27,6 +30,74 @@
 
 #include "usbip_common.h"
 
+/*
+ * Shared worker pool. With usbip_workers left at 0 every connection gets its
+ * own rx, tx and event handler threads. Otherwise devices set up afterwards
+ * run them as work items: receiving on usbip_wq, an unbound workqueue
+ * running at most usbip_workers of them at a time, and whatever may block on
+ * the peer or on teardown, i.e. sending, the event handler and a pdu too
+ * large to be received without waiting, on usbip_io_wq, which is not
+ * bounded, so that stalled peers cannot starve the pool. The cpumask, nice
+ * and max_active of the pool can be changed in
+ * /sys/bus/workqueue/devices/usbip.
+ */
+unsigned int usbip_workers;
+EXPORT_SYMBOL_GPL(usbip_workers);
+
+struct workqueue_struct *usbip_wq;
+EXPORT_SYMBOL_GPL(usbip_wq);
+
+struct workqueue_struct *usbip_io_wq;
+EXPORT_SYMBOL_GPL(usbip_io_wq);
+
+static int usbip_workers_set(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_uint(val, kp);
+
+	/* 0 leaves the pool to the connections still on it, unbounded */
+	if (!ret && usbip_wq)
+		workqueue_set_max_active(usbip_wq, usbip_workers ?
+					 usbip_workers : WQ_DFL_ACTIVE);
+
+	return ret;
+}
+
+static const struct kernel_param_ops usbip_workers_ops = {
+	.set = usbip_workers_set,
+	.get = param_get_uint,
+};
+
+module_param_cb(usbip_workers, &usbip_workers_ops, &usbip_workers,
+		S_IRUGO|S_IWUSR);
+MODULE_PARM_DESC(usbip_workers,
+		 "size of the shared worker pool (0 = threads per connection)");
+
+int usbip_wq_init(void)
+{
+	unsigned int flags = WQ_UNBOUND;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0))
+	flags |= WQ_SYSFS;
+#endif
+	usbip_wq = alloc_workqueue("usbip", flags, usbip_workers);
+	if (!usbip_wq)
+		return -ENOMEM;
+
+	usbip_io_wq = alloc_workqueue("usbip_io", WQ_UNBOUND, 0);
+	if (!usbip_io_wq) {
+		destroy_workqueue(usbip_wq);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void usbip_wq_exit(void)
+{
+	destroy_workqueue(usbip_io_wq);
+	destroy_workqueue(usbip_wq);
+}
+
 static int event_handler(struct usbip_device *ud)
 {
 	usbip_dbg_eh("enter\n");
@@ -83,16 +154,45 @@ static int event_handler_loop(void *data)
 	return 0;
 }
 
+static void event_handler_work(struct work_struct *work)
+{
+	struct usbip_device *ud = container_of(work, struct usbip_device,
+					       eh_work);
+	unsigned long flags;
+
+	usbip_dbg_eh("wakeup\n");
+
+	ud->eh_task = current;
+	if (event_handler(ud) < 0) {
+		/* like the thread, do not handle anything after BYE */
+		spin_lock_irqsave(&ud->lock, flags);
+		ud->eh_active = 0;
+		spin_unlock_irqrestore(&ud->lock, flags);
+	}
+	ud->eh_task = NULL;
+}
+
 int usbip_start_eh(struct usbip_device *ud)
 {
 	init_waitqueue_head(&ud->eh_waitq);
 	ud->event = 0;
 
+	if (usbip_workers) {
+		INIT_WORK(&ud->eh_work, event_handler_work);
+		ud->eh = NULL;
+		ud->eh_task = NULL;
+		ud->eh_wq = 1;
+		ud->eh_active = 1;
+		return 0;
+	}
+
+	ud->eh_wq = 0;
 	ud->eh = kthread_run(event_handler_loop, ud, "usbip_eh");
 	if (IS_ERR(ud->eh)) {
 		pr_warning("Unable to start control thread\n");
 		return PTR_ERR(ud->eh);
 	}
+	ud->eh_task = ud->eh;
 
 	return 0;
 }
@@ -100,10 +200,20 @@ EXPORT_SYMBOL_GPL(usbip_start_eh);
 
 void usbip_stop_eh(struct usbip_device *ud)
 {
-	if (ud->eh == current)
+	unsigned long flags;
+
+	if (ud->eh_task == current)
 		return; /* do not wait for myself */
 
-	kthread_stop(ud->eh);
+	if (ud->eh_wq) {
+		/* let the events added so far be handled, then stop */
+		spin_lock_irqsave(&ud->lock, flags);
+		ud->eh_active = 0;
+		spin_unlock_irqrestore(&ud->lock, flags);
+		flush_work(&ud->eh_work);
+	} else {
+		kthread_stop(ud->eh);
+	}
 	usbip_dbg_eh("usbip_eh has finished\n");
 }
 EXPORT_SYMBOL_GPL(usbip_stop_eh);
@@ -114,7 +224,10 @@ void usbip_event_add(struct usbip_device *ud, unsigned long event)
 
 	spin_lock_irqsave(&ud->lock, flags);
 	ud->event |= event;
-	wake_up(&ud->eh_waitq);
+	if (!ud->eh_wq)
+		wake_up(&ud->eh_waitq);
+	else if (ud->eh_active)
+		queue_work(usbip_io_wq, &ud->eh_work);
 	spin_unlock_irqrestore(&ud->lock, flags);
 }
 EXPORT_SYMBOL_GPL(usbip_event_add);
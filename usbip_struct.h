@@ -35,6 +35,20 @@
 #   define USBIP_DIR_IN	0x01
 #endif
 
+/*
+ * Optional credit window in the devid of USBIP_RET_SUBMIT and
+ * USBIP_RET_UNLINK: how many requests and how many transfer bytes, in units
+ * of 4 KiB, the client may have outstanding. The all-ones values mean no
+ * limit. A server that does not announce credits leaves devid zero.
+ */
+#define USBIP_CREDIT_VALID		0x80000000
+#define USBIP_CREDIT_URBS_MAX		0xffff
+#define USBIP_CREDIT_UNITS_MAX		0x7fff
+#define USBIP_CREDIT_UNIT_SHIFT		12
+#define USBIP_CREDIT_URBS(devid)	((devid) & USBIP_CREDIT_URBS_MAX)
+#define USBIP_CREDIT_UNITS(devid)	\
+	(((devid) >> 16) & USBIP_CREDIT_UNITS_MAX)
+
 /*
  * This is the same as usb_iso_packet_descriptor but packed for pdu.
  */
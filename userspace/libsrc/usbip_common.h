@@ -81,7 +81,8 @@ enum usb_device_speed {
 	USB_SPEED_UNKNOWN = 0,                  /* enumerating */
 	USB_SPEED_LOW, USB_SPEED_FULL,          /* usb 1.1 */
 	USB_SPEED_HIGH,                         /* usb 2.0 */
-	USB_SPEED_VARIABLE                      /* wireless (usb 2.5) */
+	USB_SPEED_VARIABLE,                     /* wireless (usb 2.5) */
+	USB_SPEED_SUPER                         /* usb 3.0 */
 };
 
 /* FIXME: how to sync with drivers/usbip_common.h ? */
@@ -16,10 +16,13 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <linux/usbdevice_fs.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "usbip_common.h"
@@ -384,6 +387,137 @@ err_write_sockfd:
 	return ret;
 }
 
+/* append a record of the descriptor bundle; 0 if it does not fit */
+static int add_desc_record(uint8_t *buf, size_t size, size_t *len,
+			   uint16_t wValue, uint16_t wIndex,
+			   const uint8_t *desc, size_t desc_len)
+{
+	uint8_t *p = buf + *len;
+
+	if (desc_len > 0xffff || size - *len < 6 + desc_len)
+		return 0;
+
+	p[0] = wValue & 0xff;
+	p[1] = wValue >> 8;
+	p[2] = wIndex & 0xff;
+	p[3] = wIndex >> 8;
+	p[4] = desc_len & 0xff;
+	p[5] = desc_len >> 8;
+	memcpy(p + 6, desc, desc_len);
+	*len += 6 + desc_len;
+
+	return 1;
+}
+
+/* GET_DESCRIPTOR through usbfs; the length read, or -1 */
+static int usbfs_get_descriptor(int fd, uint16_t wValue, uint16_t wIndex,
+				uint8_t *desc, uint16_t wLength)
+{
+	struct usbdevfs_ctrltransfer ctrl;
+
+	memset(&ctrl, 0, sizeof(ctrl));
+	ctrl.bRequestType = 0x80;	/* IN, standard, device */
+	ctrl.bRequest = 0x06;		/* GET_DESCRIPTOR */
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = 1000;
+	ctrl.data = desc;
+
+	return ioctl(fd, USBDEVFS_CONTROL, &ctrl);
+}
+
+/*
+ * Fill @buf with the descriptor bundle of an exported device: the device
+ * and configuration descriptors from its sysfs descriptors file, then what
+ * can be read through usbfs of the BOS and string descriptors. Returns the
+ * length of the bundle, or -1 if even the former cannot be read.
+ */
+ssize_t usbip_host_read_descriptors(struct usbip_exported_device *edev,
+				    uint8_t *buf, size_t size)
+{
+	char path[SYSFS_PATH_MAX];
+	uint8_t raw[USBIP_DESC_BUNDLE_MAX];
+	uint8_t desc[256];
+	uint8_t strings[256];
+	size_t rawlen = 0, len = 0, pos;
+	uint16_t langid = 0;
+	int fd, n, i;
+
+	snprintf(path, sizeof(path), "%s/descriptors", edev->udev.path);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		dbg("open failed: %s", path);
+		return -1;
+	}
+	while (rawlen < sizeof(raw) &&
+	       (n = read(fd, raw + rawlen, sizeof(raw) - rawlen)) > 0)
+		rawlen += n;
+	close(fd);
+
+	/* the device descriptor, then each configuration in full */
+	if (rawlen < 18 ||
+	    !add_desc_record(buf, size, &len, 0x0100, 0, raw, 18))
+		return -1;
+
+	memset(strings, 0, sizeof(strings));
+	strings[raw[14]] = strings[raw[15]] = strings[raw[16]] = 1;
+
+	pos = 18;
+	for (i = 0; i < raw[17] && rawlen - pos >= 9; i++) {
+		size_t total = raw[pos + 2] | (raw[pos + 3] << 8);
+
+		if (total < 9 || total > rawlen - pos)
+			break;
+		if (!add_desc_record(buf, size, &len, 0x0200 | i, 0,
+				     raw + pos, total))
+			break;
+		strings[raw[pos + 6]] = 1;
+		pos += total;
+	}
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u",
+		 edev->udev.busnum, edev->udev.devnum);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		dbg("open failed: %s, bundle without strings", path);
+		return len;
+	}
+
+	/* BOS, from USB 2.01 on */
+	if ((raw[2] | (raw[3] << 8)) >= 0x0201 &&
+	    usbfs_get_descriptor(fd, 0x0f00, 0, desc, 5) == 5) {
+		uint8_t *bos;
+		int total = desc[2] | (desc[3] << 8);
+
+		bos = malloc(total);
+		if (bos && usbfs_get_descriptor(fd, 0x0f00, 0, bos, total) ==
+		    total)
+			add_desc_record(buf, size, &len, 0x0f00, 0, bos, total);
+		free(bos);
+	}
+
+	/* strings in the first language, as the kernel asks for them */
+	n = usbfs_get_descriptor(fd, 0x0300, 0, desc, 255);
+	if (n >= 4 && add_desc_record(buf, size, &len, 0x0300, 0, desc, n)) {
+		langid = desc[2] | (desc[3] << 8);
+
+		for (i = 1; i < 256; i++) {
+			if (!strings[i])
+				continue;
+			n = usbfs_get_descriptor(fd, 0x0300 | i, langid, desc,
+						 255);
+			if (n >= 2)
+				add_desc_record(buf, size, &len, 0x0300 | i,
+						langid, desc, n);
+		}
+	}
+
+	close(fd);
+
+	return len;
+}
+
 struct usbip_exported_device *usbip_host_get_device(int num)
 {
 	struct usbip_exported_device *edev;
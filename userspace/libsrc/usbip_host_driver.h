@@ -20,6 +20,7 @@
 #define __USBIP_HOST_DRIVER_H
 
 #include <stdint.h>
+#include <sys/types.h>
 #include "usbip_common.h"
 
 struct usbip_host_driver {
@@ -44,5 +45,7 @@ void usbip_host_driver_close(void);
 int usbip_host_refresh_device_list(void);
 int usbip_host_export_device(struct usbip_exported_device *edev, int sockfd);
 struct usbip_exported_device *usbip_host_get_device(int num);
+ssize_t usbip_host_read_descriptors(struct usbip_exported_device *edev,
+				    uint8_t *buf, size_t size);
 
 #endif /* __USBIP_HOST_DRIVER_H */
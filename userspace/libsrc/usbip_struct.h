@@ -99,6 +99,17 @@ USBIP_STRUCT_BEGIN(op_import_reply)
 	USBIP_STRUCT_MEMBER_STRUCT(usbip_usb_device,udev);
 USBIP_STRUCT_END
 
+/*
+ * Descriptor bundle: set in the last byte of busid of the request and of the
+ * reply, only for a busid shorter than SYSFS_BUS_ID_SIZE - 1 characters,
+ * whose terminating NUL would be there otherwise. The reply is then followed by a 32-bit length and that many bytes
+ * of records, at most USBIP_DESC_BUNDLE_MAX; see usbip_protocol.txt.
+ */
+#ifndef USBIP_IMPORT_DESC
+#   define USBIP_IMPORT_DESC	0x01
+#   define USBIP_DESC_BUNDLE_MAX	(16 * 1024)
+#endif
+
 /* ---------------------------------------------------------------------- */
 /* Export a USB device to a remote host. */
 #ifndef OP_EXPORT
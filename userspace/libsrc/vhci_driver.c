@@ -2,6 +2,8 @@
  * Copyright (C) 2005-2007 Takahiro Hirofuchi
  */
 
+#include <fcntl.h>
+
 #include "usbip_common.h"
 #include "vhci_driver.h"
 
@@ -51,16 +53,12 @@ err:
 
 
 
-static int parse_status(char *value)
+static int parse_status(char *value, int hc)
 {
 	int ret = 0;
 	char *c;
 
 
-	for (int i = 0; i < vhci_driver->nports; i++)
-		memset(&vhci_driver->idev[i], 0, sizeof(vhci_driver->idev[i]));
-
-
 	/* skip a header line */
 	c = strchr(value, '\n');
 	if (!c)
@@ -71,12 +69,13 @@ static int parse_status(char *value)
 		int port, status, speed, devid;
 		unsigned long socket;
 		char lbusid[SYSFS_BUS_ID_SIZE];
+		char hub[3];
 
-		ret = sscanf(c, "%d %d %d %x %lx %s\n",
-				&port, &status, &speed,
+		ret = sscanf(c, "%2s %d %d %d %x %lx %s\n",
+				hub, &port, &status, &speed,
 				&devid, &socket, lbusid);
 
-		if (ret < 5) {
+		if (ret < 6) {
 			dbg("sscanf failed: %d", ret);
 			BUG();
 		}
@@ -86,10 +85,19 @@ static int parse_status(char *value)
 		dbg("socket %lx lbusid %s", socket, lbusid);
 
 
+		if (port >= vhci_driver->hc_nports[hc]) {
+			dbg("port %d beyond the ports of %s", port,
+			    vhci_driver->hc_device[hc]->name);
+			break;
+		}
+		port += vhci_driver->hc_port_base[hc];
+
 		/* if a device is connected, look at it */
 		{
 			struct usbip_imported_device *idev = &vhci_driver->idev[port];
 
+			idev->hub	= strcmp(hub, "ss") ? HUB_SPEED_HIGH :
+					  HUB_SPEED_SUPER;
 			idev->port	= port;
 			idev->status	= status;
 
@@ -141,8 +149,16 @@ static int check_usbip_device(struct sysfs_class_device *cdev)
 
 	ret = sysfs_get_link(class_path, dev_path, sizeof(dev_path));
 	if (ret == 0) {
-		if (!strncmp(dev_path, vhci_driver->hc_device->path,
-			     strlen(vhci_driver->hc_device->path))) {
+		int i;
+
+		for (i = 0; i < vhci_driver->nhc; i++) {
+			char *hc_path = vhci_driver->hc_device[i]->path;
+
+			if (!strncmp(dev_path, hc_path, strlen(hc_path)))
+				break;
+		}
+
+		if (i < vhci_driver->nhc) {
 			/* found usbip device */
 			usbip_cdev = calloc(1, sizeof(*usbip_cdev));
 			if (!usbip_cdev) {
@@ -242,32 +258,45 @@ static int refresh_class_device_list(void)
 static int refresh_imported_device_list(void)
 {
 	struct sysfs_attribute *attr_status;
+	struct sysfs_device *hc_device;
+	int ret;
 
 
-	attr_status = sysfs_get_device_attr(vhci_driver->hc_device, "status");
-	if (!attr_status) {
-		dbg("sysfs_get_device_attr(\"status\") failed: %s",
-		    vhci_driver->hc_device->name);
-		return -1;
-	}
+	for (int i = 0; i < vhci_driver->nports; i++)
+		memset(&vhci_driver->idev[i], 0, sizeof(vhci_driver->idev[i]));
 
-	dbg("name: %s  path: %s  len: %d  method: %d  value: %s",
-	    attr_status->name, attr_status->path, attr_status->len,
-	    attr_status->method, attr_status->value);
+	for (int i = 0; i < vhci_driver->nhc; i++) {
+		hc_device = vhci_driver->hc_device[i];
+
+		attr_status = sysfs_get_device_attr(hc_device, "status");
+		if (!attr_status) {
+			dbg("sysfs_get_device_attr(\"status\") failed: %s",
+			    hc_device->name);
+			return -1;
+		}
+
+		dbg("name: %s  path: %s  len: %d  method: %d  value: %s",
+		    attr_status->name, attr_status->path, attr_status->len,
+		    attr_status->method, attr_status->value);
+
+		ret = parse_status(attr_status->value, i);
+		if (ret < 0)
+			return ret;
+	}
 
-	return parse_status(attr_status->value);
+	return 0;
 }
 
-static int get_nports(void)
+static int get_nports(struct sysfs_device *hc_device)
 {
 	char *c;
 	int nports = 0;
 	struct sysfs_attribute *attr_status;
 
-	attr_status = sysfs_get_device_attr(vhci_driver->hc_device, "status");
+	attr_status = sysfs_get_device_attr(hc_device, "status");
 	if (!attr_status) {
 		dbg("sysfs_get_device_attr(\"status\") failed: %s",
-		    vhci_driver->hc_device->name);
+		    hc_device->name);
 		return -1;
 	}
 
@@ -293,7 +322,23 @@ static int get_nports(void)
 	return nports;
 }
 
-static int get_hc_busid(char *sysfs_mntpath, char *hc_busid)
+/* vhci_hcd is controller 0, vhci_hcd.N is controller N */
+static int get_hc_index(char *hc_busid)
+{
+	char *c = strchr(hc_busid, '.');
+
+	if (!c)
+		return 0;
+
+	return atoi(c + 1);
+}
+
+/*
+ * Fill hc_busid with the bus ids of all the vhci_hcd controllers, in the
+ * order of their index. Returns the number of controllers found.
+ */
+static int get_hc_busids(char *sysfs_mntpath,
+			 char hc_busid[MAXNHC][SYSFS_BUS_ID_SIZE])
 {
 	struct sysfs_driver *sdriver;
 	char sdriver_path[SYSFS_PATH_MAX];
@@ -301,7 +346,10 @@ static int get_hc_busid(char *sysfs_mntpath, char *hc_busid)
 	struct sysfs_device *hc_dev;
 	struct dlist *hc_devs;
 
-	int found = 0;
+	char found[MAXNHC][SYSFS_BUS_ID_SIZE];
+	int nhc = 0;
+
+	memset(found, 0, sizeof(found));
 
 	snprintf(sdriver_path, SYSFS_PATH_MAX, "%s/%s/%s/%s/%s", sysfs_mntpath,
 	SYSFS_BUS_NAME, USBIP_VHCI_BUS_TYPE, SYSFS_DRIVERS_NAME,
@@ -321,19 +369,45 @@ static int get_hc_busid(char *sysfs_mntpath, char *hc_busid)
 		goto err;
 	}
 
-	/* assume only one vhci_hcd */
 	dlist_for_each_data(hc_devs, hc_dev, struct sysfs_device) {
-		strncpy(hc_busid, hc_dev->bus_id, SYSFS_BUS_ID_SIZE);
-		found = 1;
+		int i = get_hc_index(hc_dev->bus_id);
+
+		if (i < 0 || i >= MAXNHC) {
+			dbg("skip %s", hc_dev->bus_id);
+			continue;
+		}
+		strncpy(found[i], hc_dev->bus_id, SYSFS_BUS_ID_SIZE);
+	}
+
+	for (int i = 0; i < MAXNHC; i++) {
+		if (found[i][0] == '\0')
+			continue;
+		strncpy(hc_busid[nhc++], found[i], SYSFS_BUS_ID_SIZE);
 	}
 
 err:
 	sysfs_close_driver(sdriver);
 
-	if (found)
-		return 0;
+	if (nhc > 0)
+		return nhc;
+
+	dbg("%s not found", USBIP_VHCI_DRV_NAME);
+	return -1;
+}
+
+/* find the controller of a global port number, and its rhport there */
+static int get_hc_of_port(int port, int *rhport)
+{
+	for (int i = 0; i < vhci_driver->nhc; i++) {
+		if (port >= vhci_driver->hc_port_base[i] &&
+		    port < vhci_driver->hc_port_base[i] +
+			   vhci_driver->hc_nports[i]) {
+			*rhport = port - vhci_driver->hc_port_base[i];
+			return i;
+		}
+	}
 
-	dbg("%s not found", hc_busid);
+	dbg("invalid port %d", port);
 	return -1;
 }
 
@@ -343,7 +417,7 @@ err:
 int usbip_vhci_driver_open(void)
 {
 	int ret;
-	char hc_busid[SYSFS_BUS_ID_SIZE];
+	char hc_busid[MAXNHC][SYSFS_BUS_ID_SIZE];
 
 	vhci_driver = (struct usbip_vhci_driver *) calloc(1, sizeof(*vhci_driver));
 	if (!vhci_driver) {
@@ -357,19 +431,35 @@ int usbip_vhci_driver_open(void)
 		goto err;
 	}
 
-	ret = get_hc_busid(vhci_driver->sysfs_mntpath, hc_busid);
+	ret = get_hc_busids(vhci_driver->sysfs_mntpath, hc_busid);
 	if (ret < 0)
 		goto err;
 
-	/* will be freed in usbip_driver_close() */
-	vhci_driver->hc_device = sysfs_open_device(USBIP_VHCI_BUS_TYPE,
-						   hc_busid);
-	if (!vhci_driver->hc_device) {
-		dbg("sysfs_open_device failed");
-		goto err;
-	}
+	for (int i = 0; i < ret; i++) {
+		struct sysfs_device *hc_device;
+		int nports;
+
+		/* will be freed in usbip_driver_close() */
+		hc_device = sysfs_open_device(USBIP_VHCI_BUS_TYPE,
+					      hc_busid[i]);
+		if (!hc_device) {
+			dbg("sysfs_open_device failed: %s", hc_busid[i]);
+			goto err;
+		}
+		vhci_driver->hc_device[vhci_driver->nhc++] = hc_device;
+
+		nports = get_nports(hc_device);
+		if (nports < 0)
+			goto err;
+		if (vhci_driver->nports + nports > MAXNPORT)
+			nports = MAXNPORT - vhci_driver->nports;
 
-	vhci_driver->nports = get_nports();
+		vhci_driver->hc_port_base[i] = vhci_driver->nports;
+		vhci_driver->hc_nports[i] = nports;
+		vhci_driver->nports += nports;
+
+		dbg("%s: ports %d", hc_busid[i], nports);
+	}
 
 	dbg("available ports: %d", vhci_driver->nports);
 
@@ -390,8 +480,8 @@ int usbip_vhci_driver_open(void)
 err:
 	if (vhci_driver->cdev_list)
 		dlist_destroy(vhci_driver->cdev_list);
-	if (vhci_driver->hc_device)
-		sysfs_close_device(vhci_driver->hc_device);
+	for (int i = 0; i < vhci_driver->nhc; i++)
+		sysfs_close_device(vhci_driver->hc_device[i]);
 	if (vhci_driver)
 		free(vhci_driver);
 
@@ -413,8 +503,8 @@ void usbip_vhci_driver_close()
 			dlist_destroy(vhci_driver->idev[i].cdev_list);
 	}
 
-	if (vhci_driver->hc_device)
-		sysfs_close_device(vhci_driver->hc_device);
+	for (int i = 0; i < vhci_driver->nhc; i++)
+		sysfs_close_device(vhci_driver->hc_device[i]);
 	free(vhci_driver);
 
 	vhci_driver = NULL;
@@ -457,31 +547,129 @@ err:
 }
 
 
-int usbip_vhci_get_free_port(void)
+/*
+ * A free port of the controller with the most free ports, on the root hub
+ * matching the device speed.
+ */
+int usbip_vhci_get_free_port(uint32_t speed)
 {
-	for (int i = 0; i < vhci_driver->nports; i++) {
-		if (vhci_driver->idev[i].status == VDEV_ST_NULL)
-			return i;
+	enum hub_speed hub = speed == USB_SPEED_SUPER ? HUB_SPEED_SUPER :
+			     HUB_SPEED_HIGH;
+
+	int port = -1;
+	int most_free = 0;
+
+	for (int i = 0; i < vhci_driver->nhc; i++) {
+		int base = vhci_driver->hc_port_base[i];
+		int first = -1;
+		int nfree = 0;
+
+		for (int p = base; p < base + vhci_driver->hc_nports[i]; p++) {
+			if (vhci_driver->idev[p].hub != hub ||
+			    vhci_driver->idev[p].status != VDEV_ST_NULL)
+				continue;
+			if (first < 0)
+				first = p;
+			nfree++;
+		}
+
+		if (nfree > most_free) {
+			most_free = nfree;
+			port = first;
+		}
 	}
 
-	return -1;
+	return port;
+}
+
+/* must match VHCI_DESC_MAX of vhci_hcd */
+#define VHCI_DESC_SLOT	USBIP_DESC_BUNDLE_MAX
+
+/*
+ * Write a descriptor bundle to the slot of rhport of hc_device. Sysfs takes
+ * at most a page per write; vhci_hcd appends each one to the bundle.
+ */
+static int write_descriptors(struct sysfs_device *hc_device, int rhport,
+		const void *desc, size_t desc_len)
+{
+	char path[SYSFS_PATH_MAX];
+	const char *p = desc;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t done = 0;
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/descriptors", hc_device->path);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0) {
+		dbg("open failed: %s", path);
+		return -1;
+	}
+
+	while (done < desc_len) {
+		size_t n = desc_len - done;
+
+		if (n > page)
+			n = page;
+		ret = pwrite(fd, p + done, n,
+			     (off_t) rhport * VHCI_DESC_SLOT + done);
+		if (ret <= 0) {
+			dbg("pwrite failed: %s", path);
+			close(fd);
+			return -1;
+		}
+		done += ret;
+	}
+	close(fd);
+
+	return 0;
 }
 
-int usbip_vhci_attach_device2(uint8_t port, int sockfd, uint32_t devid,
+int usbip_vhci_attach_device2(int port, int sockfd, uint32_t devid,
 		uint32_t speed) {
+	return usbip_vhci_attach_device_desc(port, sockfd, devid, speed,
+					     NULL, 0);
+}
+
+/*
+ * Attach with the descriptor bundle the server sent along with the import
+ * reply, so vhci_hcd answers the enumeration requests it covers locally.
+ * The port is attached without it if it cannot be preloaded.
+ */
+int usbip_vhci_attach_device_desc(int port, int sockfd, uint32_t devid,
+		uint32_t speed, const void *desc, size_t desc_len)
+{
 	struct sysfs_attribute *attr_attach;
+	struct sysfs_device *hc_device;
 	char buff[200]; /* what size should be ? */
 	int ret;
+	int hc, rhport;
+
+	hc = get_hc_of_port(port, &rhport);
+	if (hc < 0)
+		return -1;
+	hc_device = vhci_driver->hc_device[hc];
 
-	attr_attach = sysfs_get_device_attr(vhci_driver->hc_device, "attach");
+	attr_attach = sysfs_get_device_attr(hc_device, "attach");
 	if (!attr_attach) {
 		dbg("sysfs_get_device_attr(\"attach\") failed: %s",
-		    vhci_driver->hc_device->name);
+		    hc_device->name);
 		return -1;
 	}
 
-	snprintf(buff, sizeof(buff), "%u %u %u %u",
-			port, sockfd, devid, speed);
+	if (desc_len > VHCI_DESC_SLOT ||
+	    (desc_len && write_descriptors(hc_device, rhport, desc,
+					   desc_len) < 0))
+		desc_len = 0;
+
+	/* rx_mode 0 is the default receive engine */
+	if (desc_len)
+		snprintf(buff, sizeof(buff), "%u %u %u %u 0 %zu",
+				rhport, sockfd, devid, speed, desc_len);
+	else
+		snprintf(buff, sizeof(buff), "%u %u %u %u",
+				rhport, sockfd, devid, speed);
 	dbg("writing: %s", buff);
 
 	ret = sysfs_write_attribute(attr_attach, buff, strlen(buff));
@@ -501,7 +689,7 @@ static unsigned long get_devid(uint8_t busnum, uint8_t devnum)
 }
 
 /* will be removed */
-int usbip_vhci_attach_device(uint8_t port, int sockfd, uint8_t busnum,
+int usbip_vhci_attach_device(int port, int sockfd, uint8_t busnum,
 		uint8_t devnum, uint32_t speed)
 {
 	int devid = get_devid(busnum, devnum);
@@ -509,20 +697,27 @@ int usbip_vhci_attach_device(uint8_t port, int sockfd, uint8_t busnum,
 	return usbip_vhci_attach_device2(port, sockfd, devid, speed);
 }
 
-int usbip_vhci_detach_device(uint8_t port)
+int usbip_vhci_detach_device(int port)
 {
 	struct sysfs_attribute  *attr_detach;
+	struct sysfs_device *hc_device;
 	char buff[200]; /* what size should be ? */
 	int ret;
+	int hc, rhport;
+
+	hc = get_hc_of_port(port, &rhport);
+	if (hc < 0)
+		return -1;
+	hc_device = vhci_driver->hc_device[hc];
 
-	attr_detach = sysfs_get_device_attr(vhci_driver->hc_device, "detach");
+	attr_detach = sysfs_get_device_attr(hc_device, "detach");
 	if (!attr_detach) {
 		dbg("sysfs_get_device_attr(\"detach\") failed: %s",
-		    vhci_driver->hc_device->name);
+		    hc_device->name);
 		return -1;
 	}
 
-	snprintf(buff, sizeof(buff), "%u", port);
+	snprintf(buff, sizeof(buff), "%u", rhport);
 	dbg("writing: %s", buff);
 
 	ret = sysfs_write_attribute(attr_detach, buff, strlen(buff));
@@ -11,15 +11,22 @@
 #include "usbip_common.h"
 
 #define USBIP_VHCI_BUS_TYPE "platform"
-#define MAXNPORT 128
+#define MAXNPORT 512
+#define MAXNHC 16
 
 struct usbip_class_device {
 	char class_path[SYSFS_PATH_MAX];
 	char dev_path[SYSFS_PATH_MAX];
 };
 
+enum hub_speed {
+	HUB_SPEED_HIGH = 0,
+	HUB_SPEED_SUPER,
+};
+
 struct usbip_imported_device {
-	uint8_t port;
+	enum hub_speed hub;
+	int port;
 	uint32_t status;
 
 	uint32_t devid;
@@ -35,8 +42,16 @@ struct usbip_imported_device {
 struct usbip_vhci_driver {
 	char sysfs_mntpath[SYSFS_PATH_MAX];
 
-	/* /sys/devices/platform/vhci_hcd */
-	struct sysfs_device *hc_device;
+	/* /sys/devices/platform/vhci_hcd, vhci_hcd.1, ... */
+	int nhc;
+	struct sysfs_device *hc_device[MAXNHC];
+
+	/*
+	 * The ports of all controllers are numbered one after the other:
+	 * the rhport r of hc_device[i] is port hc_port_base[i] + r.
+	 */
+	int hc_port_base[MAXNHC];
+	int hc_nports[MAXNHC];
 
 	/* usbip_class_device list */
 	struct dlist *cdev_list;
@@ -54,14 +69,16 @@ void usbip_vhci_driver_close(void);
 int  usbip_vhci_refresh_device_list(void);
 
 
-int usbip_vhci_get_free_port(void);
-int usbip_vhci_attach_device2(uint8_t port, int sockfd, uint32_t devid,
+int usbip_vhci_get_free_port(uint32_t speed);
+int usbip_vhci_attach_device2(int port, int sockfd, uint32_t devid,
 		uint32_t speed);
+int usbip_vhci_attach_device_desc(int port, int sockfd, uint32_t devid,
+		uint32_t speed, const void *desc, size_t desc_len);
 
 /* will be removed */
-int usbip_vhci_attach_device(uint8_t port, int sockfd, uint8_t busnum,
+int usbip_vhci_attach_device(int port, int sockfd, uint8_t busnum,
 		uint8_t devnum, uint32_t speed);
 
-int usbip_vhci_detach_device(uint8_t port);
+int usbip_vhci_detach_device(int port);
 
 #endif /* __VHCI_DRIVER_H */
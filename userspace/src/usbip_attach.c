@@ -18,10 +18,12 @@
 
 #include <sys/stat.h>
 #include <sysfs/libsysfs.h>
+#include <arpa/inet.h>
 
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <fcntl.h>
@@ -86,7 +88,8 @@ static int record_connection(char *host, char *port, char *busid, int rhport)
 	return 0;
 }
 
-static int import_device(int sockfd, struct usbip_usb_device *udev)
+static int import_device(int sockfd, struct usbip_usb_device *udev,
+			 const void *desc, size_t desc_len)
 {
 	int rc;
 	int port;
@@ -97,15 +100,16 @@ static int import_device(int sockfd, struct usbip_usb_device *udev)
 		return -1;
 	}
 
-	port = usbip_vhci_get_free_port();
+	port = usbip_vhci_get_free_port(udev->speed);
 	if (port < 0) {
 		err("no free port");
 		usbip_vhci_driver_close();
 		return -1;
 	}
 
-	rc = usbip_vhci_attach_device(port, sockfd, udev->busnum,
-				      udev->devnum, udev->speed);
+	rc = usbip_vhci_attach_device_desc(port, sockfd,
+					   (udev->busnum << 16) | udev->devnum,
+					   udev->speed, desc, desc_len);
 	if (rc < 0) {
 		err("import device");
 		usbip_vhci_driver_close();
@@ -123,6 +127,9 @@ static int query_import_device(int sockfd, char *busid)
 	struct op_import_request request;
 	struct op_import_reply   reply;
 	uint16_t code = OP_REP_IMPORT;
+	uint8_t *desc = NULL;
+	uint32_t desc_len = 0;
+	int want_desc;
 
 	memset(&request, 0, sizeof(request));
 	memset(&reply, 0, sizeof(reply));
@@ -135,6 +142,13 @@ static int query_import_device(int sockfd, char *busid)
 	}
 
 	strncpy(request.busid, busid, SYSFS_BUS_ID_SIZE-1);
+	/*
+	 * ask for the descriptor bundle; old servers ignore it, as long as
+	 * the last byte is not the terminating NUL of a full-length busid
+	 */
+	want_desc = strlen(busid) < SYSFS_BUS_ID_SIZE-1;
+	if (want_desc)
+		request.busid[SYSFS_BUS_ID_SIZE-1] = USBIP_IMPORT_DESC;
 
 	PACK_OP_IMPORT_REQUEST(0, &request);
 
@@ -159,14 +173,47 @@ static int query_import_device(int sockfd, char *busid)
 
 	PACK_OP_IMPORT_REPLY(0, &reply);
 
+	/* the descriptor bundle follows if the server sends one */
+	if (want_desc &&
+	    (reply.udev.busid[SYSFS_BUS_ID_SIZE-1] & USBIP_IMPORT_DESC)) {
+		reply.udev.busid[SYSFS_BUS_ID_SIZE-1] = '\0';
+
+		rc = usbip_net_recv(sockfd, &desc_len, sizeof(desc_len));
+		if (rc < 0) {
+			err("recv descriptor bundle length");
+			return -1;
+		}
+		desc_len = ntohl(desc_len);
+		if (desc_len > USBIP_DESC_BUNDLE_MAX) {
+			err("descriptor bundle too large: %u", desc_len);
+			return -1;
+		}
+
+		desc = malloc(desc_len);
+		if (!desc) {
+			err("malloc descriptor bundle");
+			return -1;
+		}
+		rc = usbip_net_recv(sockfd, desc, desc_len);
+		if (rc < 0) {
+			err("recv descriptor bundle");
+			free(desc);
+			return -1;
+		}
+	}
+
 	/* check the reply */
 	if (strncmp(reply.udev.busid, busid, SYSFS_BUS_ID_SIZE)) {
 		err("recv different busid %s", reply.udev.busid);
+		free(desc);
 		return -1;
 	}
 
 	/* import a device */
-	return import_device(sockfd, &reply.udev);
+	rc = import_device(sockfd, &reply.udev, desc, desc_len);
+	free(desc);
+
+	return rc;
 }
 
 static int attach_device(char *host, char *busid)
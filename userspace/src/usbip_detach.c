@@ -46,7 +46,7 @@ void usbip_detach_usage(void)
 static int detach_port(char *port)
 {
 	int ret;
-	uint8_t portnum;
+	int portnum;
 	char path[PATH_MAX+1];
 
 	for (unsigned int i = 0; i < strlen(port); i++)
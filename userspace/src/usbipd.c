@@ -77,6 +77,10 @@ static int recv_request_import(int sockfd)
 	struct op_common reply;
 	struct usbip_exported_device *edev;
 	struct usbip_usb_device pdu_udev;
+	uint8_t *desc = NULL;
+	ssize_t desc_len = -1;
+	uint32_t pdu_len;
+	int want_desc;
 	int found = 0;
 	int error = 0;
 	int rc;
@@ -91,6 +95,12 @@ static int recv_request_import(int sockfd)
 	}
 	PACK_OP_IMPORT_REQUEST(0, &req);
 
+	/* the last byte of busid is never part of it; see usbip_struct.h */
+	want_desc = strnlen(req.busid, SYSFS_BUS_ID_SIZE - 1) <
+		SYSFS_BUS_ID_SIZE - 1 &&
+		(req.busid[SYSFS_BUS_ID_SIZE - 1] & USBIP_IMPORT_DESC);
+	req.busid[SYSFS_BUS_ID_SIZE - 1] = '\0';
+
 	dlist_for_each_data(host_driver->edev_list, edev,
 			    struct usbip_exported_device) {
 		if (!strncmp(req.busid, edev->udev.busid, SYSFS_BUS_ID_SIZE)) {
@@ -104,6 +114,16 @@ static int recv_request_import(int sockfd)
 		/* should set TCP_NODELAY for usbip */
 		usbip_net_set_nodelay(sockfd);
 
+		/* read while nothing else talks to the device */
+		if (want_desc) {
+			desc = malloc(USBIP_DESC_BUNDLE_MAX);
+			if (desc)
+				desc_len = usbip_host_read_descriptors(edev,
+						desc, USBIP_DESC_BUNDLE_MAX);
+			if (desc_len < 0)
+				dbg("no descriptor bundle for %s", req.busid);
+		}
+
 		/* export device needs a TCP/IP socket descriptor */
 		rc = usbip_host_export_device(edev, sockfd);
 		if (rc < 0)
@@ -117,23 +137,42 @@ static int recv_request_import(int sockfd)
 				      (!error ? ST_OK : ST_NA));
 	if (rc < 0) {
 		dbg("usbip_net_send_op_common failed: %#0x", OP_REP_IMPORT);
+		free(desc);
 		return -1;
 	}
 
 	if (error) {
 		dbg("import request busid %s: failed", req.busid);
+		free(desc);
 		return -1;
 	}
 
 	memcpy(&pdu_udev, &edev->udev, sizeof(pdu_udev));
+	if (desc_len >= 0)
+		pdu_udev.busid[SYSFS_BUS_ID_SIZE - 1] |= USBIP_IMPORT_DESC;
 	usbip_net_pack_usb_device(1, &pdu_udev);
 
 	rc = usbip_net_send(sockfd, &pdu_udev, sizeof(pdu_udev));
 	if (rc < 0) {
 		dbg("usbip_net_send failed: devinfo");
+		free(desc);
 		return -1;
 	}
 
+	if (desc_len >= 0) {
+		pdu_len = htonl(desc_len);
+		rc = usbip_net_send(sockfd, &pdu_len, sizeof(pdu_len));
+		if (rc >= 0)
+			rc = usbip_net_send(sockfd, desc, desc_len);
+		if (rc < 0) {
+			dbg("usbip_net_send failed: descriptor bundle");
+			free(desc);
+			return -1;
+		}
+		dbg("sent a descriptor bundle of %zd bytes", desc_len);
+	}
+	free(desc);
+
 	dbg("import request busid %s: complete", req.busid);
 
 	return 0;
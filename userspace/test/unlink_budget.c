@@ -0,0 +1,252 @@
+/* cc -Wall -g -o unlink_budget unlink_budget.c
+ *
+ * usage: unlink_budget <host> <busid> <ep> [urbs [len]]
+ */
+
+/*
+ * Check that usbip-host still answers CMD_UNLINK while the in-flight budget
+ * of a device is used up.
+ *
+ * Imports <busid> from usbipd on <host>, submits <urbs> IN transfers of
+ * <len> bytes to endpoint <ep>, which should be one that does not complete
+ * on its own, e.g. the interrupt endpoint of an idle mouse or keyboard, and
+ * then unlinks the first of them. <urbs> defaults to 1024, the default
+ * usbip_budget_urbs of a device; a smaller usbip_budget_urbs set in sysfs
+ * on the server makes for a quicker run. The test passes if the RET_UNLINK
+ * arrives within 5 seconds: a server that stops reading the connection
+ * while the budget is used up never sends it.
+ *
+ * Exits with 0 on success, 1 on failure and 2 on a usage or setup error.
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define USBIP_PORT		"3240"
+#define USBIP_VERSION		0x0111
+#define OP_REQ_IMPORT		0x8003
+#define OP_REP_IMPORT		0x0003
+
+#define USBIP_CMD_SUBMIT	0x0001
+#define USBIP_CMD_UNLINK	0x0002
+#define USBIP_RET_SUBMIT	0x0003
+#define USBIP_RET_UNLINK	0x0004
+
+#define USBIP_DIR_IN		1
+
+#define TIMEOUT_MS		5000
+
+struct op_common {
+	uint16_t version;
+	uint16_t code;
+	uint32_t status;
+} __attribute__((packed));
+
+struct usb_device_info {
+	char path[256];
+	char busid[32];
+	uint32_t busnum;
+	uint32_t devnum;
+	uint32_t speed;
+	uint16_t idVendor;
+	uint16_t idProduct;
+	uint16_t bcdDevice;
+	uint8_t bDeviceClass;
+	uint8_t bDeviceSubClass;
+	uint8_t bDeviceProtocol;
+	uint8_t bConfigurationValue;
+	uint8_t bNumConfigurations;
+	uint8_t bNumInterfaces;
+} __attribute__((packed));
+
+/* usbip_header, all fields in network byte order */
+struct pdu {
+	uint32_t command;
+	uint32_t seqnum;
+	uint32_t devid;
+	uint32_t direction;
+	uint32_t ep;
+	uint32_t u[7];
+} __attribute__((packed));
+
+static int sockfd;
+
+static int xsend(const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(sockfd, p, len, 0);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* -1 on error, 0 on timeout */
+static int xrecv(void *buf, size_t len, int timeout)
+{
+	struct pollfd pfd = { .fd = sockfd, .events = POLLIN };
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = poll(&pfd, 1, timeout);
+		if (n <= 0)
+			return n;
+		n = recv(sockfd, p, len, 0);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int connect_to(const char *host)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if (getaddrinfo(host, USBIP_PORT, &hints, &res))
+		return -1;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+/* the devid of the imported device, or 0 */
+static uint32_t import(const char *busid)
+{
+	struct op_common op;
+	struct usb_device_info udev;
+	char req[32];
+
+	memset(&op, 0, sizeof(op));
+	op.version = htons(USBIP_VERSION);
+	op.code = htons(OP_REQ_IMPORT);
+	memset(req, 0, sizeof(req));
+	strncpy(req, busid, sizeof(req) - 1);
+
+	if (xsend(&op, sizeof(op)) < 0 || xsend(req, sizeof(req)) < 0)
+		return 0;
+
+	if (xrecv(&op, sizeof(op), TIMEOUT_MS) <= 0 ||
+	    ntohs(op.code) != OP_REP_IMPORT || op.status)
+		return 0;
+	if (xrecv(&udev, sizeof(udev), TIMEOUT_MS) <= 0)
+		return 0;
+
+	return (ntohl(udev.busnum) << 16) | ntohl(udev.devnum);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pdu pdu;
+	uint32_t devid, ep, urbs = 1024, len = 8, seqnum, i;
+	char *buf;
+	int ret;
+
+	if (argc < 4) {
+		fprintf(stderr,
+			"usage: %s <host> <busid> <ep> [urbs [len]]\n",
+			argv[0]);
+		return 2;
+	}
+	ep = strtoul(argv[3], NULL, 0);
+	if (argc > 4)
+		urbs = strtoul(argv[4], NULL, 0);
+	if (argc > 5)
+		len = strtoul(argv[5], NULL, 0);
+
+	buf = malloc(len);
+	if (!buf)
+		return 2;
+
+	sockfd = connect_to(argv[1]);
+	if (sockfd < 0) {
+		perror("connect");
+		return 2;
+	}
+
+	devid = import(argv[2]);
+	if (!devid) {
+		fprintf(stderr, "import of %s failed\n", argv[2]);
+		return 2;
+	}
+
+	/* fill the budget with transfers that stay pending */
+	for (seqnum = 1; seqnum <= urbs; seqnum++) {
+		memset(&pdu, 0, sizeof(pdu));
+		pdu.command = htonl(USBIP_CMD_SUBMIT);
+		pdu.seqnum = htonl(seqnum);
+		pdu.devid = htonl(devid);
+		pdu.direction = htonl(USBIP_DIR_IN);
+		pdu.ep = htonl(ep);
+		pdu.u[1] = htonl(len);		/* transfer_buffer_length */
+		pdu.u[4] = htonl(1);		/* interval */
+		if (xsend(&pdu, sizeof(pdu)) < 0) {
+			perror("send CMD_SUBMIT");
+			return 2;
+		}
+	}
+
+	memset(&pdu, 0, sizeof(pdu));
+	pdu.command = htonl(USBIP_CMD_UNLINK);
+	pdu.seqnum = htonl(seqnum);
+	pdu.devid = htonl(devid);
+	pdu.u[0] = htonl(1);			/* unlink_seqnum */
+	if (xsend(&pdu, sizeof(pdu)) < 0) {
+		perror("send CMD_UNLINK");
+		return 2;
+	}
+
+	/* skip whatever completed meanwhile */
+	for (i = 0; i <= urbs; i++) {
+		ret = xrecv(&pdu, sizeof(pdu), TIMEOUT_MS);
+		if (ret <= 0)
+			break;
+
+		if (ntohl(pdu.command) == USBIP_RET_UNLINK &&
+		    ntohl(pdu.seqnum) == seqnum) {
+			printf("PASS: RET_UNLINK status %d\n",
+			       (int32_t) ntohl(pdu.u[0]));
+			return 0;
+		}
+
+		/* the IN data of a RET_SUBMIT */
+		if (ntohl(pdu.command) == USBIP_RET_SUBMIT &&
+		    ntohl(pdu.u[1]) <= len &&
+		    xrecv(buf, ntohl(pdu.u[1]), TIMEOUT_MS) <= 0)
+			break;
+	}
+
+	printf("FAIL: no RET_UNLINK for seqnum %u\n", seqnum);
+	return 1;
+}
@@ -12,6 +12,9 @@
 #define __USBIP_VHCI_H
 
 #include <linux/device.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/sysfs.h>
@@ -19,6 +22,46 @@
 #include <linux/usb.h>
 #include <linux/usb/hcd.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+
+/* buckets of the seqnum indexes of a vhci_device */
+#define VHCI_SEQNUM_HASH_BITS 6
+#define VHCI_SEQNUM_HASH_SIZE (1 << VHCI_SEQNUM_HASH_BITS)
+
+/* default flush policy of vhci_tx, see the tx_max_* module parameters */
+#define VHCI_TX_MAX_BYTES	(64 * 1024)
+#define VHCI_TX_MAX_URBS	64
+#define VHCI_TX_MAX_DELAY	0
+#define VHCI_TX_BULK_QUANTUM	(64 * 1024)
+
+/* initial size of the kvec array and the header area of tx_batch */
+#define VHCI_TX_IOVMAX		64
+#define VHCI_TX_SCRATCH		(4 * 1024)
+
+/* room for the descriptor bundle of a port, see vhci_desc.c */
+#define VHCI_DESC_MAX		(16 * 1024)
+
+/* tx queues of submitted urbs, highest priority first */
+#define VHCI_TX_Q_CTRL	0
+#define VHCI_TX_Q_INT	1
+#define VHCI_TX_Q_ISOC	2
+#define VHCI_TX_Q_BULK	3
+#define VHCI_TX_QUEUES	4
+
+/* how long the urbs of one transfer type waited for vhci_tx */
+struct vhci_tx_stats {
+	unsigned long urbs;
+	unsigned long long delay_us;
+	unsigned int max_delay_us;
+};
+
+/* what the jitter buffer of a port did, see vhci_iso.c */
+struct vhci_iso_stats {
+	unsigned long urbs;
+	unsigned int max_held;
+	unsigned long underruns;
+	unsigned long overruns;
+};
 
 struct vhci_device {
 	struct usb_device *udev;
@@ -35,30 +78,114 @@ struct vhci_device {
 	/* vhci root-hub port to which this device is attached */
 	__u32 rhport;
 
+	/* controller owning that root hub */
+	struct vhci_hcd *vhci;
+
 	struct usbip_device ud;
 
+	/*
+	 * Serializes enqueue, dequeue and giveback of the urbs of this port,
+	 * so that busy ports do not contend on the controller lock, which is
+	 * left to the root-hub state. Taken before priv_lock.
+	 */
+	spinlock_t port_lock;
+
 	/* lock for the below link lists */
 	spinlock_t priv_lock;
 
-	/* vhci_priv is linked to one of them. */
-	struct list_head priv_tx;
+	/* last seqnum given to a vhci_priv or vhci_unlink, under priv_lock */
+	unsigned long seqnum;
+
+	/*
+	 * vhci_priv is linked to one of them. Until vhci_tx takes it, it waits
+	 * on the priv_tx queue of its transfer type; vhci_tx serves the
+	 * queues in order and lets the bulk endpoints take turns, the last
+	 * one served being tx_bulk_ep (see vhci_tx_ep()).
+	 */
+	struct list_head priv_tx[VHCI_TX_QUEUES];
 	struct list_head priv_rx;
+	int tx_bulk_ep;
+
+	/* by transfer type, also protected by priv_lock */
+	struct vhci_tx_stats tx_stats[VHCI_TX_QUEUES];
 
 	/* vhci_unlink is linked to one of them */
 	struct list_head unlink_tx;
 	struct list_head unlink_rx;
 
+	/*
+	 * Every vhci_priv and vhci_unlink on priv_rx and unlink_rx is also
+	 * indexed by its seqnum, so that a returned pdu finds its request
+	 * without walking the lists. Requests still on priv_tx or unlink_tx
+	 * are not, so that no reply, duplicate or malformed, can take one
+	 * the tx path still owns. Also protected by priv_lock.
+	 */
+	struct hlist_head priv_hash[VHCI_SEQNUM_HASH_SIZE];
+	struct hlist_head unlink_hash[VHCI_SEQNUM_HASH_SIZE];
+
 	/* vhci_tx thread sleeps for this queue */
 	wait_queue_head_t waitq_tx;
+
+	/* pdus gathered by vhci_tx between two flushes, only touched by it */
+	struct usbip_xmit_batch tx_batch;
+
+	/*
+	 * Jitter buffer of the iso urbs, off while iso_latency (usecs) is 0.
+	 * iso_held is sorted by due time, iso_next is the due time of the
+	 * next urb of each endpoint, by direction and number. Protected by
+	 * port_lock.
+	 */
+	unsigned int iso_latency;
+	struct list_head iso_held;
+	unsigned int iso_nheld;
+	ktime_t iso_next[2][16];
+	struct hrtimer iso_timer;
+	struct work_struct iso_work;
+	struct vhci_iso_stats iso_stats;
+
+	/*
+	 * Descriptors preloaded by attach, answering enumeration requests
+	 * locally while desc_valid is set; see vhci_desc.c. Protected by
+	 * port_lock.
+	 */
+	u8 *desc;
+	size_t desc_len;
+	int desc_valid;
+
+	/*
+	 * Credit window of the peer, taken from the devid of its replies
+	 * (see usbip_protocol.txt); ignored until credit_valid is set.
+	 * sent_urbs and sent_bytes are what is on priv_rx. A CMD_SUBMIT that
+	 * does not fit in the window waits on priv_tx with credit_held set,
+	 * until a reply returns credits. Protected by priv_lock.
+	 */
+	int credit_valid;
+	unsigned int credit_urbs;
+	unsigned long credit_bytes;
+	unsigned int sent_urbs;
+	unsigned long sent_bytes;
+	int credit_held;
 };
 
 /* urb->hcpriv, use container_of() */
 struct vhci_priv {
 	unsigned long seqnum;
 	struct list_head list;
+	struct hlist_node hash;
 
 	struct vhci_device *vdev;
 	struct urb *urb;
+
+	/* priv_tx queue, and when the urb was put on it */
+	int tx_queue;
+	ktime_t queued;
+
+	/*
+	 * taken by vhci_tx, so the peer may know the urb; counted in
+	 * sent_urbs and sent_bytes of vdev
+	 */
+	int sent;
+	unsigned int sent_len;
 };
 
 struct vhci_unlink {
@@ -66,49 +193,118 @@ struct vhci_unlink {
 	unsigned long seqnum;
 
 	struct list_head list;
+	struct hlist_node hash;
 
 	/* seqnum of the unlink target */
 	unsigned long unlink_seqnum;
 };
 
-/* Number of supported ports. Value has an upperbound of USB_MAXCHILDREN */
-#define VHCI_NPORTS 8
+/*
+ * Ports of each root hub and number of controllers, set by the nports and
+ * num_controllers module parameters. Every controller has a USB 2.0 and a
+ * SuperSpeed root hub with that many ports each; a SuperSpeed hub has at
+ * most 15 ports.
+ */
+#define VHCI_DEFAULT_NPORTS 8
+#define VHCI_MAX_NPORTS 15
+#define VHCI_MAX_CONTROLLERS 16
+
+extern unsigned int vhci_nports;
+extern unsigned int vhci_num_controllers;
 
 /* for usb_bus.hcpriv */
 struct vhci_hcd {
 	spinlock_t lock;
 
-	u32 port_status[VHCI_NPORTS];
+	/*
+	 * index of this controller, 0 for the platform device vhci_hcd;
+	 * shared by its USB 2.0 and SuperSpeed hcds
+	 */
+	int id;
+
+	u32 port_status[VHCI_MAX_NPORTS];
+
+	/* start of the local frame clock, see vhci_get_frame_number() */
+	ktime_t frame_base;
 
 	unsigned resuming:1;
 	unsigned long re_timeout;
 
-	atomic_t seqnum;
-
 	/*
 	 * NOTE:
 	 * wIndex shows the port number and begins from 1.
 	 * But, the index of this array begins from 0.
+	 * vhci_nports entries, allocated in vhci_hcd_probe().
 	 */
-	struct vhci_device vdev[VHCI_NPORTS];
+	struct vhci_device *vdev;
 };
 
-extern struct vhci_hcd *the_controller;
 extern const struct attribute_group dev_attr_group;
+extern struct bin_attribute dev_attr_descriptors;
 
 /* vhci_hcd.c */
-void rh_port_connect(int rhport, enum usb_device_speed speed);
+void rh_port_connect(struct vhci_device *vdev, enum usb_device_speed speed);
+
+/* vhci_desc.c */
+ssize_t vhci_desc_write(struct vhci_device *vdev, const char *buf,
+			size_t pos, size_t count);
+int vhci_desc_enable(struct vhci_device *vdev, size_t len);
+void vhci_desc_free(struct vhci_device *vdev);
+int vhci_desc_answer(struct vhci_device *vdev, struct urb *urb);
+
+/* vhci_iso.c */
+void vhci_iso_init(struct vhci_device *vdev);
+void vhci_iso_flush(struct vhci_device *vdev);
+int vhci_iso_wq_init(void);
+void vhci_iso_wq_exit(void);
+void vhci_iso_reset(struct vhci_device *vdev);
+int vhci_iso_hold(struct vhci_device *vdev, struct urb *urb);
+int vhci_iso_unhold(struct vhci_device *vdev, struct urb *urb);
+ssize_t vhci_iso_show(struct vhci_device *vdev, char *buf, size_t size);
 
 /* vhci_rx.c */
 struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum);
 int vhci_rx_loop(void *data);
+void vhci_rx_pdu(struct usbip_device *ud);
+int vhci_rx_pdu_size(struct usbip_device *ud, struct usbip_header *pdu);
 
 /* vhci_tx.c */
+void vhci_credit_return(struct vhci_device *vdev, struct vhci_priv *priv);
 int vhci_tx_loop(void *data);
+void vhci_tx_work(struct usbip_device *ud);
+ssize_t vhci_tx_stats_show(struct vhci_device *vdev, char *buf, size_t size);
+
+static inline struct hlist_head *vhci_seqnum_bucket(struct hlist_head *table,
+						   unsigned long seqnum)
+{
+	return &table[hash_32(seqnum, VHCI_SEQNUM_HASH_BITS)];
+}
+
+static inline int vhci_tx_class(struct urb *urb)
+{
+	switch (usb_pipetype(urb->pipe)) {
+	case PIPE_CONTROL:
+		return VHCI_TX_Q_CTRL;
+	case PIPE_INTERRUPT:
+		return VHCI_TX_Q_INT;
+	case PIPE_ISOCHRONOUS:
+		return VHCI_TX_Q_ISOC;
+	default:
+		return VHCI_TX_Q_BULK;
+	}
+}
+
+/* endpoint address of an urb, direction included */
+static inline int vhci_tx_ep(struct urb *urb)
+{
+	return usb_pipeendpoint(urb->pipe) |
+		(usb_pipein(urb->pipe) ? USB_DIR_IN : 0);
+}
 
-static inline struct vhci_device *port_to_vdev(__u32 port)
+static inline struct vhci_device *port_to_vdev(struct vhci_hcd *vhci,
+					       __u32 port)
 {
-	return &the_controller->vdev[port];
+	return &vhci->vdev[port];
 }
 
 static inline struct vhci_hcd *hcd_to_vhci(struct usb_hcd *hcd)
@@ -0,0 +1,267 @@
+/*
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+#include <linux/slab.h>
+#include <linux/usb.h>
+#include <linux/usb/ch9.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+/*
+ * Descriptor cache of a port.
+ *
+ * usbip attach may preload the descriptors the server sent along with
+ * OP_REP_IMPORT (see "Descriptor bundle" in usbip_protocol.txt) through the
+ * descriptors file of the controller, before the port is attached. While
+ * the cache is valid, vhci_urb_enqueue() answers the standard GET_DESCRIPTOR
+ * requests it has a record for, and GET_STATUS of the device, without a
+ * round trip; everything else is sent to the server as before. The first
+ * request that may change what the device reports, i.e. any non-standard
+ * request or a standard SET_CONFIGURATION, SET_INTERFACE, SET_FEATURE,
+ * CLEAR_FEATURE or SET_DESCRIPTOR, drops the cache for good.
+ *
+ * desc, desc_len and desc_valid are protected by port_lock.
+ */
+
+/* a record of the bundle, followed by wLength bytes of descriptor */
+struct vhci_desc_record {
+	__le16 wValue;
+	__le16 wIndex;
+	__le16 wLength;
+} __packed;
+
+/* the bundle is a sequence of whole records */
+static int vhci_desc_check(const u8 *desc, size_t len)
+{
+	const struct vhci_desc_record *rec;
+	size_t pos = 0;
+
+	while (pos < len) {
+		if (len - pos < sizeof(*rec))
+			return -EINVAL;
+		rec = (const struct vhci_desc_record *) (desc + pos);
+		pos += sizeof(*rec);
+
+		if (len - pos < le16_to_cpu(rec->wLength))
+			return -EINVAL;
+		pos += le16_to_cpu(rec->wLength);
+	}
+
+	return 0;
+}
+
+static const struct vhci_desc_record *
+vhci_desc_find(struct vhci_device *vdev, u16 wValue, u16 wIndex)
+{
+	const struct vhci_desc_record *rec;
+	size_t pos = 0;
+
+	/* stop at a record that does not fit, should the cache be torn */
+	while (vdev->desc_len - pos >= sizeof(*rec)) {
+		rec = (const struct vhci_desc_record *) (vdev->desc + pos);
+		pos += sizeof(*rec);
+		if (vdev->desc_len - pos < le16_to_cpu(rec->wLength))
+			break;
+		if (le16_to_cpu(rec->wValue) == wValue &&
+		    le16_to_cpu(rec->wIndex) == wIndex)
+			return rec;
+		pos += le16_to_cpu(rec->wLength);
+	}
+
+	return NULL;
+}
+
+/* caller must hold port_lock */
+static void vhci_desc_drop(struct vhci_device *vdev)
+{
+	kfree(vdev->desc);
+	vdev->desc = NULL;
+	vdev->desc_len = 0;
+	vdev->desc_valid = 0;
+}
+
+/*
+ * Store @count bytes of a bundle at @pos, for a port that is not attached.
+ * A write at 0 starts a new bundle. Any write disables the cache until
+ * vhci_desc_enable() has checked the bundle again.
+ */
+ssize_t vhci_desc_write(struct vhci_device *vdev, const char *buf,
+			size_t pos, size_t count)
+{
+	u8 *desc = NULL;
+
+	if (pos + count > VHCI_DESC_MAX)
+		return -EFBIG;
+
+	if (!pos) {
+		desc = kmalloc(VHCI_DESC_MAX, GFP_KERNEL);
+		if (!desc)
+			return -ENOMEM;
+	}
+
+	spin_lock(&vdev->port_lock);
+	spin_lock(&vdev->ud.lock);
+
+	if (vdev->ud.status != VDEV_ST_NULL ||
+	    (pos && (!vdev->desc || pos != vdev->desc_len))) {
+		spin_unlock(&vdev->ud.lock);
+		spin_unlock(&vdev->port_lock);
+		kfree(desc);
+		return -EBUSY;
+	}
+
+	if (desc) {
+		vhci_desc_drop(vdev);
+		vdev->desc = desc;
+	}
+	memcpy(vdev->desc + pos, buf, count);
+	vdev->desc_len = pos + count;
+	vdev->desc_valid = 0;
+
+	spin_unlock(&vdev->ud.lock);
+	spin_unlock(&vdev->port_lock);
+
+	return count;
+}
+
+/*
+ * Called by attach, before the port is used: make the bundle written last
+ * the cache of the port if it is @len bytes long and well-formed, or drop
+ * it if @len is 0.
+ */
+int vhci_desc_enable(struct vhci_device *vdev, size_t len)
+{
+	int ret = 0;
+
+	spin_lock(&vdev->port_lock);
+	spin_lock(&vdev->ud.lock);
+
+	if (vdev->ud.status != VDEV_ST_NULL)
+		ret = -EBUSY;
+	else if (!len)
+		vhci_desc_drop(vdev);
+	else if (!vdev->desc || len != vdev->desc_len ||
+		 vhci_desc_check(vdev->desc, len) < 0)
+		ret = -EINVAL;
+	else
+		vdev->desc_valid = 1;
+
+	spin_unlock(&vdev->ud.lock);
+	spin_unlock(&vdev->port_lock);
+
+	return ret;
+}
+
+/* after the connection has gone */
+void vhci_desc_free(struct vhci_device *vdev)
+{
+	spin_lock(&vdev->port_lock);
+	vhci_desc_drop(vdev);
+	spin_unlock(&vdev->port_lock);
+}
+
+/* whether a standard request may change what the device reports */
+static int vhci_desc_stale(struct usb_ctrlrequest *ctrlreq)
+{
+	if ((ctrlreq->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD)
+		return 1;
+
+	switch (ctrlreq->bRequest) {
+	case USB_REQ_SET_CONFIGURATION:
+	case USB_REQ_SET_INTERFACE:
+	case USB_REQ_SET_FEATURE:
+	case USB_REQ_CLEAR_FEATURE:
+	case USB_REQ_SET_DESCRIPTOR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Answer a control urb to the default endpoint from the cache. Returns 1 if
+ * it has been completed, so the caller gives it back without sending it.
+ * Caller must hold port_lock.
+ */
+int vhci_desc_answer(struct vhci_device *vdev, struct urb *urb)
+{
+	struct usb_ctrlrequest *ctrlreq =
+		(struct usb_ctrlrequest *) urb->setup_packet;
+	const struct vhci_desc_record *rec;
+	u16 wValue, wIndex, wLength;
+	const void *data;
+	__le16 status;
+	size_t len;
+
+	if (!vdev->desc_valid || usb_pipetype(urb->pipe) != PIPE_CONTROL ||
+	    usb_pipeendpoint(urb->pipe) != 0 || !ctrlreq)
+		return 0;
+
+	if (vhci_desc_stale(ctrlreq)) {
+		usbip_dbg_vhci_hc("drop descriptor cache of port %u\n",
+				  vdev->rhport);
+		vhci_desc_drop(vdev);
+		return 0;
+	}
+
+	if (ctrlreq->bRequestType != (USB_DIR_IN | USB_RECIP_DEVICE) ||
+	    !urb->transfer_buffer)
+		return 0;
+
+	wValue = le16_to_cpu(ctrlreq->wValue);
+	wIndex = le16_to_cpu(ctrlreq->wIndex);
+	wLength = le16_to_cpu(ctrlreq->wLength);
+
+	switch (ctrlreq->bRequest) {
+	case USB_REQ_GET_DESCRIPTOR:
+		rec = vhci_desc_find(vdev, wValue, wIndex);
+		if (!rec)
+			return 0;
+		data = rec + 1;
+		len = le16_to_cpu(rec->wLength);
+		break;
+
+	case USB_REQ_GET_STATUS:
+		/* not configured yet, so as the first configuration says */
+		rec = vhci_desc_find(vdev, USB_DT_CONFIG << 8, 0);
+		if (!rec || le16_to_cpu(rec->wLength) < USB_DT_CONFIG_SIZE)
+			return 0;
+		status = cpu_to_le16(((const struct usb_config_descriptor *)
+				      (rec + 1))->bmAttributes &
+				     USB_CONFIG_ATT_SELFPOWER ?
+				     1 << USB_DEVICE_SELF_POWERED : 0);
+		data = &status;
+		len = sizeof(status);
+		break;
+
+	default:
+		return 0;
+	}
+
+	len = min_t(size_t, len, min_t(size_t, wLength,
+				       urb->transfer_buffer_length));
+	memcpy(urb->transfer_buffer, data, len);
+	urb->actual_length = len;
+	if (urb->status == -EINPROGRESS)
+		urb->status = 0;
+
+	usbip_dbg_vhci_hc("answered request %02x %04x %04x locally, %zu bytes\n",
+			  ctrlreq->bRequest, wValue, wIndex, len);
+
+	return 1;
+}
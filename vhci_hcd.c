@@ -21,6 +21,7 @@
 #include <linux/file.h>
 #include <linux/kernel.h>
 #include <linux/kthread.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/platform_device.h>
 #include <linux/slab.h>
@@ -49,6 +50,7 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb,
 			    gfp_t mem_flags);
 static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status);
+static int vhci_setup(struct usb_hcd *hcd);
 static int vhci_start(struct usb_hcd *vhci_hcd);
 static void vhci_stop(struct usb_hcd *hcd);
 static int vhci_get_frame_number(struct usb_hcd *hcd);
@@ -56,7 +58,16 @@ static int vhci_get_frame_number(struct usb_hcd *hcd);
 static const char driver_name[] = "vhci_hcd";
 static const char driver_desc[] = "USB/IP Virtual Host Controller";
 
-struct vhci_hcd *the_controller;
+/* read once at load time; both size the controllers created in init */
+unsigned int vhci_nports = VHCI_DEFAULT_NPORTS;
+module_param_named(nports, vhci_nports, uint, S_IRUGO);
+MODULE_PARM_DESC(nports, "ports of each root hub (1-"
+		 __stringify(VHCI_MAX_NPORTS) ")");
+
+unsigned int vhci_num_controllers = 1;
+module_param_named(num_controllers, vhci_num_controllers, uint, S_IRUGO);
+MODULE_PARM_DESC(num_controllers, "vhci_hcd instances to create (1-"
+		 __stringify(VHCI_MAX_CONTROLLERS) ")");
 
 static const char * const bit_desc[] = {
 	"CONNECTION",		/*0*/
@@ -119,43 +130,49 @@ static void dump_port_status_diff(u32 prev_status, u32 new_status)
 	pr_debug("\n");
 }
 
-void rh_port_connect(int rhport, enum usb_device_speed speed)
+void rh_port_connect(struct vhci_device *vdev, enum usb_device_speed speed)
 {
-	usbip_dbg_vhci_rh("rh_port_connect %d\n", rhport);
+	struct vhci_hcd *vhci = vdev->vhci;
+	int rhport = vdev->rhport;
+
+	usbip_dbg_vhci_rh("rh_port_connect %d-%d\n", vhci->id, rhport);
 
-	spin_lock(&the_controller->lock);
+	spin_lock(&vhci->lock);
 
-	the_controller->port_status[rhport] |= USB_PORT_STAT_CONNECTION
+	vhci->port_status[rhport] |= USB_PORT_STAT_CONNECTION
 		| (1 << USB_PORT_FEAT_C_CONNECTION);
 
 	switch (speed) {
 	case USB_SPEED_HIGH:
-		the_controller->port_status[rhport] |= USB_PORT_STAT_HIGH_SPEED;
+		vhci->port_status[rhport] |= USB_PORT_STAT_HIGH_SPEED;
 		break;
 	case USB_SPEED_LOW:
-		the_controller->port_status[rhport] |= USB_PORT_STAT_LOW_SPEED;
+		vhci->port_status[rhport] |= USB_PORT_STAT_LOW_SPEED;
 		break;
 	default:
 		break;
 	}
 
-	spin_unlock(&the_controller->lock);
+	spin_unlock(&vhci->lock);
 
-	usb_hcd_poll_rh_status(vhci_to_hcd(the_controller));
+	usb_hcd_poll_rh_status(vhci_to_hcd(vhci));
 }
 
-static void rh_port_disconnect(int rhport)
+static void rh_port_disconnect(struct vhci_device *vdev)
 {
-	usbip_dbg_vhci_rh("rh_port_disconnect %d\n", rhport);
+	struct vhci_hcd *vhci = vdev->vhci;
+	int rhport = vdev->rhport;
 
-	spin_lock(&the_controller->lock);
+	usbip_dbg_vhci_rh("rh_port_disconnect %d-%d\n", vhci->id, rhport);
 
-	the_controller->port_status[rhport] &= ~USB_PORT_STAT_CONNECTION;
-	the_controller->port_status[rhport] |=
+	spin_lock(&vhci->lock);
+
+	vhci->port_status[rhport] &= ~USB_PORT_STAT_CONNECTION;
+	vhci->port_status[rhport] |=
 					(1 << USB_PORT_FEAT_C_CONNECTION);
 
-	spin_unlock(&the_controller->lock);
-	usb_hcd_poll_rh_status(vhci_to_hcd(the_controller));
+	spin_unlock(&vhci->lock);
+	usb_hcd_poll_rh_status(vhci_to_hcd(vhci));
 }
 
 #define PORT_C_MASK				\
@@ -183,7 +200,7 @@ static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
 	int		rhport;
 	int		changed = 0;
 
-	retval = DIV_ROUND_UP(VHCI_NPORTS + 1, 8);
+	retval = DIV_ROUND_UP(vhci_nports + 1, 8);
 	memset(buf, 0, retval);
 
 	vhci = hcd_to_vhci(hcd);
@@ -195,7 +212,7 @@ static int vhci_hub_status(struct usb_hcd *hcd, char *buf)
 	}
 
 	/* check pseudo status register for each port */
-	for (rhport = 0; rhport < VHCI_NPORTS; rhport++) {
+	for (rhport = 0; rhport < vhci_nports; rhport++) {
 		if ((vhci->port_status[rhport] & PORT_C_MASK)) {
 			/* The status of a port has been changed, */
 			usbip_dbg_vhci_rh("port %d status changed\n", rhport);
@@ -217,16 +234,50 @@ done:
 
 static inline void hub_descriptor(struct usb_hub_descriptor *desc)
 {
+	/* bytes of the DeviceRemovable and PortPwrCtrlMask bitmaps each */
+	int width = vhci_nports / 8 + 1;
+
 	memset(desc, 0, sizeof(*desc));
 	desc->bDescriptorType = 0x29;
-	desc->bDescLength = 9;
+	desc->bDescLength = 7 + 2 * width;
+	desc->wHubCharacteristics = (__force __u16)
+		(__constant_cpu_to_le16(0x0001));
+	desc->bNbrPorts = vhci_nports;
+	memset(&desc->u.hs.DeviceRemovable[0], 0xff, 2 * width);
+}
+
+static inline void ss_hub_descriptor(struct usb_hub_descriptor *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->bDescriptorType = 0x2a;
+	desc->bDescLength = 12;
 	desc->wHubCharacteristics = (__force __u16)
 		(__constant_cpu_to_le16(0x0001));
-	desc->bNbrPorts = VHCI_NPORTS;
-	desc->u.hs.DeviceRemovable[0] = 0xff;
-	desc->u.hs.DeviceRemovable[1] = 0xff;
+	desc->bNbrPorts = vhci_nports;
+	desc->u.ss.bHubHdrDecLat = 0x04; /* worst case: 0.4 micro sec */
+	desc->u.ss.DeviceRemovable = (__force __le16) 0xffff;
 }
 
+/* BOS of the SuperSpeed root hub, with only the SuperSpeed capability */
+static const struct {
+	struct usb_bos_descriptor bos;
+	struct usb_ss_cap_descriptor ss_cap;
+} __packed usb3_bos_desc = {
+	.bos = {
+		.bLength		= USB_DT_BOS_SIZE,
+		.bDescriptorType	= USB_DT_BOS,
+		.wTotalLength		= cpu_to_le16(sizeof(usb3_bos_desc)),
+		.bNumDeviceCaps		= 1,
+	},
+	.ss_cap = {
+		.bLength		= USB_DT_USB_SS_CAP_SIZE,
+		.bDescriptorType	= USB_DT_DEVICE_CAPABILITY,
+		.bDevCapabilityType	= USB_SS_CAP_TYPE,
+		.wSpeedSupported	= cpu_to_le16(USB_5GBPS_OPERATION),
+		.bFunctionalitySupport	= ilog2(USB_5GBPS_OPERATION),
+	},
+};
+
 static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 			    u16 wIndex, char *buf, u16 wLength)
 {
@@ -234,7 +285,7 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 	int             retval = 0;
 	int		rhport;
 
-	u32 prev_port_status[VHCI_NPORTS];
+	u32 prev_port_status[VHCI_MAX_NPORTS];
 
 	if (!HCD_HW_ACCESSIBLE(hcd))
 		return -ETIMEDOUT;
@@ -245,7 +296,7 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 	 */
 	usbip_dbg_vhci_rh("typeReq %x wValue %x wIndex %x\n", typeReq, wValue,
 			  wIndex);
-	if (wIndex > VHCI_NPORTS)
+	if (wIndex > vhci_nports)
 		pr_err("invalid port number %d\n", wIndex);
 	rhport = ((__u8)(wIndex & 0x00ff)) - 1;
 
@@ -282,6 +333,9 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		case USB_PORT_FEAT_C_RESET:
 			usbip_dbg_vhci_rh(" ClearPortFeature: "
 					  "USB_PORT_FEAT_C_RESET\n");
+			/* a SuperSpeed port has no speed bits */
+			if (hcd->speed == HCD_USB3)
+				goto clear_default;
 			switch (dum->vdev[rhport].speed) {
 			case USB_SPEED_HIGH:
 				dum->port_status[rhport] |=
@@ -295,6 +349,7 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 				break;
 			}
 		default:
+clear_default:
 			usbip_dbg_vhci_rh(" ClearPortFeature: default %x\n",
 					  wValue);
 			dum->port_status[rhport] &= ~(1 << wValue);
@@ -303,7 +358,31 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		break;
 	case GetHubDescriptor:
 		usbip_dbg_vhci_rh(" GetHubDescriptor\n");
-		hub_descriptor((struct usb_hub_descriptor *) buf);
+		if (hcd->speed == HCD_USB3)
+			ss_hub_descriptor((struct usb_hub_descriptor *) buf);
+		else
+			hub_descriptor((struct usb_hub_descriptor *) buf);
+		break;
+	case DeviceRequest | USB_REQ_GET_DESCRIPTOR:
+		usbip_dbg_vhci_rh(" GetDescriptor %x\n", wValue);
+		/* only the BOS of the SuperSpeed hub comes here */
+		if (hcd->speed != HCD_USB3 || (wValue >> 8) != USB_DT_BOS ||
+		    wLength < USB_DT_BOS_SIZE) {
+			retval = -EPIPE;
+			break;
+		}
+		retval = min_t(u16, wLength, sizeof(usb3_bos_desc));
+		memcpy(buf, &usb3_bos_desc, retval);
+		break;
+	case SetHubDepth:
+	case GetPortErrorCount:
+		usbip_dbg_vhci_rh(" SetHubDepth/GetPortErrorCount\n");
+		if (hcd->speed != HCD_USB3) {
+			retval = -EPIPE;
+			break;
+		}
+		if (typeReq == GetPortErrorCount)
+			*(__le32 *) buf = __constant_cpu_to_le32(0);
 		break;
 	case GetHubStatus:
 		usbip_dbg_vhci_rh(" GetHubStatus\n");
@@ -311,7 +390,7 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 		break;
 	case GetPortStatus:
 		usbip_dbg_vhci_rh(" GetPortStatus port %x\n", wIndex);
-		if (wIndex > VHCI_NPORTS || wIndex < 1) {
+		if (wIndex > vhci_nports || wIndex < 1) {
 			pr_err("invalid port number %d\n", wIndex);
 			retval = -EPIPE;
 		}
@@ -364,9 +443,39 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 			usbip_dbg_vhci_rh(" SetPortFeature: "
 					  "USB_PORT_FEAT_SUSPEND\n");
 			break;
+		case USB_PORT_FEAT_POWER:
+			usbip_dbg_vhci_rh(" SetPortFeature: "
+					  "USB_PORT_FEAT_POWER\n");
+			/* the power bit moved in the SuperSpeed port status */
+			if (hcd->speed == HCD_USB3)
+				dum->port_status[rhport] |=
+					USB_SS_PORT_STAT_POWER;
+			else
+				dum->port_status[rhport] |=
+					USB_PORT_STAT_POWER;
+			break;
+		case USB_PORT_FEAT_LINK_STATE:
+		case USB_PORT_FEAT_U1_TIMEOUT:
+		case USB_PORT_FEAT_U2_TIMEOUT:
+			usbip_dbg_vhci_rh(" SetPortFeature: link %d\n",
+					  wValue);
+			/* there is no link to manage */
+			if (hcd->speed != HCD_USB3)
+				retval = -EPIPE;
+			break;
+		case USB_PORT_FEAT_BH_PORT_RESET:
+			usbip_dbg_vhci_rh(" SetPortFeature: "
+					  "USB_PORT_FEAT_BH_PORT_RESET\n");
+			if (hcd->speed != HCD_USB3) {
+				retval = -EPIPE;
+				break;
+			}
+			/* FALLTHROUGH */
 		case USB_PORT_FEAT_RESET:
 			usbip_dbg_vhci_rh(" SetPortFeature: "
 					  "USB_PORT_FEAT_RESET\n");
+			/* a warm reset is reported as a plain one */
+			wValue = USB_PORT_FEAT_RESET;
 			/* if it's already running, disconnect first */
 			if (dum->port_status[rhport] & USB_PORT_STAT_ENABLE) {
 				dum->port_status[rhport] &=
@@ -409,30 +518,10 @@ static int vhci_hub_control(struct usb_hcd *hcd, u16 typeReq, u16 wValue,
 	return retval;
 }
 
-static struct vhci_device *get_vdev(struct usb_device *udev)
+static void vhci_tx_urb(struct vhci_device *vdev, struct urb *urb)
 {
-	int i;
-
-	if (!udev)
-		return NULL;
-
-	for (i = 0; i < VHCI_NPORTS; i++)
-		if (the_controller->vdev[i].udev == udev)
-			return port_to_vdev(i);
-
-	return NULL;
-}
-
-static void vhci_tx_urb(struct urb *urb)
-{
-	struct vhci_device *vdev = get_vdev(urb->dev);
 	struct vhci_priv *priv;
 
-	if (!vdev) {
-		pr_err("could not get virtual device");
-		return;
-	}
-
 	priv = kzalloc(sizeof(struct vhci_priv), GFP_ATOMIC);
 	if (!priv) {
 		usbip_event_add(&vdev->ud, VDEV_EVENT_ERROR_MALLOC);
@@ -441,7 +530,7 @@ static void vhci_tx_urb(struct urb *urb)
 
 	spin_lock(&vdev->priv_lock);
 
-	priv->seqnum = atomic_inc_return(&the_controller->seqnum);
+	priv->seqnum = ++vdev->seqnum;
 	if (priv->seqnum == 0xffff)
 		dev_info(&urb->dev->dev, "seqnum max\n");
 
@@ -450,9 +539,11 @@ static void vhci_tx_urb(struct urb *urb)
 
 	urb->hcpriv = (void *) priv;
 
-	list_add_tail(&priv->list, &vdev->priv_tx);
+	priv->tx_queue = vhci_tx_class(urb);
+	priv->queued = ktime_get();
+	list_add_tail(&priv->list, &vdev->priv_tx[priv->tx_queue]);
 
-	wake_up(&vdev->waitq_tx);
+	usbip_wake_tx(&vdev->ud, &vdev->waitq_tx);
 	spin_unlock(&vdev->priv_lock);
 }
 
@@ -467,25 +558,26 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb,
 			  hcd, urb, mem_flags);
 
 	/* patch to usb_sg_init() is in 2.5.60 */
-	BUG_ON(!urb->transfer_buffer && urb->transfer_buffer_length);
+	BUG_ON(!urb->transfer_buffer && !urb->num_sgs &&
+	       urb->transfer_buffer_length);
 
-	spin_lock(&the_controller->lock);
+	vdev = port_to_vdev(hcd_to_vhci(hcd), urb->dev->portnum-1);
+
+	spin_lock(&vdev->port_lock);
 
 	if (urb->status != -EINPROGRESS) {
 		dev_err(dev, "URB already unlinked!, status %d\n", urb->status);
-		spin_unlock(&the_controller->lock);
+		spin_unlock(&vdev->port_lock);
 		return urb->status;
 	}
 
-	vdev = port_to_vdev(urb->dev->portnum-1);
-
 	/* refuse enqueue for dead connection */
 	spin_lock(&vdev->ud.lock);
 	if (vdev->ud.status == VDEV_ST_NULL ||
 	    vdev->ud.status == VDEV_ST_ERROR) {
 		dev_err(dev, "enqueue for inactive port %d\n", vdev->rhport);
 		spin_unlock(&vdev->ud.lock);
-		spin_unlock(&the_controller->lock);
+		spin_unlock(&vdev->port_lock);
 		return -ENODEV;
 	}
 	spin_unlock(&vdev->ud.lock);
@@ -559,16 +651,20 @@ static int vhci_urb_enqueue(struct usb_hcd *hcd, struct urb *urb,
 	}
 
 out:
-	vhci_tx_urb(urb);
-	spin_unlock(&the_controller->lock);
+	/* enumeration requests the preloaded descriptors can answer */
+	if (vhci_desc_answer(vdev, urb))
+		goto no_need_xmit;
+
+	vhci_tx_urb(vdev, urb);
+	spin_unlock(&vdev->port_lock);
 
 	return 0;
 
 no_need_xmit:
 	usb_hcd_unlink_urb_from_ep(hcd, urb);
 no_need_unlink:
-	spin_unlock(&the_controller->lock);
-	usb_hcd_giveback_urb(vhci_to_hcd(the_controller), urb, urb->status);
+	spin_unlock(&vdev->port_lock);
+	usb_hcd_giveback_urb(hcd, urb, urb->status);
 	return ret;
 }
 
@@ -623,15 +719,25 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 	struct vhci_priv *priv;
 	struct vhci_device *vdev;
 
-	pr_info("dequeue a urb %p\n", urb);
+	usbip_dbg_vhci_hc("dequeue a urb %p\n", urb);
 
-	spin_lock(&the_controller->lock);
+	vdev = port_to_vdev(hcd_to_vhci(hcd), urb->dev->portnum-1);
+
+	spin_lock(&vdev->port_lock);
 
 	priv = urb->hcpriv;
 	if (!priv) {
 		/* URB was never linked! or will be soon given back by
-		 * vhci_rx. */
-		spin_unlock(&the_controller->lock);
+		 * vhci_rx, unless it waits in the jitter buffer. */
+		if (usb_pipeisoc(urb->pipe) &&
+		    !usb_hcd_check_unlink_urb(hcd, urb, status) &&
+		    vhci_iso_unhold(vdev, urb)) {
+			usb_hcd_unlink_urb_from_ep(hcd, urb);
+			spin_unlock(&vdev->port_lock);
+			usb_hcd_giveback_urb(hcd, urb, status);
+			return 0;
+		}
+		spin_unlock(&vdev->port_lock);
 		return 0;
 	}
 
@@ -639,20 +745,20 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 		int ret = 0;
 		ret = usb_hcd_check_unlink_urb(hcd, urb, status);
 		if (ret) {
-			spin_unlock(&the_controller->lock);
+			spin_unlock(&vdev->port_lock);
 			return ret;
 		}
 	}
 
-	 /* send unlink request here? */
-	vdev = priv->vdev;
-
 	if (!vdev->ud.tcp_socket) {
 		/* tcp connection is closed */
 		spin_lock(&vdev->priv_lock);
 
 		pr_info("device %p seems to be disconnected\n", vdev);
+		vhci_credit_return(vdev, priv);
 		list_del(&priv->list);
+		/* not hashed if still on priv_tx */
+		hlist_del_init(&priv->hash);
 		kfree(priv);
 		urb->hcpriv = NULL;
 
@@ -667,10 +773,9 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 
 		usb_hcd_unlink_urb_from_ep(hcd, urb);
 
-		spin_unlock(&the_controller->lock);
-		usb_hcd_giveback_urb(vhci_to_hcd(the_controller), urb,
-				     urb->status);
-		spin_lock(&the_controller->lock);
+		spin_unlock(&vdev->port_lock);
+		usb_hcd_giveback_urb(hcd, urb, urb->status);
+		spin_lock(&vdev->port_lock);
 
 	} else {
 		/* tcp connection is alive */
@@ -678,32 +783,55 @@ static int vhci_urb_dequeue(struct usb_hcd *hcd, struct urb *urb, int status)
 
 		spin_lock(&vdev->priv_lock);
 
+		/*
+		 * vhci_tx has not taken the urb yet, so the peer has never
+		 * seen it: give it back right here, without a round trip.
+		 */
+		if (!priv->sent) {
+			usbip_dbg_vhci_hc("unlink urb %p locally\n", urb);
+
+			list_del(&priv->list);
+			kfree(priv);
+			urb->hcpriv = NULL;
+
+			spin_unlock(&vdev->priv_lock);
+
+			usb_hcd_unlink_urb_from_ep(hcd, urb);
+
+			spin_unlock(&vdev->port_lock);
+			usb_hcd_giveback_urb(hcd, urb, status);
+
+			usbip_dbg_vhci_hc("leave\n");
+			return 0;
+		}
+
 		/* setup CMD_UNLINK pdu */
 		unlink = kzalloc(sizeof(struct vhci_unlink), GFP_ATOMIC);
 		if (!unlink) {
 			spin_unlock(&vdev->priv_lock);
-			spin_unlock(&the_controller->lock);
+			spin_unlock(&vdev->port_lock);
 			usbip_event_add(&vdev->ud, VDEV_EVENT_ERROR_MALLOC);
 			return -ENOMEM;
 		}
 
-		unlink->seqnum = atomic_inc_return(&the_controller->seqnum);
+		unlink->seqnum = ++vdev->seqnum;
 		if (unlink->seqnum == 0xffff)
 			pr_info("seqnum max\n");
 
 		unlink->unlink_seqnum = priv->seqnum;
 
-		pr_info("device %p seems to be still connected\n", vdev);
+		usbip_dbg_vhci_hc("device %p seems to be still connected\n",
+				  vdev);
 
 		/* send cmd_unlink and try to cancel the pending URB in the
 		 * peer */
 		list_add_tail(&unlink->list, &vdev->unlink_tx);
-		wake_up(&vdev->waitq_tx);
+		usbip_wake_tx(&vdev->ud, &vdev->waitq_tx);
 
 		spin_unlock(&vdev->priv_lock);
 	}
 
-	spin_unlock(&the_controller->lock);
+	spin_unlock(&vdev->port_lock);
 
 	usbip_dbg_vhci_hc("leave\n");
 	return 0;
@@ -713,7 +841,7 @@ static void vhci_device_unlink_cleanup(struct vhci_device *vdev)
 {
 	struct vhci_unlink *unlink, *tmp;
 
-	spin_lock(&the_controller->lock);
+	spin_lock(&vdev->port_lock);
 	spin_lock(&vdev->priv_lock);
 
 	list_for_each_entry_safe(unlink, tmp, &vdev->unlink_tx, list) {
@@ -736,30 +864,32 @@ static void vhci_device_unlink_cleanup(struct vhci_device *vdev)
 			pr_info("the urb (seqnum %lu) was already given back\n",
 				unlink->unlink_seqnum);
 			list_del(&unlink->list);
+			hlist_del(&unlink->hash);
 			kfree(unlink);
 			continue;
 		}
 
 		urb->status = -ENODEV;
 
-		usb_hcd_unlink_urb_from_ep(vhci_to_hcd(the_controller), urb);
+		usb_hcd_unlink_urb_from_ep(vhci_to_hcd(vdev->vhci), urb);
 
 		list_del(&unlink->list);
+		hlist_del(&unlink->hash);
 
 		spin_unlock(&vdev->priv_lock);
-		spin_unlock(&the_controller->lock);
+		spin_unlock(&vdev->port_lock);
 
-		usb_hcd_giveback_urb(vhci_to_hcd(the_controller), urb,
+		usb_hcd_giveback_urb(vhci_to_hcd(vdev->vhci), urb,
 				     urb->status);
 
-		spin_lock(&the_controller->lock);
+		spin_lock(&vdev->port_lock);
 		spin_lock(&vdev->priv_lock);
 
 		kfree(unlink);
 	}
 
 	spin_unlock(&vdev->priv_lock);
-	spin_unlock(&the_controller->lock);
+	spin_unlock(&vdev->port_lock);
 }
 
 /*
@@ -778,6 +908,8 @@ static void vhci_shutdown_connection(struct usbip_device *ud)
 	}
 
 	/* kill threads related to this sdev */
+	if (vdev->ud.use_wq)
+		usbip_wq_stop(&vdev->ud);
 	if (vdev->ud.tcp_rx) {
 		kthread_stop_put(vdev->ud.tcp_rx);
 		vdev->ud.tcp_rx = NULL;
@@ -790,12 +922,16 @@ static void vhci_shutdown_connection(struct usbip_device *ud)
 
 	/* active connection is closed */
 	if (vdev->ud.tcp_socket) {
+		/* the urbs below are given back before the peer answered */
+		usbip_xmit_abort(vdev->ud.tcp_socket, &vdev->tx_batch);
+		usbip_rx_stop(&vdev->ud);
 		fput(vdev->ud.tcp_socket->file);
 		vdev->ud.tcp_socket = NULL;
 	}
 	pr_info("release socket\n");
 
 	vhci_device_unlink_cleanup(vdev);
+	vhci_iso_flush(vdev);
 
 	/*
 	 * rh_port_disconnect() is a trigger of ...
@@ -817,7 +953,7 @@ static void vhci_shutdown_connection(struct usbip_device *ud)
 	 * is actually given back by vhci_rx after receiving its return pdu.
 	 *
 	 */
-	rh_port_disconnect(vdev->rhport);
+	rh_port_disconnect(vdev);
 
 	pr_info("disconnect device\n");
 }
@@ -827,16 +963,29 @@ static void vhci_device_reset(struct usbip_device *ud)
 {
 	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
 
+	/* port_lock is taken before ud->lock */
+	vhci_iso_reset(vdev);
+	vhci_desc_free(vdev);
+
 	spin_lock(&ud->lock);
 
 	vdev->speed  = 0;
 	vdev->devid  = 0;
 
+	/* the next peer announces its own window, if any */
+	spin_lock(&vdev->priv_lock);
+	vdev->credit_valid = 0;
+	vdev->credit_held = 0;
+	vdev->tx_bulk_ep = -1;
+	memset(vdev->tx_stats, 0, sizeof(vdev->tx_stats));
+	spin_unlock(&vdev->priv_lock);
+
 	if (vdev->udev)
 		usb_put_dev(vdev->udev);
 	vdev->udev = NULL;
 
 	if (ud->tcp_socket) {
+		usbip_rx_stop(ud);
 		fput(ud->tcp_socket->file);
 		ud->tcp_socket = NULL;
 	}
@@ -854,6 +1003,8 @@ static void vhci_device_unusable(struct usbip_device *ud)
 
 static void vhci_device_init(struct vhci_device *vdev)
 {
+	int i;
+
 	memset(vdev, 0, sizeof(*vdev));
 
 	vdev->ud.side   = USBIP_VHCI;
@@ -861,22 +1012,70 @@ static void vhci_device_init(struct vhci_device *vdev)
     INIT_LIST_HEAD(&vdev->ud.filters);
     spin_lock_init(&vdev->ud.filter_lock);
 	spin_lock_init(&vdev->ud.lock);
+	spin_lock_init(&vdev->ud.wq_lock);
 
 	INIT_LIST_HEAD(&vdev->priv_rx);
-	INIT_LIST_HEAD(&vdev->priv_tx);
+	for (i = 0; i < VHCI_TX_QUEUES; i++)
+		INIT_LIST_HEAD(&vdev->priv_tx[i]);
+	vdev->tx_bulk_ep = -1;
 	INIT_LIST_HEAD(&vdev->unlink_tx);
 	INIT_LIST_HEAD(&vdev->unlink_rx);
+	for (i = 0; i < VHCI_SEQNUM_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&vdev->priv_hash[i]);
+		INIT_HLIST_HEAD(&vdev->unlink_hash[i]);
+	}
 	spin_lock_init(&vdev->priv_lock);
+	spin_lock_init(&vdev->port_lock);
 
 	init_waitqueue_head(&vdev->waitq_tx);
+	vhci_iso_init(vdev);
 
 	vdev->ud.eh_ops.shutdown = vhci_shutdown_connection;
 	vdev->ud.eh_ops.reset = vhci_device_reset;
 	vdev->ud.eh_ops.unusable = vhci_device_unusable;
 
+	vdev->ud.wq_ops.rx_pdu = vhci_rx_pdu;
+	vdev->ud.wq_ops.pdu_size = vhci_rx_pdu_size;
+	vdev->ud.wq_ops.tx = vhci_tx_work;
+
 	usbip_start_eh(&vdev->ud);
 }
 
+/*
+ * Each controller is a pair of hcds sharing one platform device: the
+ * primary one has a USB 2.0 root hub, the shared one a SuperSpeed root hub.
+ * Each has its own ports, see vhci_port_hcd() in vhci_sysfs.c.
+ */
+static int vhci_setup(struct usb_hcd *hcd)
+{
+	if (usb_hcd_is_primary_hcd(hcd)) {
+		hcd->speed = HCD_USB2;
+		hcd->self.root_hub->speed = USB_SPEED_HIGH;
+	} else {
+		hcd->speed = HCD_USB3;
+		hcd->self.root_hub->speed = USB_SPEED_SUPER;
+	}
+
+	return 0;
+}
+
+/* shutdown the first @nports ports, whose event handlers are running */
+static void vhci_stop_ports(struct vhci_hcd *vhci, int nports)
+{
+	int rhport;
+
+	for (rhport = 0 ; rhport < nports; rhport++) {
+		struct vhci_device *vdev = &vhci->vdev[rhport];
+
+		usbip_event_add(&vdev->ud, VDEV_EVENT_REMOVED);
+		usbip_stop_eh(&vdev->ud);
+		/* no timer or work of the port may outlive it */
+		vhci_iso_flush(vdev);
+		usbip_xmit_batch_free(&vdev->tx_batch);
+		vhci_desc_free(vdev);
+	}
+}
+
 static int vhci_start(struct usb_hcd *hcd)
 {
 	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
@@ -887,50 +1086,89 @@ static int vhci_start(struct usb_hcd *hcd)
 
 	/* initialize private data of usb_hcd */
 
-	for (rhport = 0; rhport < VHCI_NPORTS; rhport++) {
+	for (rhport = 0; rhport < vhci_nports; rhport++) {
 		struct vhci_device *vdev = &vhci->vdev[rhport];
 		vhci_device_init(vdev);
 		vdev->rhport = rhport;
+		vdev->vhci = vhci;
+
+		err = usbip_xmit_batch_init(&vdev->tx_batch, &vdev->ud,
+					    VHCI_TX_IOVMAX, VHCI_TX_SCRATCH);
+		if (err) {
+			vhci_stop_ports(vhci, rhport + 1);
+			return err;
+		}
 	}
 
-	atomic_set(&vhci->seqnum, 0);
 	spin_lock_init(&vhci->lock);
+	vhci->frame_base = ktime_get();
 
 	hcd->power_budget = 0; /* no limit */
 	hcd->uses_new_polling = 1;
 
-	/* vhci_hcd is now ready to be controlled through sysfs */
-	err = sysfs_create_group(&vhci_dev(vhci)->kobj, &dev_attr_group);
-	if (err) {
-		pr_err("create sysfs files\n");
-		return err;
-	}
-
-	return 0;
+	return err;
 }
 
 static void vhci_stop(struct usb_hcd *hcd)
 {
 	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
-	int rhport = 0;
 
 	usbip_dbg_vhci_hc("stop VHCI controller\n");
 
-	/* 1. remove the userland interface of vhci_hcd */
-	sysfs_remove_group(&vhci_dev(vhci)->kobj, &dev_attr_group);
+	/* shutdown all the ports of vhci_hcd */
+	vhci_stop_ports(vhci, vhci_nports);
+}
 
-	/* 2. shutdown all the ports of vhci_hcd */
-	for (rhport = 0 ; rhport < VHCI_NPORTS; rhport++) {
-		struct vhci_device *vdev = &vhci->vdev[rhport];
+/*
+ * The frames of the peer cannot be followed over the network. Count local
+ * 1 ms frames instead, on the clock the jitter buffer gives back iso urbs
+ * on, wrapping like the 11-bit frame number of a SOF.
+ */
+static int vhci_get_frame_number(struct usb_hcd *hcd)
+{
+	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
 
-		usbip_event_add(&vdev->ud, VDEV_EVENT_REMOVED);
-		usbip_stop_eh(&vdev->ud);
+	return ktime_to_ms(ktime_sub(ktime_get(), vhci->frame_base)) & 0x7ff;
+}
+
+/*
+ * Bulk streams are set up lazily by usbip-host, when the first urb with a
+ * stream id reaches an endpoint; the id travels in the start_frame field of
+ * CMD_SUBMIT. All that can be checked here is what the endpoints announce.
+ */
+static int vhci_alloc_streams(struct usb_hcd *hcd, struct usb_device *udev,
+			      struct usb_host_endpoint **eps,
+			      unsigned int num_eps, unsigned int num_streams,
+			      gfp_t mem_flags)
+{
+	unsigned int i;
+
+	if (hcd->speed != HCD_USB3 || !num_eps)
+		return -EINVAL;
+
+	for (i = 0; i < num_eps; i++) {
+		unsigned int max = usbip_ep_max_streams(eps[i]);
+
+		if (!max) {
+			dev_dbg(&udev->dev, "ep %02x has no streams\n",
+				eps[i]->desc.bEndpointAddress);
+			return -EINVAL;
+		}
+		num_streams = min(num_streams, max);
 	}
+
+	usbip_dbg_vhci_hc("%u streams on %u eps\n", num_streams, num_eps);
+	return num_streams;
 }
 
-static int vhci_get_frame_number(struct usb_hcd *hcd)
+/* usbip-host releases the streams along with the endpoints */
+static int vhci_free_streams(struct usb_hcd *hcd, struct usb_device *udev,
+			     struct usb_host_endpoint **eps,
+			     unsigned int num_eps, gfp_t mem_flags)
 {
-	pr_err("Not yet implemented\n");
+	if (hcd->speed != HCD_USB3)
+		return -EINVAL;
+
 	return 0;
 }
 
@@ -978,8 +1216,9 @@ static struct hc_driver vhci_hc_driver = {
 	.product_desc	= driver_desc,
 	.hcd_priv_size	= sizeof(struct vhci_hcd),
 
-	.flags		= HCD_USB2,
+	.flags		= HCD_USB3 | HCD_SHARED,
 
+	.reset		= vhci_setup,
 	.start		= vhci_start,
 	.stop		= vhci_stop,
 
@@ -988,15 +1227,70 @@ static struct hc_driver vhci_hc_driver = {
 
 	.get_frame_number = vhci_get_frame_number,
 
+	.alloc_streams	= vhci_alloc_streams,
+	.free_streams	= vhci_free_streams,
+
 	.hub_status_data = vhci_hub_status,
 	.hub_control    = vhci_hub_control,
 	.bus_suspend	= vhci_bus_suspend,
 	.bus_resume	= vhci_bus_resume,
 };
 
+/* give an hcd its ports, and register it */
+static int vhci_add_hcd(struct platform_device *pdev, struct usb_hcd *hcd)
+{
+	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
+	int ret;
+
+	/* this is private data for vhci_hcd */
+	vhci->id = pdev->id < 0 ? 0 : pdev->id;
+
+	vhci->vdev = kcalloc(vhci_nports, sizeof(*vhci->vdev), GFP_KERNEL);
+	if (!vhci->vdev)
+		return -ENOMEM;
+
+	/*
+	 * Scatter-gather urbs are sent from and received into their pages
+	 * directly, so usbcore needs neither to linearize nor to split them,
+	 * and the length of each element does not matter.
+	 */
+	hcd->self.sg_tablesize = ~0;
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,14,0))
+	hcd->self.no_sg_constraint = 1;
+#endif
+
+	/*
+	 * Finish generic HCD structure initialization and register.
+	 * Call the driver's reset() and start() routines.
+	 */
+	ret = usb_add_hcd(hcd, 0, 0);
+	if (ret != 0) {
+		pr_err("usb_add_hcd failed %d\n", ret);
+		kfree(vhci->vdev);
+		vhci->vdev = NULL;
+	}
+
+	return ret;
+}
+
+static void vhci_remove_hcd(struct usb_hcd *hcd)
+{
+	struct vhci_hcd *vhci = hcd_to_vhci(hcd);
+
+	/*
+	 * Disconnects the root hub,
+	 * then reverses the effects of usb_add_hcd(),
+	 * invoking the HCD's stop() methods.
+	 */
+	usb_remove_hcd(hcd);
+	kfree(vhci->vdev);
+	usb_put_hcd(hcd);
+}
+
 static int vhci_hcd_probe(struct platform_device *pdev)
 {
 	struct usb_hcd		*hcd;
+	struct usb_hcd		*ss_hcd;
 	int			ret;
 
 	usbip_dbg_vhci_hc("name %s id %d\n", pdev->name, pdev->id);
@@ -1018,23 +1312,53 @@ static int vhci_hcd_probe(struct platform_device *pdev)
 	}
 	hcd->has_tt = 1;
 
-	/* this is private data for vhci_hcd */
-	the_controller = hcd_to_vhci(hcd);
+	ret = vhci_add_hcd(pdev, hcd);
+	if (ret)
+		goto err_put_hcd;
+
+	/* the SuperSpeed root hub */
+	ss_hcd = usb_create_shared_hcd(&vhci_hc_driver, &pdev->dev,
+				       dev_name(&pdev->dev), hcd);
+	if (!ss_hcd) {
+		pr_err("create shared hcd failed\n");
+		ret = -ENOMEM;
+		goto err_remove_hcd;
+	}
 
-	/*
-	 * Finish generic HCD structure initialization and register.
-	 * Call the driver's reset() and start() routines.
-	 */
-	ret = usb_add_hcd(hcd, 0, 0);
-	if (ret != 0) {
-		pr_err("usb_add_hcd failed %d\n", ret);
-		usb_put_hcd(hcd);
-		the_controller = NULL;
-		return ret;
+	ret = vhci_add_hcd(pdev, ss_hcd);
+	if (ret) {
+		usb_put_hcd(ss_hcd);
+		goto err_remove_hcd;
+	}
+
+	/* vhci_hcd is now ready to be controlled through sysfs */
+	ret = sysfs_create_group(&pdev->dev.kobj, &dev_attr_group);
+	if (ret) {
+		pr_err("create sysfs files\n");
+		vhci_remove_hcd(ss_hcd);
+		goto err_remove_hcd;
+	}
+
+	/* one slot of VHCI_DESC_MAX bytes for every port */
+	dev_attr_descriptors.size = 2 * vhci_nports * VHCI_DESC_MAX;
+	ret = sysfs_create_bin_file(&pdev->dev.kobj, &dev_attr_descriptors);
+	if (ret) {
+		pr_err("create sysfs files\n");
+		sysfs_remove_group(&pdev->dev.kobj, &dev_attr_group);
+		vhci_remove_hcd(ss_hcd);
+		goto err_remove_hcd;
 	}
 
 	usbip_dbg_vhci_hc("bye\n");
 	return 0;
+
+err_remove_hcd:
+	vhci_remove_hcd(hcd);
+	return ret;
+
+err_put_hcd:
+	usb_put_hcd(hcd);
+	return ret;
 }
 
 static int vhci_hcd_remove(struct platform_device *pdev)
@@ -1045,14 +1369,13 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 	if (!hcd)
 		return 0;
 
-	/*
-	 * Disconnects the root hub,
-	 * then reverses the effects of usb_add_hcd(),
-	 * invoking the HCD's stop() methods.
-	 */
-	usb_remove_hcd(hcd);
-	usb_put_hcd(hcd);
-	the_controller = NULL;
+	/* remove the userland interface of vhci_hcd first */
+	sysfs_remove_bin_file(&pdev->dev.kobj, &dev_attr_descriptors);
+	sysfs_remove_group(&pdev->dev.kobj, &dev_attr_group);
+
+	if (hcd->shared_hcd)
+		vhci_remove_hcd(hcd->shared_hcd);
+	vhci_remove_hcd(hcd);
 
 	return 0;
 }
@@ -1062,21 +1385,31 @@ static int vhci_hcd_remove(struct platform_device *pdev)
 /* what should happen for USB/IP under suspend/resume? */
 static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 {
-	struct usb_hcd *hcd;
+	struct usb_hcd *hcd, *hcds[2];
+	struct vhci_hcd *vhci;
 	int rhport = 0;
 	int connected = 0;
+	int i;
 	int ret = 0;
 
 	hcd = platform_get_drvdata(pdev);
 
-	spin_lock(&the_controller->lock);
+	/* both root hubs, USB 2.0 and SuperSpeed */
+	hcds[0] = hcd;
+	hcds[1] = hcd->shared_hcd;
+
+	for (i = 0; i < 2 && hcds[i]; i++) {
+		vhci = hcd_to_vhci(hcds[i]);
 
-	for (rhport = 0; rhport < VHCI_NPORTS; rhport++)
-		if (the_controller->port_status[rhport] &
-		    USB_PORT_STAT_CONNECTION)
-			connected += 1;
+		spin_lock(&vhci->lock);
 
-	spin_unlock(&the_controller->lock);
+		for (rhport = 0; rhport < vhci_nports; rhport++)
+			if (vhci->port_status[rhport] &
+			    USB_PORT_STAT_CONNECTION)
+				connected += 1;
+
+		spin_unlock(&vhci->lock);
+	}
 
 	if (connected > 0) {
 		dev_info(&pdev->dev, "We have %d active connection%s. Do not "
@@ -1084,7 +1417,8 @@ static int vhci_hcd_suspend(struct platform_device *pdev, pm_message_t state)
 		ret =  -EBUSY;
 	} else {
 		dev_info(&pdev->dev, "suspend vhci_hcd");
-		clear_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
+		for (i = 0; i < 2 && hcds[i]; i++)
+			clear_bit(HCD_FLAG_HW_ACCESSIBLE, &hcds[i]->flags);
 	}
 
 	return ret;
@@ -1099,6 +1433,10 @@ static int vhci_hcd_resume(struct platform_device *pdev)
 	hcd = platform_get_drvdata(pdev);
 	set_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->flags);
 	usb_hcd_poll_rh_status(hcd);
+	if (hcd->shared_hcd) {
+		set_bit(HCD_FLAG_HW_ACCESSIBLE, &hcd->shared_hcd->flags);
+		usb_hcd_poll_rh_status(hcd->shared_hcd);
+	}
 
 	return 0;
 }
@@ -1124,50 +1462,80 @@ static struct platform_driver vhci_driver = {
 /*
  * The VHCI 'device' is 'virtual'; not a real plug&play hardware.
  * We need to add this virtual device as a platform device arbitrarily:
- *	1. platform_device_register()
+ *	1. platform_device_register_simple()
+ *
+ * The first controller keeps the id -1, so that it is still named vhci_hcd;
+ * the others are vhci_hcd.1, vhci_hcd.2, ...
  */
-static void the_pdev_release(struct device *dev)
+static struct platform_device *vhci_pdevs[VHCI_MAX_CONTROLLERS];
+
+static void vhci_del_pdevs(void)
 {
-	return;
-}
+	int i;
 
-static struct platform_device the_pdev = {
-	/* should be the same name as driver_name */
-	.name = (char *) driver_name,
-	.id = -1,
-	.dev = {
-		.release = the_pdev_release,
-	},
-};
+	for (i = vhci_num_controllers - 1; i >= 0; i--) {
+		if (vhci_pdevs[i])
+			platform_device_unregister(vhci_pdevs[i]);
+		vhci_pdevs[i] = NULL;
+	}
+}
 
 static int __init vhci_hcd_init(void)
 {
 	int ret;
+	int i;
 
 	if (usb_disabled())
 		return -ENODEV;
 
+	if (vhci_nports < 1 || vhci_nports > VHCI_MAX_NPORTS) {
+		pr_err("nports %u out of range\n", vhci_nports);
+		return -EINVAL;
+	}
+	if (vhci_num_controllers < 1 ||
+	    vhci_num_controllers > VHCI_MAX_CONTROLLERS) {
+		pr_err("num_controllers %u out of range\n",
+		       vhci_num_controllers);
+		return -EINVAL;
+	}
+
+	ret = vhci_iso_wq_init();
+	if (ret < 0)
+		return ret;
+
 	ret = platform_driver_register(&vhci_driver);
 	if (ret < 0)
 		goto err_driver_register;
 
-	ret = platform_device_register(&the_pdev);
-	if (ret < 0)
-		goto err_platform_device_register;
+	for (i = 0; i < vhci_num_controllers; i++) {
+		/* should be the same name as driver_name */
+		vhci_pdevs[i] = platform_device_register_simple(driver_name,
+								i ? i : -1,
+								NULL, 0);
+		if (IS_ERR(vhci_pdevs[i])) {
+			ret = PTR_ERR(vhci_pdevs[i]);
+			vhci_pdevs[i] = NULL;
+			goto err_platform_device_register;
+		}
+	}
 
-	pr_info(DRIVER_DESC " v" USBIP_VERSION "\n");
-	return ret;
+	pr_info(DRIVER_DESC " v" USBIP_VERSION " (%u x %u ports)\n",
+		vhci_num_controllers, vhci_nports);
+	return 0;
 
 err_platform_device_register:
+	vhci_del_pdevs();
 	platform_driver_unregister(&vhci_driver);
 err_driver_register:
+	vhci_iso_wq_exit();
 	return ret;
 }
 
 static void __exit vhci_hcd_exit(void)
 {
-	platform_device_unregister(&the_pdev);
+	vhci_del_pdevs();
 	platform_driver_unregister(&vhci_driver);
+	vhci_iso_wq_exit();
 }
 
 module_init(vhci_hcd_init);
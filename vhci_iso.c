@@ -0,0 +1,309 @@
+/*
+ * This is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307,
+ * USA.
+ */
+
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+
+#include "usbip_common.h"
+#include "vhci.h"
+
+/*
+ * Jitter buffer of the iso urbs of a port.
+ *
+ * Without it, an iso urb is given back as soon as its RET_SUBMIT arrives,
+ * so completions follow the timing of the network. With it, a completed
+ * iso urb is held back and given back on a local clock instead: the first
+ * urb of a stream is due iso_latency usecs after it arrived, and every
+ * following urb of the endpoint is due when the previous one has been
+ * played out, i.e. number_of_packets intervals later.
+ *
+ * A urb arriving after it was due means the buffer ran dry (underrun); the
+ * stream then starts over. A urb due more than twice iso_latency ahead
+ * means the peer delivers faster than it is played out (overrun); the urbs
+ * held for the endpoint are given back at once and the stream starts over.
+ *
+ * Urbs in flight to the peer are those the class driver keeps submitted;
+ * the buffer only delays their giveback, so a driver needs enough of them
+ * queued to cover the latency. The held urbs are sorted by due time and
+ * protected by port_lock. iso_timer fires at the head, and iso_work gives
+ * back what is due, since port_lock is not taken from irq context.
+ */
+
+/* default latency of the ports, used from the next attach on */
+static unsigned int iso_latency;
+module_param(iso_latency, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(iso_latency, "usecs iso urbs are held back to absorb "
+		 "network jitter (0: give back on arrival)");
+
+/* runs iso_work of every port; flushed before the module goes away */
+static struct workqueue_struct *vhci_iso_wq;
+
+/* a stream idle for longer is started over without counting an underrun */
+#define VHCI_ISO_IDLE_US	(100 * 1000)
+
+/* an iso urb held back by the jitter buffer until due */
+struct vhci_iso_urb {
+	struct list_head list;
+	struct urb *urb;
+	ktime_t due;
+};
+
+static ktime_t *vhci_iso_next(struct vhci_device *vdev, struct urb *urb)
+{
+	return &vdev->iso_next[usb_pipein(urb->pipe) ? 1 : 0]
+		[usb_pipeendpoint(urb->pipe)];
+}
+
+/* how long the packets of an urb take to play out */
+static unsigned int vhci_iso_duration(struct vhci_device *vdev,
+				      struct urb *urb)
+{
+	/* the interval is in microframes from high speed on */
+	unsigned int unit = vdev->speed >= USB_SPEED_HIGH ? 125 : 1000;
+
+	return urb->number_of_packets * max(urb->interval, 1) * unit;
+}
+
+/* fire at the first held urb; caller must hold port_lock */
+static void vhci_iso_arm(struct vhci_device *vdev)
+{
+	struct vhci_iso_urb *iu;
+
+	if (list_empty(&vdev->iso_held))
+		return;
+
+	iu = list_first_entry(&vdev->iso_held, struct vhci_iso_urb, list);
+	hrtimer_start(&vdev->iso_timer, iu->due, HRTIMER_MODE_ABS);
+}
+
+/*
+ * Move the held urbs of the endpoint of @urb, or all of them if @urb is
+ * NULL, to @out and unlink them from their endpoints. Caller must hold
+ * port_lock.
+ */
+static void vhci_iso_take(struct vhci_device *vdev, struct urb *urb,
+			  struct list_head *out)
+{
+	struct usb_hcd *hcd = vhci_to_hcd(vdev->vhci);
+	struct vhci_iso_urb *iu, *tmp;
+
+	list_for_each_entry_safe(iu, tmp, &vdev->iso_held, list) {
+		if (urb && iu->urb->ep != urb->ep)
+			continue;
+
+		list_move_tail(&iu->list, out);
+		vdev->iso_nheld--;
+		usb_hcd_unlink_urb_from_ep(hcd, iu->urb);
+	}
+}
+
+static void vhci_iso_giveback(struct vhci_device *vdev, struct list_head *list)
+{
+	struct usb_hcd *hcd = vhci_to_hcd(vdev->vhci);
+	struct vhci_iso_urb *iu, *tmp;
+
+	list_for_each_entry_safe(iu, tmp, list, list) {
+		usb_hcd_giveback_urb(hcd, iu->urb, iu->urb->status);
+		kfree(iu);
+	}
+}
+
+/*
+ * Called by vhci_rx for a completed urb, before giving it back. Returns 1 if
+ * the urb was taken by the jitter buffer, which gives it back later.
+ */
+int vhci_iso_hold(struct vhci_device *vdev, struct urb *urb)
+{
+	unsigned int latency = ACCESS_ONCE(vdev->iso_latency);
+	struct vhci_iso_urb *iu, *pos;
+	LIST_HEAD(overrun);
+	ktime_t now, *next;
+
+	if (!latency || !usb_pipeisoc(urb->pipe))
+		return 0;
+
+	iu = kmalloc(sizeof(*iu), GFP_ATOMIC);
+	if (!iu)
+		return 0;
+	iu->urb = urb;
+
+	spin_lock(&vdev->port_lock);
+
+	now = ktime_get();
+	next = vhci_iso_next(vdev, urb);
+
+	if (!ktime_to_ns(*next) ||
+	    ktime_us_delta(now, *next) > VHCI_ISO_IDLE_US) {
+		/* a new stream: buffer it up */
+		iu->due = ktime_add_us(now, latency);
+	} else if (ktime_us_delta(now, *next) > 0) {
+		vdev->iso_stats.underruns++;
+		iu->due = ktime_add_us(now, latency);
+	} else if (ktime_us_delta(*next, now) > 2 * (s64) latency) {
+		vdev->iso_stats.overruns++;
+		vhci_iso_take(vdev, urb, &overrun);
+		iu->due = ktime_add_us(now, latency);
+	} else {
+		iu->due = *next;
+	}
+	*next = ktime_add_us(iu->due, vhci_iso_duration(vdev, urb));
+
+	/* mostly the last one */
+	list_for_each_entry_reverse(pos, &vdev->iso_held, list)
+		if (ktime_to_ns(pos->due) <= ktime_to_ns(iu->due))
+			break;
+	list_add(&iu->list, &pos->list);
+
+	vdev->iso_stats.urbs++;
+	if (++vdev->iso_nheld > vdev->iso_stats.max_held)
+		vdev->iso_stats.max_held = vdev->iso_nheld;
+
+	if (vdev->iso_held.next == &iu->list)
+		vhci_iso_arm(vdev);
+
+	spin_unlock(&vdev->port_lock);
+
+	vhci_iso_giveback(vdev, &overrun);
+
+	return 1;
+}
+
+/*
+ * Take @urb out of the jitter buffer, for vhci_urb_dequeue(). Returns 1 if
+ * it was held. Caller must hold port_lock and gives the urb back.
+ */
+int vhci_iso_unhold(struct vhci_device *vdev, struct urb *urb)
+{
+	struct vhci_iso_urb *iu;
+
+	list_for_each_entry(iu, &vdev->iso_held, list) {
+		if (iu->urb == urb) {
+			list_del(&iu->list);
+			vdev->iso_nheld--;
+			kfree(iu);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static enum hrtimer_restart vhci_iso_timer(struct hrtimer *timer)
+{
+	struct vhci_device *vdev = container_of(timer, struct vhci_device,
+						iso_timer);
+
+	queue_work(vhci_iso_wq, &vdev->iso_work);
+
+	return HRTIMER_NORESTART;
+}
+
+static void vhci_iso_work(struct work_struct *work)
+{
+	struct vhci_device *vdev = container_of(work, struct vhci_device,
+						iso_work);
+	struct usb_hcd *hcd = vhci_to_hcd(vdev->vhci);
+	struct vhci_iso_urb *iu, *tmp;
+	LIST_HEAD(due);
+	ktime_t now = ktime_get();
+
+	spin_lock(&vdev->port_lock);
+
+	list_for_each_entry_safe(iu, tmp, &vdev->iso_held, list) {
+		if (ktime_to_ns(iu->due) > ktime_to_ns(now))
+			break;
+
+		list_move_tail(&iu->list, &due);
+		vdev->iso_nheld--;
+		usb_hcd_unlink_urb_from_ep(hcd, iu->urb);
+	}
+	vhci_iso_arm(vdev);
+
+	spin_unlock(&vdev->port_lock);
+
+	vhci_iso_giveback(vdev, &due);
+}
+
+void vhci_iso_init(struct vhci_device *vdev)
+{
+	INIT_LIST_HEAD(&vdev->iso_held);
+	hrtimer_init(&vdev->iso_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	vdev->iso_timer.function = vhci_iso_timer;
+	INIT_WORK(&vdev->iso_work, vhci_iso_work);
+	vdev->iso_latency = ACCESS_ONCE(iso_latency);
+}
+
+/*
+ * Give back every held urb at once, after vhci_rx has been stopped. The
+ * list is emptied first, so a running iso_work finds nothing to re-arm the
+ * timer for; the timer is cancelled once more after it for good measure.
+ */
+void vhci_iso_flush(struct vhci_device *vdev)
+{
+	LIST_HEAD(held);
+
+	spin_lock(&vdev->port_lock);
+	vhci_iso_take(vdev, NULL, &held);
+	spin_unlock(&vdev->port_lock);
+
+	hrtimer_cancel(&vdev->iso_timer);
+	cancel_work_sync(&vdev->iso_work);
+	hrtimer_cancel(&vdev->iso_timer);
+
+	vhci_iso_giveback(vdev, &held);
+}
+
+/* for the next connection, after vhci_iso_flush() */
+void vhci_iso_reset(struct vhci_device *vdev)
+{
+	spin_lock(&vdev->port_lock);
+	vdev->iso_latency = ACCESS_ONCE(iso_latency);
+	memset(vdev->iso_next, 0, sizeof(vdev->iso_next));
+	memset(&vdev->iso_stats, 0, sizeof(vdev->iso_stats));
+	spin_unlock(&vdev->port_lock);
+}
+
+int vhci_iso_wq_init(void)
+{
+	vhci_iso_wq = alloc_workqueue("vhci_iso", WQ_HIGHPRI, 0);
+	if (!vhci_iso_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+void vhci_iso_wq_exit(void)
+{
+	destroy_workqueue(vhci_iso_wq);
+}
+
+ssize_t vhci_iso_show(struct vhci_device *vdev, char *buf, size_t size)
+{
+	ssize_t len;
+
+	spin_lock(&vdev->port_lock);
+	len = scnprintf(buf, size, "%u %lu %u %u %lu %lu",
+			vdev->iso_latency, vdev->iso_stats.urbs,
+			vdev->iso_nheld, vdev->iso_stats.max_held,
+			vdev->iso_stats.underruns, vdev->iso_stats.overruns);
+	spin_unlock(&vdev->port_lock);
+
+	return len;
+}
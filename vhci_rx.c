@@ -23,50 +23,86 @@
 #include "usbip_common.h"
 #include "vhci.h"
 
+/* caller must hold vdev->priv_lock */
+static struct vhci_priv *vhci_lookup_priv(struct vhci_device *vdev,
+					  __u32 seqnum)
+{
+	struct hlist_node *pos;
+	struct vhci_priv *priv;
+
+	hlist_for_each(pos, vhci_seqnum_bucket(vdev->priv_hash, seqnum)) {
+		priv = hlist_entry(pos, struct vhci_priv, hash);
+		if (priv->seqnum == seqnum)
+			return priv;
+	}
+
+	return NULL;
+}
+
 /* get URB from transmitted urb queue. caller must hold vdev->priv_lock */
 struct urb *pickup_urb_and_free_priv(struct vhci_device *vdev, __u32 seqnum)
 {
-	struct vhci_priv *priv, *tmp;
-	struct urb *urb = NULL;
+	struct vhci_priv *priv;
+	struct urb *urb;
 	int status;
 
-	list_for_each_entry_safe(priv, tmp, &vdev->priv_rx, list) {
-		if (priv->seqnum != seqnum)
-			continue;
+	priv = vhci_lookup_priv(vdev, seqnum);
+	if (!priv)
+		return NULL;
 
-		urb = priv->urb;
-		status = urb->status;
+	urb = priv->urb;
+	status = urb->status;
 
-		usbip_dbg_vhci_rx("find urb %p vurb %p seqnum %u\n",
-				urb, priv, seqnum);
-
-		switch (status) {
-		case -ENOENT:
-			/* fall through */
-		case -ECONNRESET:
-			dev_info(&urb->dev->dev,
-				 "urb %p was unlinked %ssynchronuously.\n", urb,
-				 status == -ENOENT ? "" : "a");
-			break;
-		case -EINPROGRESS:
-			/* no info output */
-			break;
-		default:
-			dev_info(&urb->dev->dev,
-				 "urb %p may be in a error, status %d\n", urb,
-				 status);
-		}
-
-		list_del(&priv->list);
-		kfree(priv);
-		urb->hcpriv = NULL;
+	usbip_dbg_vhci_rx("find urb %p vurb %p seqnum %u\n",
+			urb, priv, seqnum);
 
+	switch (status) {
+	case -ENOENT:
+		/* fall through */
+	case -ECONNRESET:
+		dev_info(&urb->dev->dev,
+			 "urb %p was unlinked %ssynchronuously.\n", urb,
+			 status == -ENOENT ? "" : "a");
 		break;
+	case -EINPROGRESS:
+		/* no info output */
+		break;
+	default:
+		dev_info(&urb->dev->dev,
+			 "urb %p may be in a error, status %d\n", urb,
+			 status);
 	}
 
+	vhci_credit_return(vdev, priv);
+	list_del(&priv->list);
+	hlist_del(&priv->hash);
+	kfree(priv);
+	urb->hcpriv = NULL;
+
 	return urb;
 }
 
+/* take the credit window announced in the devid of a reply, if any */
+static void vhci_recv_credit(struct vhci_device *vdev, __u32 devid)
+{
+	int wake;
+
+	if (!(devid & USBIP_CREDIT_VALID))
+		return;
+
+	spin_lock(&vdev->priv_lock);
+	vdev->credit_valid = 1;
+	vdev->credit_urbs = USBIP_CREDIT_URBS(devid);
+	vdev->credit_bytes = (unsigned long) USBIP_CREDIT_UNITS(devid) <<
+		USBIP_CREDIT_UNIT_SHIFT;
+	wake = vdev->credit_held;
+	vdev->credit_held = 0;
+	spin_unlock(&vdev->priv_lock);
+
+	if (wake)
+		usbip_wake_tx(&vdev->ud, &vdev->waitq_tx);
+}
+
 static void vhci_recv_ret_submit(struct vhci_device *vdev,
 				 struct usbip_header *pdu)
 {
@@ -79,8 +115,7 @@ static void vhci_recv_ret_submit(struct vhci_device *vdev,
 
 	if (!urb) {
 		pr_err("cannot find a urb of seqnum %u\n", pdu->base.seqnum);
-		pr_info("max seqnum %d\n",
-			atomic_read(&the_controller->seqnum));
+		pr_info("max seqnum %lu\n", vdev->seqnum);
 		usbip_event_add(ud, VDEV_EVENT_ERROR_TCP);
 		return;
 	}
@@ -102,13 +137,17 @@ static void vhci_recv_ret_submit(struct vhci_device *vdev,
 	if (usbip_dbg_flag_vhci_rx)
 		usbip_dump_urb(urb);
 
+	/* iso urbs may wait in the jitter buffer */
+	if (vhci_iso_hold(vdev, urb))
+		return;
+
 	usbip_dbg_vhci_rx("now giveback urb %p\n", urb);
 
-	spin_lock(&the_controller->lock);
-	usb_hcd_unlink_urb_from_ep(vhci_to_hcd(the_controller), urb);
-	spin_unlock(&the_controller->lock);
+	spin_lock(&vdev->port_lock);
+	usb_hcd_unlink_urb_from_ep(vhci_to_hcd(vdev->vhci), urb);
+	spin_unlock(&vdev->port_lock);
 
-	usb_hcd_giveback_urb(vhci_to_hcd(the_controller), urb, urb->status);
+	usb_hcd_giveback_urb(vhci_to_hcd(vdev->vhci), urb, urb->status);
 
 	usbip_dbg_vhci_rx("Leave\n");
 
@@ -118,16 +157,19 @@ static void vhci_recv_ret_submit(struct vhci_device *vdev,
 static struct vhci_unlink *dequeue_pending_unlink(struct vhci_device *vdev,
 						  struct usbip_header *pdu)
 {
-	struct vhci_unlink *unlink, *tmp;
+	struct hlist_node *pos;
+	struct vhci_unlink *unlink;
 
 	spin_lock(&vdev->priv_lock);
 
-	list_for_each_entry_safe(unlink, tmp, &vdev->unlink_rx, list) {
-		pr_info("unlink->seqnum %lu\n", unlink->seqnum);
+	hlist_for_each(pos, vhci_seqnum_bucket(vdev->unlink_hash,
+					       pdu->base.seqnum)) {
+		unlink = hlist_entry(pos, struct vhci_unlink, hash);
 		if (unlink->seqnum == pdu->base.seqnum) {
 			usbip_dbg_vhci_rx("found pending unlink, %lu\n",
 					  unlink->seqnum);
 			list_del(&unlink->list);
+			hlist_del(&unlink->hash);
 
 			spin_unlock(&vdev->priv_lock);
 			return unlink;
@@ -173,11 +215,11 @@ static void vhci_recv_ret_unlink(struct vhci_device *vdev,
 		urb->status = pdu->u.ret_unlink.status;
 		pr_info("urb->status %d\n", urb->status);
 
-		spin_lock(&the_controller->lock);
-		usb_hcd_unlink_urb_from_ep(vhci_to_hcd(the_controller), urb);
-		spin_unlock(&the_controller->lock);
+		spin_lock(&vdev->port_lock);
+		usb_hcd_unlink_urb_from_ep(vhci_to_hcd(vdev->vhci), urb);
+		spin_unlock(&vdev->port_lock);
 
-		usb_hcd_giveback_urb(vhci_to_hcd(the_controller), urb,
+		usb_hcd_giveback_urb(vhci_to_hcd(vdev->vhci), urb,
 				     urb->status);
 	}
 
@@ -196,7 +238,7 @@ static int vhci_priv_tx_empty(struct vhci_device *vdev)
 }
 
 /* recv a pdu */
-static void vhci_rx_pdu(struct usbip_device *ud)
+void vhci_rx_pdu(struct usbip_device *ud)
 {
 	int ret;
 	struct usbip_header pdu;
@@ -207,7 +249,7 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 	memset(&pdu, 0, sizeof(pdu));
 
 	/* receive a pdu header */
-	ret = usbip_recv(ud->tcp_socket, &pdu, sizeof(pdu));
+	ret = usbip_recv_data(ud, &pdu, sizeof(pdu));
 	if (ret < 0) {
 		if (ret == -ECONNRESET)
 			pr_info("connection reset by peer\n");
@@ -241,9 +283,11 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 
 	switch (pdu.base.command) {
 	case USBIP_RET_SUBMIT:
+		vhci_recv_credit(vdev, pdu.base.devid);
 		vhci_recv_ret_submit(vdev, &pdu);
 		break;
 	case USBIP_RET_UNLINK:
+		vhci_recv_credit(vdev, pdu.base.devid);
 		vhci_recv_ret_unlink(vdev, &pdu);
 		break;
 	default:
@@ -255,6 +299,33 @@ static void vhci_rx_pdu(struct usbip_device *ud)
 	}
 }
 
+/* bytes following the header of pdu, for the shared worker pool */
+int vhci_rx_pdu_size(struct usbip_device *ud, struct usbip_header *pdu)
+{
+	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
+	struct vhci_priv *priv;
+	int size = 0;
+
+	if (pdu->base.command != USBIP_RET_SUBMIT)
+		return 0;
+
+	spin_lock(&vdev->priv_lock);
+	priv = vhci_lookup_priv(vdev, pdu->base.seqnum);
+	if (priv) {
+		struct urb *urb = priv->urb;
+
+		if (usb_pipein(urb->pipe))
+			size += pdu->u.ret_submit.actual_length;
+		if (usb_pipeisoc(urb->pipe) &&
+		    pdu->u.ret_submit.number_of_packets > 0)
+			size += pdu->u.ret_submit.number_of_packets *
+				sizeof(struct usbip_iso_packet_descriptor);
+	}
+	spin_unlock(&vdev->priv_lock);
+
+	return size;
+}
+
 int vhci_rx_loop(void *data)
 {
 	struct usbip_device *ud = data;
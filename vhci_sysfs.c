@@ -19,6 +19,7 @@
 
 #include <linux/kthread.h>
 #include <linux/file.h>
+#include <linux/math64.h>
 #include <linux/net.h>
 
 #include "usbip_common.h"
@@ -26,35 +27,60 @@
 
 /* TODO: refine locking ?*/
 
+/*
+ * The ports of a controller are numbered across its two root hubs: the
+ * first vhci_nports are on the USB 2.0 hub, the next vhci_nports on the
+ * SuperSpeed hub. Returns the hcd of @port and makes @port local to it.
+ */
+static struct vhci_hcd *vhci_port_hcd(struct device *dev, __u32 *port)
+{
+	struct usb_hcd *hcd = dev_get_drvdata(dev);
+
+	if (*port >= vhci_nports) {
+		*port -= vhci_nports;
+		hcd = hcd->shared_hcd;
+	}
+
+	return hcd ? hcd_to_vhci(hcd) : NULL;
+}
+
 /* Sysfs entry to show port status */
 static ssize_t show_status(struct device *dev, struct device_attribute *attr,
 			   char *out)
 {
+	struct vhci_hcd *vhci;
 	char *s = out;
 	int i = 0;
 
-	BUG_ON(!the_controller || !out);
-
-	spin_lock(&the_controller->lock);
+	BUG_ON(!out);
 
 	/*
 	 * output example:
-	 * prt sta spd dev socket           local_busid
-	 * 000 004 000 000         c5a7bb80 1-2.3
-	 * 001 004 000 000         d8cee980 2-3.4
+	 * hub prt sta spd dev socket           local_busid
+	 * hs  000 004 000 000         c5a7bb80 1-2.3
+	 * ss  008 004 000 000         d8cee980 2-3.4
 	 *
 	 * IP address can be retrieved from a socket pointer address by looking
 	 * up /proc/net/{tcp,tcp6}. Also, a userland program may remember a
 	 * port number and its peer IP address.
 	 */
-	out += sprintf(out, "prt sta spd bus dev socket           "
+	out += sprintf(out, "hub prt sta spd bus dev socket           "
 		       "local_busid\n");
 
-	for (i = 0; i < VHCI_NPORTS; i++) {
-		struct vhci_device *vdev = port_to_vdev(i);
+	for (i = 0; i < 2 * vhci_nports; i++) {
+		struct vhci_device *vdev;
+		__u32 rhport = i;
+
+		vhci = vhci_port_hcd(dev, &rhport);
+		if (!vhci)
+			break;
+		vdev = port_to_vdev(vhci, rhport);
 
+		spin_lock(&vhci->lock);
 		spin_lock(&vdev->ud.lock);
-		out += sprintf(out, "%03u %03u ", i, vdev->ud.status);
+		out += sprintf(out, "%s  %03u %03u ",
+			       vhci_to_hcd(vhci)->speed == HCD_USB3 ?
+			       "ss" : "hs", i, vdev->ud.status);
 
 		if (vdev->ud.status == VDEV_ST_USED) {
 			out += sprintf(out, "%03u %08x ",
@@ -68,25 +94,141 @@ static ssize_t show_status(struct device *dev, struct device_attribute *attr,
 
 		out += sprintf(out, "\n");
 		spin_unlock(&vdev->ud.lock);
+		spin_unlock(&vhci->lock);
 	}
 
-	spin_unlock(&the_controller->lock);
-
 	return out - s;
 }
 static DEVICE_ATTR(status, S_IRUGO, show_status, NULL);
 
+/*
+ * Sysfs entry to show, for every port in use and per transfer type, how many
+ * urbs vhci_tx has sent and their total and longest delay from enqueue to
+ * being taken for the socket.
+ *
+ * output example:
+ * 000 ctrl urbs 12 delay_us 40 max_delay_us 9 int urbs ... bulk urbs ...
+ */
+static ssize_t show_tx_stats(struct device *dev, struct device_attribute *attr,
+			     char *out)
+{
+	struct vhci_hcd *vhci;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < 2 * vhci_nports; i++) {
+		struct vhci_device *vdev;
+		__u32 rhport = i;
+
+		vhci = vhci_port_hcd(dev, &rhport);
+		if (!vhci)
+			break;
+		vdev = port_to_vdev(vhci, rhport);
+
+		if (ACCESS_ONCE(vdev->ud.status) != VDEV_ST_USED)
+			continue;
+
+		len += scnprintf(out + len, PAGE_SIZE - len, "%03u", i);
+		len += vhci_tx_stats_show(vdev, out + len, PAGE_SIZE - len);
+		len += scnprintf(out + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+static DEVICE_ATTR(tx_stats, S_IRUGO, show_tx_stats, NULL);
+
+/*
+ * Sysfs entry to show the jitter buffer of every port in use: its latency
+ * in usecs, the iso urbs it has taken, how many it holds now and at most,
+ * and its underruns and overruns; see vhci_iso.c.
+ *
+ * output example:
+ * prt latency urbs held max_held underruns overruns
+ * 000 20000 5120 8 12 1 0
+ */
+static ssize_t show_iso(struct device *dev, struct device_attribute *attr,
+			char *out)
+{
+	struct vhci_hcd *vhci;
+	size_t len;
+	int i;
+
+	len = scnprintf(out, PAGE_SIZE, "prt latency urbs held max_held "
+			"underruns overruns\n");
+
+	for (i = 0; i < 2 * vhci_nports; i++) {
+		struct vhci_device *vdev;
+		__u32 rhport = i;
+
+		vhci = vhci_port_hcd(dev, &rhport);
+		if (!vhci)
+			break;
+		vdev = port_to_vdev(vhci, rhport);
+
+		if (ACCESS_ONCE(vdev->ud.status) != VDEV_ST_USED)
+			continue;
+
+		len += scnprintf(out + len, PAGE_SIZE - len, "%03u ", i);
+		len += vhci_iso_show(vdev, out + len, PAGE_SIZE - len);
+		len += scnprintf(out + len, PAGE_SIZE - len, "\n");
+	}
+
+	return len;
+}
+
+/*
+ * Sysfs entry to set the jitter buffer latency of a port until it is
+ * detached; 0 gives iso urbs back on arrival.
+ *
+ * @rhport: port number of this vhci_hcd, see vhci_port_hcd()
+ * @latency: usecs
+ */
+static ssize_t store_iso(struct device *dev, struct device_attribute *attr,
+			 const char *buf, size_t count)
+{
+	struct vhci_hcd *vhci;
+	struct vhci_device *vdev;
+	__u32 rhport;
+	unsigned int latency;
+
+	if (sscanf(buf, "%u %u", &rhport, &latency) != 2)
+		return -EINVAL;
+
+	if (rhport >= 2 * vhci_nports)
+		return -EINVAL;
+
+	vhci = vhci_port_hcd(dev, &rhport);
+	if (!vhci)
+		return -EINVAL;
+	vdev = port_to_vdev(vhci, rhport);
+
+	spin_lock(&vdev->port_lock);
+	vdev->iso_latency = latency;
+	spin_unlock(&vdev->port_lock);
+
+	return count;
+}
+static DEVICE_ATTR(iso, S_IRUGO | S_IWUSR, show_iso, store_iso);
+
+/* Sysfs entry to show the number of ports of each root hub */
+static ssize_t show_nports(struct device *dev, struct device_attribute *attr,
+			   char *out)
+{
+	return sprintf(out, "%u\n", vhci_nports);
+}
+static DEVICE_ATTR(nports, S_IRUGO, show_nports, NULL);
+
 /* Sysfs entry to shutdown a virtual connection */
-static int vhci_port_disconnect(__u32 rhport)
+static int vhci_port_disconnect(struct vhci_hcd *vhci, __u32 rhport)
 {
 	struct vhci_device *vdev;
 
 	usbip_dbg_vhci_sysfs("enter\n");
 
 	/* lock */
-	spin_lock(&the_controller->lock);
+	spin_lock(&vhci->lock);
 
-	vdev = port_to_vdev(rhport);
+	vdev = port_to_vdev(vhci, rhport);
 
 	spin_lock(&vdev->ud.lock);
 	if (vdev->ud.status == VDEV_ST_NULL) {
@@ -94,14 +236,14 @@ static int vhci_port_disconnect(__u32 rhport)
 
 		/* unlock */
 		spin_unlock(&vdev->ud.lock);
-		spin_unlock(&the_controller->lock);
+		spin_unlock(&vhci->lock);
 
 		return -EINVAL;
 	}
 
 	/* unlock */
 	spin_unlock(&vdev->ud.lock);
-	spin_unlock(&the_controller->lock);
+	spin_unlock(&vhci->lock);
 
 	usbip_event_add(&vdev->ud, VDEV_EVENT_DOWN);
 
@@ -111,18 +253,20 @@ static int vhci_port_disconnect(__u32 rhport)
 static ssize_t store_detach(struct device *dev, struct device_attribute *attr,
 			    const char *buf, size_t count)
 {
+	struct vhci_hcd *vhci;
 	int err;
 	__u32 rhport = 0;
 
 	sscanf(buf, "%u", &rhport);
 
 	/* check rhport */
-	if (rhport >= VHCI_NPORTS) {
+	vhci = vhci_port_hcd(dev, &rhport);
+	if (!vhci || rhport >= vhci_nports) {
 		dev_err(dev, "invalid port %u\n", rhport);
 		return -EINVAL;
 	}
 
-	err = vhci_port_disconnect(rhport);
+	err = vhci_port_disconnect(vhci, rhport);
 	if (err < 0)
 		return -EINVAL;
 
@@ -133,20 +277,31 @@ static ssize_t store_detach(struct device *dev, struct device_attribute *attr,
 static DEVICE_ATTR(detach, S_IWUSR, NULL, store_detach);
 
 /* Sysfs entry to establish a virtual connection */
-static int valid_args(__u32 rhport, enum usb_device_speed speed)
+static int valid_args(struct vhci_hcd *vhci, __u32 rhport,
+		      enum usb_device_speed speed)
 {
 	/* check rhport */
-	if (rhport >= VHCI_NPORTS) {
+	if (!vhci || rhport >= vhci_nports) {
 		pr_err("port %u\n", rhport);
 		return -EINVAL;
 	}
 
-	/* check speed */
+	/* check speed, which must match the root hub of the port */
 	switch (speed) {
 	case USB_SPEED_LOW:
 	case USB_SPEED_FULL:
 	case USB_SPEED_HIGH:
 	case USB_SPEED_WIRELESS:
+		if (vhci_to_hcd(vhci)->speed == HCD_USB3) {
+			pr_err("speed %d on a SuperSpeed port\n", speed);
+			return -EINVAL;
+		}
+		break;
+	case USB_SPEED_SUPER:
+		if (vhci_to_hcd(vhci)->speed != HCD_USB3) {
+			pr_err("speed %d on a USB 2.0 port\n", speed);
+			return -EINVAL;
+		}
 		break;
 	default:
 		pr_err("speed %d\n", speed);
@@ -170,24 +325,39 @@ static int valid_args(__u32 rhport, enum usb_device_speed speed)
 static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 			    const char *buf, size_t count)
 {
+	struct vhci_hcd *vhci;
 	struct vhci_device *vdev;
 	struct socket *socket;
 	int sockfd = 0;
-	__u32 rhport = 0, devid = 0, speed = 0;
+	__u32 rhport = 0, devid = 0, speed = 0, rx_mode = USBIP_RX_RECVMSG;
+	__u32 desc_len = 0;
 
 	/*
-	 * @rhport: port number of vhci_hcd
+	 * @rhport: port number of this vhci_hcd, see vhci_port_hcd()
 	 * @sockfd: socket descriptor of an established TCP connection
 	 * @devid: unique device identifier in a remote host
 	 * @speed: usb device speed in a remote host
+	 * @rx_mode: optional receive engine (USBIP_RX_*), recvmsg by default
+	 * @desc_len: optional length of the descriptor bundle written to the
+	 *	      slot of the port in descriptors, 0 if none
 	 */
-	sscanf(buf, "%u %u %u %u", &rhport, &sockfd, &devid, &speed);
+	sscanf(buf, "%u %u %u %u %u %u", &rhport, &sockfd, &devid, &speed,
+	       &rx_mode, &desc_len);
 
-	usbip_dbg_vhci_sysfs("rhport(%u) sockfd(%u) devid(%u) speed(%u)\n",
-			     rhport, sockfd, devid, speed);
+	usbip_dbg_vhci_sysfs("rhport(%u) sockfd(%u) devid(%u) speed(%u) "
+			     "rx_mode(%u) desc_len(%u)\n",
+			     rhport, sockfd, devid, speed, rx_mode, desc_len);
 
 	/* check received parameters */
-	if (valid_args(rhport, speed) < 0)
+	vhci = vhci_port_hcd(dev, &rhport);
+	if (valid_args(vhci, rhport, speed) < 0)
+		return -EINVAL;
+
+	if (rx_mode != USBIP_RX_RECVMSG && rx_mode != USBIP_RX_READSOCK)
+		return -EINVAL;
+
+	/* fails for a port in use, as below */
+	if (vhci_desc_enable(port_to_vdev(vhci, rhport), desc_len) < 0)
 		return -EINVAL;
 
 	/* Extract socket from fd. */
@@ -199,14 +369,14 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 	/* now need lock until setting vdev status as used */
 
 	/* begin a lock */
-	spin_lock(&the_controller->lock);
-	vdev = port_to_vdev(rhport);
+	spin_lock(&vhci->lock);
+	vdev = port_to_vdev(vhci, rhport);
 	spin_lock(&vdev->ud.lock);
 
 	if (vdev->ud.status != VDEV_ST_NULL) {
 		/* end of the lock */
 		spin_unlock(&vdev->ud.lock);
-		spin_unlock(&the_controller->lock);
+		spin_unlock(&vhci->lock);
 
 		fput(socket->file);
 
@@ -220,23 +390,65 @@ static ssize_t store_attach(struct device *dev, struct device_attribute *attr,
 	vdev->devid         = devid;
 	vdev->speed         = speed;
 	vdev->ud.tcp_socket = socket;
+	vdev->ud.rx_mode    = rx_mode;
 	vdev->ud.status     = VDEV_ST_NOTASSIGNED;
 
 	spin_unlock(&vdev->ud.lock);
-	spin_unlock(&the_controller->lock);
+	spin_unlock(&vhci->lock);
 	/* end the lock */
 
-	vdev->ud.tcp_rx = kthread_get_run(vhci_rx_loop, &vdev->ud, "vhci_rx");
-	vdev->ud.tcp_tx = kthread_get_run(vhci_tx_loop, &vdev->ud, "vhci_tx");
+	usbip_rx_start(&vdev->ud);
 
-	rh_port_connect(rhport, speed);
+	if (vdev->ud.use_wq) {
+		usbip_wq_start(&vdev->ud);
+	} else {
+		vdev->ud.tcp_rx = kthread_get_run(vhci_rx_loop, &vdev->ud,
+						  "vhci_rx");
+		vdev->ud.tcp_tx = kthread_get_run(vhci_tx_loop, &vdev->ud,
+						  "vhci_tx");
+	}
+
+	rh_port_connect(vdev, speed);
 
 	return count;
 }
 static DEVICE_ATTR(attach, S_IWUSR, NULL, store_attach);
 
+/*
+ * Sysfs entry to preload the descriptor bundle of a port before attaching
+ * it (see vhci_desc.c). Every port has a slot of VHCI_DESC_MAX bytes at
+ * offset rhport * VHCI_DESC_MAX, numbered like in attach; the bundle is
+ * written from the start of the slot, and attach is then given its length.
+ */
+static ssize_t write_descriptors(struct file *file, struct kobject *kobj,
+				 struct bin_attribute *attr, char *buf,
+				 loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct vhci_hcd *vhci;
+	__u32 rhport = div_u64(off, VHCI_DESC_MAX);
+	size_t pos = off - (loff_t) rhport * VHCI_DESC_MAX;
+
+	if (rhport >= 2 * vhci_nports)
+		return -EINVAL;
+
+	vhci = vhci_port_hcd(dev, &rhport);
+	if (!vhci)
+		return -EINVAL;
+
+	return vhci_desc_write(port_to_vdev(vhci, rhport), buf, pos, count);
+}
+
+struct bin_attribute dev_attr_descriptors = {
+	.attr = { .name = "descriptors", .mode = S_IWUSR },
+	.write = write_descriptors,
+};
+
 static struct attribute *dev_attrs[] = {
 	&dev_attr_status.attr,
+	&dev_attr_nports.attr,
+	&dev_attr_tx_stats.attr,
+	&dev_attr_iso.attr,
 	&dev_attr_detach.attr,
 	&dev_attr_attach.attr,
 	&dev_attr_usbip_debug.attr,
@@ -17,8 +17,11 @@
  * USA.
  */
 
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
+#include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/version.h>
 
 #include "usbip_common.h"
 #include "vhci.h"
@@ -44,93 +47,233 @@ static void setup_cmd_submit_pdu(struct usbip_header *pdup,  struct urb *urb)
 		memcpy(pdup->u.cmd_submit.setup, urb->setup_packet, 8);
 }
 
-static struct vhci_priv *dequeue_from_priv_tx(struct vhci_device *vdev)
+/*
+ * Whether urb fits in the credit window of the peer. Caller must hold
+ * vdev->priv_lock. With nothing outstanding, a request is always sent.
+ */
+static int vhci_credit_fits(struct vhci_device *vdev, struct urb *urb)
 {
-	struct vhci_priv *priv, *tmp;
+	if (!vdev->credit_valid || !vdev->sent_urbs)
+		return 1;
 
-	spin_lock(&vdev->priv_lock);
+	if (vdev->credit_urbs != USBIP_CREDIT_URBS_MAX &&
+	    vdev->sent_urbs >= vdev->credit_urbs)
+		return 0;
 
-	list_for_each_entry_safe(priv, tmp, &vdev->priv_tx, list) {
-		list_move_tail(&priv->list, &vdev->priv_rx);
-		spin_unlock(&vdev->priv_lock);
-		return priv;
+	if (vdev->credit_bytes != ((unsigned long) USBIP_CREDIT_UNITS_MAX <<
+				   USBIP_CREDIT_UNIT_SHIFT) &&
+	    vdev->sent_bytes + urb->transfer_buffer_length > vdev->credit_bytes)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * A request leaves priv_rx, so its credits are available again. Caller
+ * must hold vdev->priv_lock.
+ */
+void vhci_credit_return(struct vhci_device *vdev, struct vhci_priv *priv)
+{
+	if (!priv->sent)
+		return;
+
+	priv->sent = 0;
+	vdev->sent_urbs--;
+	vdev->sent_bytes -= priv->sent_len;
+
+	if (vdev->credit_held) {
+		vdev->credit_held = 0;
+		usbip_wake_tx(&vdev->ud, &vdev->waitq_tx);
 	}
+}
 
-	spin_unlock(&vdev->priv_lock);
+/*
+ * The next urb vhci_tx should send: the oldest one of the highest non-empty
+ * priv_tx queue. Bulk endpoints take turns, so that a long write to one of
+ * them does not hold back the others; an endpoint keeps its own order.
+ * Caller must hold vdev->priv_lock.
+ */
+static struct vhci_priv *vhci_tx_pick(struct vhci_device *vdev)
+{
+	struct list_head *bulk = &vdev->priv_tx[VHCI_TX_Q_BULK];
+	struct vhci_priv *priv;
+	int q;
 
-	return NULL;
+	for (q = 0; q < VHCI_TX_Q_BULK; q++)
+		if (!list_empty(&vdev->priv_tx[q]))
+			return list_first_entry(&vdev->priv_tx[q],
+						struct vhci_priv, list);
+
+	list_for_each_entry(priv, bulk, list)
+		if (vhci_tx_ep(priv->urb) != vdev->tx_bulk_ep)
+			return priv;
+
+	if (list_empty(bulk))
+		return NULL;
+
+	return list_first_entry(bulk, struct vhci_priv, list);
 }
 
-static int vhci_send_cmd_submit(struct vhci_device *vdev)
+static void vhci_tx_account(struct vhci_device *vdev, struct vhci_priv *priv)
 {
-	struct vhci_priv *priv = NULL;
+	struct vhci_tx_stats *stats = &vdev->tx_stats[priv->tx_queue];
+	s64 us = ktime_us_delta(ktime_get(), priv->queued);
 
-	struct msghdr msg;
-	struct kvec iov[3];
-	size_t txsize;
+	if (us < 0)
+		us = 0;
 
-	size_t total_size = 0;
+	stats->urbs++;
+	stats->delay_us += us;
+	if (us > stats->max_delay_us)
+		stats->max_delay_us = us;
+}
 
-	while ((priv = dequeue_from_priv_tx(vdev)) != NULL) {
-		int ret;
-		struct urb *urb = priv->urb;
-		struct usbip_header pdu_header;
-		struct usbip_iso_packet_descriptor *iso_buffer = NULL;
+static struct vhci_priv *dequeue_from_priv_tx(struct vhci_device *vdev)
+{
+	struct vhci_priv *priv;
 
-		txsize = 0;
-		memset(&pdu_header, 0, sizeof(pdu_header));
-		memset(&msg, 0, sizeof(msg));
-		memset(&iov, 0, sizeof(iov));
+	spin_lock(&vdev->priv_lock);
 
-		usbip_dbg_vhci_tx("setup txdata urb %p\n", urb);
+	priv = vhci_tx_pick(vdev);
+	if (!priv)
+		goto out;
 
-		/* 1. setup usbip_header */
-		setup_cmd_submit_pdu(&pdu_header, urb);
-		usbip_header_correct_endian(&pdu_header, 1);
+	if (!vhci_credit_fits(vdev, priv->urb)) {
+		vdev->credit_held = 1;
+		priv = NULL;
+		goto out;
+	}
 
-		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+	priv->sent = 1;
+	priv->sent_len = priv->urb->transfer_buffer_length;
+	vdev->sent_urbs++;
+	vdev->sent_bytes += priv->sent_len;
 
-		/* 2. setup transfer buffer */
-		if (!usb_pipein(urb->pipe) && urb->transfer_buffer_length > 0) {
-			iov[1].iov_base = urb->transfer_buffer;
-			iov[1].iov_len  = urb->transfer_buffer_length;
-			txsize += urb->transfer_buffer_length;
-		}
+	if (priv->tx_queue == VHCI_TX_Q_BULK)
+		vdev->tx_bulk_ep = vhci_tx_ep(priv->urb);
+	vhci_tx_account(vdev, priv);
 
-		/* 3. setup iso_packet_descriptor */
-		if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
-			ssize_t len = 0;
+	list_move_tail(&priv->list, &vdev->priv_rx);
+	hlist_add_head(&priv->hash,
+		       vhci_seqnum_bucket(vdev->priv_hash, priv->seqnum));
 
-			iso_buffer = usbip_alloc_iso_desc_pdu(urb, &len);
-			if (!iso_buffer) {
-				usbip_event_add(&vdev->ud,
-						SDEV_EVENT_ERROR_MALLOC);
-				return -1;
-			}
+out:
+	spin_unlock(&vdev->priv_lock);
 
-			iov[2].iov_base = iso_buffer;
-			iov[2].iov_len  = len;
-			txsize += len;
-		}
+	return priv;
+}
+
+ssize_t vhci_tx_stats_show(struct vhci_device *vdev, char *buf, size_t size)
+{
+	static const char * const names[VHCI_TX_QUEUES] = {
+		[VHCI_TX_Q_CTRL] = "ctrl",
+		[VHCI_TX_Q_INT]  = "int",
+		[VHCI_TX_Q_ISOC] = "isoc",
+		[VHCI_TX_Q_BULK] = "bulk",
+	};
+	size_t len = 0;
+	int q;
+
+	spin_lock(&vdev->priv_lock);
+	for (q = 0; q < VHCI_TX_QUEUES; q++) {
+		struct vhci_tx_stats *stats = &vdev->tx_stats[q];
+
+		len += scnprintf(buf + len, size - len,
+				 " %s urbs %lu delay_us %llu max_delay_us %u",
+				 names[q], stats->urbs, stats->delay_us,
+				 stats->max_delay_us);
+	}
+	spin_unlock(&vdev->priv_lock);
+
+	return len;
+}
+
+/* flush policy of vhci_tx, shared by all ports and read once per pass */
+static unsigned int tx_max_bytes = VHCI_TX_MAX_BYTES;
+module_param(tx_max_bytes, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_max_bytes, "bytes gathered before a tx batch is sent "
+		 "(0: no limit)");
+
+static unsigned int tx_max_urbs = VHCI_TX_MAX_URBS;
+module_param(tx_max_urbs, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_max_urbs, "pdus gathered before a tx batch is sent "
+		 "(0: no limit)");
+
+static unsigned int tx_max_delay = VHCI_TX_MAX_DELAY;
+module_param(tx_max_delay, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_max_delay, "usecs a tx batch may wait for more bulk "
+		 "or isochronous urbs (0: send at once)");
+
+/*
+ * Bulk OUT bytes batched in a row before the other queues are looked at
+ * again. A single payload is never split because it must follow its
+ * CMD_SUBMIT header on the wire.
+ */
+static unsigned int tx_bulk_quantum = VHCI_TX_BULK_QUANTUM;
+module_param(tx_bulk_quantum, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(tx_bulk_quantum, "bulk OUT bytes sent in a row ahead of "
+		 "newer control and interrupt urbs (0: no limit)");
+
+/* queue the CMD_SUBMIT pdu of an urb into the tx batch */
+static int vhci_queue_cmd_submit(struct vhci_device *vdev,
+				 struct vhci_priv *priv)
+{
+	struct usbip_xmit_batch *batch = &vdev->tx_batch;
+	struct urb *urb = priv->urb;
+	struct usbip_header *pdu_header;
+	struct usbip_iso_packet_descriptor *iso_buffer;
+	size_t len;
+
+	usbip_dbg_vhci_tx("setup txdata urb %p\n", urb);
+
+	/* 1. setup usbip_header */
+	pdu_header = usbip_xmit_batch_scratch(batch, sizeof(*pdu_header));
+	if (!pdu_header)
+		return -1;
+
+	memset(pdu_header, 0, sizeof(*pdu_header));
+	setup_cmd_submit_pdu(pdu_header, urb);
+	usbip_header_correct_endian(pdu_header, 1);
+
+	if (usbip_xmit_batch_add(batch, pdu_header, sizeof(*pdu_header)) < 0)
+		return -1;
+
+	/*
+	 * 2. setup transfer buffer
+	 *
+	 * The urb is given back once the peer has answered, i.e. after it
+	 * has received the payload, or after the connection is gone, when
+	 * vhci_shutdown_connection() has aborted whatever was left unsent
+	 * with usbip_xmit_abort(). So large buffers may be sent by reference.
+	 */
+	if (!usb_pipein(urb->pipe) && urb->transfer_buffer_length > 0 &&
+	    urb->num_sgs && !urb->transfer_buffer) {
+		if (usbip_xmit_batch_add_sg(batch, urb->sg, urb->num_sgs,
+					    urb->transfer_buffer_length) < 0)
+			return -1;
+	} else if (!usb_pipein(urb->pipe) && urb->transfer_buffer_length > 0) {
+		if (usbip_xmit_batch_add_buf(batch, urb->transfer_buffer,
+					     urb->transfer_buffer_length) < 0)
+			return -1;
+	}
 
-		ret = kernel_sendmsg(vdev->ud.tcp_socket, &msg, iov, 3, txsize);
-		if (ret != txsize) {
-			pr_err("sendmsg failed!, ret=%d for %zd\n", ret,
-			       txsize);
-			kfree(iso_buffer);
-			usbip_event_add(&vdev->ud, VDEV_EVENT_ERROR_TCP);
+	/* 3. setup iso_packet_descriptor */
+	if (usb_pipetype(urb->pipe) == PIPE_ISOCHRONOUS) {
+		len = urb->number_of_packets * sizeof(*iso_buffer);
+
+		iso_buffer = usbip_xmit_batch_scratch(batch, len);
+		if (!iso_buffer)
 			return -1;
-		}
 
-		kfree(iso_buffer);
-		usbip_dbg_vhci_tx("send txdata\n");
+		usbip_fill_iso_desc_pdu(urb, iso_buffer);
 
-		total_size += txsize;
+		if (usbip_xmit_batch_add(batch, iso_buffer, len) < 0)
+			return -1;
 	}
 
-	return total_size;
+	batch->count++;
+
+	return 0;
 }
 
 static struct vhci_unlink *dequeue_from_unlink_tx(struct vhci_device *vdev)
@@ -141,6 +284,9 @@ static struct vhci_unlink *dequeue_from_unlink_tx(struct vhci_device *vdev)
 
 	list_for_each_entry_safe(unlink, tmp, &vdev->unlink_tx, list) {
 		list_move_tail(&unlink->list, &vdev->unlink_rx);
+		hlist_add_head(&unlink->hash,
+			       vhci_seqnum_bucket(vdev->unlink_hash,
+						  unlink->seqnum));
 		spin_unlock(&vdev->priv_lock);
 		return unlink;
 	}
@@ -150,54 +296,165 @@ static struct vhci_unlink *dequeue_from_unlink_tx(struct vhci_device *vdev)
 	return NULL;
 }
 
-static int vhci_send_cmd_unlink(struct vhci_device *vdev)
+/* queue a CMD_UNLINK pdu into the tx batch */
+static int vhci_queue_cmd_unlink(struct vhci_device *vdev,
+				 struct vhci_unlink *unlink)
 {
-	struct vhci_unlink *unlink = NULL;
+	struct usbip_xmit_batch *batch = &vdev->tx_batch;
+	struct usbip_header *pdu_header;
 
-	struct msghdr msg;
-	struct kvec iov[3];
-	size_t txsize;
+	usbip_dbg_vhci_tx("setup cmd unlink, %lu\n", unlink->seqnum);
 
-	size_t total_size = 0;
+	pdu_header = usbip_xmit_batch_scratch(batch, sizeof(*pdu_header));
+	if (!pdu_header)
+		return -1;
+
+	memset(pdu_header, 0, sizeof(*pdu_header));
+	pdu_header->base.command = USBIP_CMD_UNLINK;
+	pdu_header->base.seqnum  = unlink->seqnum;
+	pdu_header->base.devid   = vdev->devid;
+	pdu_header->base.ep      = 0;
+	pdu_header->u.cmd_unlink.seqnum = unlink->unlink_seqnum;
 
-	while ((unlink = dequeue_from_unlink_tx(vdev)) != NULL) {
-		int ret;
-		struct usbip_header pdu_header;
+	usbip_header_correct_endian(pdu_header, 1);
 
-		txsize = 0;
-		memset(&pdu_header, 0, sizeof(pdu_header));
-		memset(&msg, 0, sizeof(msg));
-		memset(&iov, 0, sizeof(iov));
+	if (usbip_xmit_batch_add(batch, pdu_header, sizeof(*pdu_header)) < 0)
+		return -1;
 
-		usbip_dbg_vhci_tx("setup cmd unlink, %lu\n", unlink->seqnum);
+	batch->count++;
 
-		/* 1. setup usbip_header */
-		pdu_header.base.command = USBIP_CMD_UNLINK;
-		pdu_header.base.seqnum  = unlink->seqnum;
-		pdu_header.base.devid	= vdev->devid;
-		pdu_header.base.ep	= 0;
-		pdu_header.u.cmd_unlink.seqnum = unlink->unlink_seqnum;
+	return 0;
+}
 
-		usbip_header_correct_endian(&pdu_header, 1);
+static int vhci_tx_pending(struct vhci_device *vdev)
+{
+	int q;
 
-		iov[0].iov_base = &pdu_header;
-		iov[0].iov_len  = sizeof(pdu_header);
-		txsize += sizeof(pdu_header);
+	if (!list_empty(&vdev->unlink_tx))
+		return 1;
 
-		ret = kernel_sendmsg(vdev->ud.tcp_socket, &msg, iov, 1, txsize);
-		if (ret != txsize) {
-			pr_err("sendmsg failed!, ret=%d for %zd\n", ret,
-			       txsize);
-			usbip_event_add(&vdev->ud, VDEV_EVENT_ERROR_TCP);
-			return -1;
+	if (vdev->credit_held)
+		return 0;
+
+	for (q = 0; q < VHCI_TX_QUEUES; q++)
+		if (!list_empty(&vdev->priv_tx[q]))
+			return 1;
+
+	return 0;
+}
+
+static void vhci_tx_linger(struct vhci_device *vdev, ktime_t deadline)
+{
+	ktime_t timeout = ktime_sub(deadline, ktime_get());
+
+	if (ktime_to_ns(timeout) <= 0)
+		return;
+
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0))
+	wait_event_interruptible_hrtimeout(vdev->waitq_tx,
+					   (vhci_tx_pending(vdev) ||
+					    kthread_should_stop()),
+					   timeout);
+#else
+	wait_event_interruptible_timeout(vdev->waitq_tx,
+					 (vhci_tx_pending(vdev) ||
+					  kthread_should_stop()),
+					 usecs_to_jiffies(ktime_to_us(timeout)));
+#endif
+}
+
+/*
+ * vhci_send_batch - send pending CMD_SUBMITs and CMD_UNLINKs
+ *
+ * Drains unlink_tx and the priv_tx queues into the tx batch of the port and
+ * pushes it to the socket with as few kernel_sendmsg() calls as the flush
+ * policy allows. The queues are looked at again before every pdu, so
+ * CMD_UNLINKs go first, then control, interrupt, iso and bulk urbs; a
+ * CMD_UNLINK may overtake any CMD_SUBMIT since its target has been taken
+ * already. At most tx_bulk_quantum bytes of bulk OUT data are batched
+ * before a flush, which bounds how long a newer urgent urb waits behind
+ * them. A batch holding an urgent pdu is never held back by tx_max_delay.
+ */
+static int vhci_send_batch(struct vhci_device *vdev)
+{
+	struct usbip_xmit_batch *batch = &vdev->tx_batch;
+	struct usbip_xmit_policy policy;
+	unsigned int quantum = ACCESS_ONCE(tx_bulk_quantum);
+	struct vhci_priv *priv;
+	struct vhci_unlink *unlink;
+	ktime_t deadline = ktime_set(0, 0);
+	size_t total_size = 0;
+	size_t bulk_size = 0;
+	int urgent = 0;
+
+	policy.max_bytes = ACCESS_ONCE(tx_max_bytes);
+	policy.max_urbs  = ACCESS_ONCE(tx_max_urbs);
+	policy.max_delay = ACCESS_ONCE(tx_max_delay);
+
+	for (;;) {
+		unlink = dequeue_from_unlink_tx(vdev);
+		priv = unlink ? NULL : dequeue_from_priv_tx(vdev);
+
+		if (unlink || priv) {
+			if (!batch->count)
+				deadline = ktime_add_us(ktime_get(),
+							policy.max_delay);
+
+			if (unlink) {
+				if (vhci_queue_cmd_unlink(vdev, unlink) < 0)
+					goto err;
+				/* the target is waiting for its reply */
+				urgent = 1;
+			} else {
+				/* priv may be gone once its pdu is out */
+				int q = priv->tx_queue;
+				size_t out = usb_pipein(priv->urb->pipe) ?
+					0 : priv->sent_len;
+
+				if (vhci_queue_cmd_submit(vdev, priv) < 0)
+					goto err;
+				if (q == VHCI_TX_Q_BULK)
+					bulk_size += out;
+				else if (q != VHCI_TX_Q_ISOC)
+					urgent = 1;
+			}
+
+			if (!usbip_xmit_batch_full(batch, &policy) &&
+			    !(quantum && bulk_size >= quantum))
+				continue;
+
+			total_size += batch->size;
+			if (usbip_xmit_batch_flush(batch, 1) < 0)
+				goto err;
+			bulk_size = 0;
+			urgent = 0;
+			continue;
 		}
 
-		usbip_dbg_vhci_tx("send txdata\n");
+		if (!batch->count)
+			break;
 
-		total_size += txsize;
+		/* linger for more requests if allowed to */
+		if (policy.max_delay && !urgent && !kthread_should_stop()) {
+			vhci_tx_linger(vdev, deadline);
+			if (vhci_tx_pending(vdev))
+				continue;
+		}
+		break;
 	}
 
+	total_size += batch->size;
+	if (usbip_xmit_batch_flush(batch, 0) < 0)
+		goto err;
+
+	usbip_dbg_vhci_tx("send %zd bytes\n", total_size);
+
 	return total_size;
+
+err:
+	/* the requests taken stay on priv_rx and unlink_rx for cleanup */
+	usbip_xmit_batch_reset(batch);
+	return -1;
 }
 
 int vhci_tx_loop(void *data)
@@ -206,15 +463,11 @@ int vhci_tx_loop(void *data)
 	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
 
 	while (!kthread_should_stop()) {
-		if (vhci_send_cmd_submit(vdev) < 0)
-			break;
-
-		if (vhci_send_cmd_unlink(vdev) < 0)
+		if (vhci_send_batch(vdev) < 0)
 			break;
 
 		wait_event_interruptible(vdev->waitq_tx,
-					 (!list_empty(&vdev->priv_tx) ||
-					  !list_empty(&vdev->unlink_tx) ||
+					 (vhci_tx_pending(vdev) ||
 					  kthread_should_stop()));
 
 		usbip_dbg_vhci_tx("pending urbs ?, now wake up\n");
@@ -222,3 +475,11 @@ int vhci_tx_loop(void *data)
 
 	return 0;
 }
+
+/* one run of the tx side on the shared worker pool */
+void vhci_tx_work(struct usbip_device *ud)
+{
+	struct vhci_device *vdev = container_of(ud, struct vhci_device, ud);
+
+	vhci_send_batch(vdev);
+}